@@ -0,0 +1,52 @@
+#include "dfi-delta.h"
+
+/* Updates DIRECTORY/index.cache using a delta written by 'compile
+ * --delta'.  The new file replaces the old one atomically, so readers
+ * that still have the old one mapped are not disturbed.
+ */
+int
+main (int argc, char **argv)
+{
+  GError *error = NULL;
+  gchar *old_data;
+  gchar *delta;
+  gsize old_size;
+  gsize delta_size;
+  gchar *filename;
+  GString *result;
+
+  if (argc != 3)
+    {
+      g_printerr ("usage: %s DIRECTORY DELTA\n", argv[0]);
+      return 1;
+    }
+
+  filename = g_build_filename (argv[1], "index.cache", NULL);
+
+  if (!g_file_get_contents (filename, &old_data, &old_size, &error) ||
+      !g_file_get_contents (argv[2], &delta, &delta_size, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  result = dfi_delta_apply (old_data, old_size, delta, delta_size);
+  if (result == NULL)
+    {
+      g_printerr ("%s: delta does not apply to %s\n", argv[2], filename);
+      return 1;
+    }
+
+  if (!g_file_set_contents (filename, result->str, result->len, &error))
+    {
+      g_printerr ("%s\n", error->message);
+      return 1;
+    }
+
+  g_string_free (result, TRUE);
+  g_free (old_data);
+  g_free (delta);
+  g_free (filename);
+
+  return 0;
+}
@@ -0,0 +1,106 @@
+#!/bin/sh
+#
+# Builds the cache twice from copies of the same desktop files that
+# were created in opposite orders (so that readdir gives them in
+# different orders, on most filesystems) and checks that the output is
+# byte-for-byte identical for each layout.  Deltas rely on this.  Then
+# does the same for builds in the C locale and in another installed
+# one, since the output mustn't depend on the environment either.
+#
+# usage: check-reproducible.sh [DIRECTORY]
+#
+# DIRECTORY defaults to /usr/share/applications.  Set COMPILE to use a
+# compile binary other than the one in the current directory.
+
+set -e
+
+source_dir=${1:-/usr/share/applications}
+compile=${COMPILE:-$(pwd)/compile}
+
+# tmpfs lists files newest first, so prefer it
+tmp=$(mktemp -d -p /dev/shm 2> /dev/null || mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+mkdir "$tmp/a" "$tmp/b"
+
+ls "$source_dir" | grep '\.desktop$' > "$tmp/names"
+if [ ! -s "$tmp/names" ]; then
+  echo "no desktop files in $source_dir" >&2
+  exit 1
+fi
+
+for name in $(cat "$tmp/names"); do
+  cp "$source_dir/$name" "$tmp/a/"
+done
+
+for name in $(sort -r "$tmp/names"); do
+  cp "$source_dir/$name" "$tmp/b/"
+done
+
+if [ "$(ls -f "$tmp/a" | grep '\.desktop$')" = "$(ls -f "$tmp/b" | grep '\.desktop$')" ]; then
+  echo "warning: readdir order doesn't follow creation order here; only checking that builds repeat" >&2
+fi
+
+# A profile with some ties, to check that hot items are ordered stably
+head -n 3 "$tmp/names" | while read name; do
+  echo "app $name 5"
+done > "$tmp/profile"
+echo "locale fr 2" >> "$tmp/profile"
+echo "locale de 2" >> "$tmp/profile"
+echo "key Name 7" >> "$tmp/profile"
+echo "key Exec 7" >> "$tmp/profile"
+
+status=0
+
+compare ()
+{
+  if ! diff -r "$tmp/out-$1-a" "$tmp/out-$1-b" > /dev/null; then
+    echo "FAIL: $1: $2"
+    status=1
+  else
+    echo "PASS: $1"
+  fi
+}
+
+check ()
+{
+  layout=$1
+  shift
+
+  for copy in a b; do
+    mkdir "$tmp/out-$layout-$copy"
+    (cd "$tmp/out-$layout-$copy" && "$compile" "$@" "$tmp/$copy" > /dev/null)
+  done
+
+  compare $layout "output depends on the order of the desktop files"
+}
+
+check_locale ()
+{
+  mkdir "$tmp/out-locale-a" "$tmp/out-locale-b"
+  (cd "$tmp/out-locale-a" && LC_ALL=C "$compile" "$tmp/a" > /dev/null)
+  (cd "$tmp/out-locale-b" && LC_ALL=$1 "$compile" "$tmp/a" > /dev/null)
+
+  compare locale "output depends on the locale of the build ($1)"
+}
+
+check default
+check split-locales --split-locales
+check profile --profile "$tmp/profile"
+check split-profile --split-locales --profile "$tmp/profile"
+check front-coded --front-coded
+check overlays --overlays
+
+# Prefer a locale with real collation rules to C.UTF-8
+other_locale=$(locale -a 2> /dev/null | grep -i 'utf-*8$' | sort | grep -v '^C\.' | head -n 1)
+if [ -z "$other_locale" ]; then
+  other_locale=$(locale -a 2> /dev/null | grep -i '^C\.utf-*8$' | head -n 1)
+fi
+
+if [ -n "$other_locale" ]; then
+  check_locale "$other_locale"
+else
+  echo "warning: no UTF-8 locale is installed; not checking builds in different locales" >&2
+fi
+
+exit $status
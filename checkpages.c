@@ -1,5 +1,26 @@
 #include <sys/mman.h>
+#include <fcntl.h>
 #include <glib.h>
+#include <unistd.h>
+
+/* Prints the resident pages of a file, then evicts it from the page
+ * cache.  Run it once, run a workload, then run it again to see which
+ * pages the workload touched (eg: before and after 'compile --profile').
+ */
+static void
+print_pages (const guchar *pages,
+             gint          n_pages)
+{
+  gint n_resident = 0;
+  gint i;
+
+  for (i = 0; i < n_pages; i++)
+    {
+      g_print ("%c", (pages[i] & 1) ? '#' : '.');
+      n_resident += pages[i] & 1;
+    }
+  g_print ("\n%d of %d pages resident\n", n_resident, n_pages);
+}
 
 int
 main (int argc, char **argv)
@@ -10,7 +31,7 @@ main (int argc, char **argv)
   gint n_pages;
   guchar *pages;
   gsize size;
-  gint i;
+  gint fd;
 
   mapped = g_mapped_file_new (argv[1], FALSE, &error);
   g_assert_no_error (error);
@@ -19,14 +40,16 @@ main (int argc, char **argv)
   n_pages = (size + 4095) / 4096;
   pages = g_new0 (guchar, n_pages);
   mincore (contents, size, pages);
-  for (i = 0; i < n_pages; i++)
-    g_print ("%c", (pages[i] & 1) ? '#' : '.');
-  g_print ("\n");
+  print_pages (pages, n_pages);
   madvise (contents, size, MADV_DONTNEED);
+  fd = open (argv[1], O_RDONLY);
+  if (fd >= 0)
+    {
+      posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+      close (fd);
+    }
   mincore (contents, size, pages);
-  for (i = 0; i < n_pages; i++)
-    g_print ("%c", (pages[i] & 1) ? '#' : '.');
-  g_print ("\n");
+  print_pages (pages, n_pages);
 
   return 0;
 }
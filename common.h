@@ -46,6 +46,16 @@ struct dfi_text_index_item
     } value;
 };
 
+/* With DFI_HEADER_FLAG_OVERLAYS, the text indexes of translations are
+ * overlays on the text index of the untranslated ("" locale) strings,
+ * which is their base.  An overlay has DFI_TEXT_INDEX_FLAG_OVERLAY set
+ * in n_items and only holds the tokens whose id lists differ from those
+ * in its base (with an empty id list if the translations replaced all
+ * of the strings that had the token).  Other tokens are looked up in
+ * the base.
+ */
+#define DFI_TEXT_INDEX_FLAG_OVERLAY     (1u << 31)
+
 struct dfi_text_index
 {
   dfi_uint32                 n_items;
@@ -71,22 +81,287 @@ struct dfi_keyfile_item
   dfi_string value;
 };
 
+/* In the wide format (DFI_HEADER_FLAG_WIDE_IDS), ids and counts are
+ * 32bit so that tables can have more than 65535 entries.  Text indexes
+ * and pointer arrays have the same layout in both formats and the other
+ * structures have the wide versions below.  Text index items can't
+ * store ids inline in the wide format.
+ */
+typedef dfi_uint32 dfi_wide_id;
+
+struct dfi_id_list_wide
+{
+  dfi_uint32  n_ids;
+  dfi_wide_id ids[1];
+};
+
+struct dfi_string_list_wide
+{
+  dfi_uint32 n_strings;
+  dfi_string strings[1];
+};
+
+struct dfi_keyfile_wide
+{
+  dfi_uint32 n_groups;
+  dfi_uint32 n_items;
+};
+
+struct dfi_keyfile_group_wide
+{
+  dfi_wide_id name_id;
+  dfi_uint32  items_index;
+};
+
+struct dfi_keyfile_item_wide
+{
+  dfi_wide_id key_id;
+  dfi_wide_id locale_id;
+  dfi_string  value;
+};
+
+/* A suffix array over the tokens of a text index, for finding all of
+ * the tokens that contain a substring.  Each entry is a suffix of a
+ * token, given as (item << 8) | offset: the index of the text index
+ * item and the byte offset where the suffix starts.  Entries are sorted
+ * by their suffix, as by strcmp().  Suffixes are only present for
+ * offsets that start a character and are below 256.
+ */
+#define DFI_SUFFIX_ARRAY_MAX_OFFSET     255
+
+struct dfi_suffix_array
+{
+  dfi_pointer text_index;
+  dfi_uint32  n_suffixes;
+  dfi_uint32  suffixes[1];
+};
+
+/* The positions of the tokens of a text index within the strings that
+ * they came from, for phrase queries.  A position counts the words of
+ * the string from 0 (see dfi_tokenizer_split()).
+ *
+ * lists[i] is for text index item i and has an entry for each (app,
+ * group, key) triple of its id list, in the same order.  Most tokens
+ * only appear once in a string, so the list starts with the positions
+ * of any further appearances, as n_extra (entry, position) pairs sorted
+ * by entry and position, and then has the first position of each entry.
+ * Only entries below 65536 can have extra positions.
+ */
+struct dfi_position_table
+{
+  dfi_pointer text_index;
+  dfi_uint32  n_items;
+  dfi_pointer lists[1];
+};
+
+struct dfi_position_list
+{
+  dfi_uint16 n_extra;
+  dfi_uint16 positions[1];
+};
+
+/* A front-coded token dictionary: the same token -> id list map as a
+ * text index, but with the sorted tokens stored inline in blocks of
+ * DFI_TOKEN_DICTIONARY_BLOCK_SIZE instead of in the string table.
+ *
+ * Each token is written as two varints (7 bits per byte, least
+ * significant first): the number of bytes it shares with the token
+ * before it (always 0 at the start of a block) and the number of bytes
+ * that follow.  Then come those bytes and then, aligned, the token's
+ * id list itself.  blocks[] holds the offset of each block from the
+ * start of the dictionary and n_bytes the size of the whole thing.
+ */
+#define DFI_TOKEN_DICTIONARY_BLOCK_SIZE 16
+
+struct dfi_token_dictionary
+{
+  dfi_uint32 n_tokens;
+  dfi_uint32 n_bytes;
+  dfi_uint32 blocks[1];
+};
+
+/* What drawing a menu or a grid of apps needs, without going through
+ * the desktop files: a row per app, in app id order, with its Icon and
+ * Exec (untranslated) and flags.  The Names get translated, so they are
+ * in a separate column for each locale, next to the locale's text index.
+ * Strings that an app doesn't have are given as offset 0.
+ */
+#define DFI_APP_SUMMARY_FLAG_NO_DISPLAY (1u << 0)
+#define DFI_APP_SUMMARY_FLAG_HIDDEN     (1u << 1)
+
+struct dfi_app_summary_row
+{
+  dfi_string icon;
+  dfi_string exec;
+  dfi_uint32 flags;
+};
+
+struct dfi_app_summary
+{
+  dfi_uint32                 n_apps;
+  struct dfi_app_summary_row rows[1];
+};
+
+struct dfi_name_column
+{
+  dfi_uint32 n_apps;
+  dfi_string names[1];
+};
+
+/* The well-known boolean keys of the apps, as a bitmap over the app
+ * ids for each flag: bit (app % 32) of words[flag * n_words + app / 32]
+ * where n_words is (n_apps + 31) / 32.  Files from before a flag was
+ * added have a smaller n_flags and the flag reads as unset.
+ */
+enum
+{
+  DFI_APP_FLAG_NO_DISPLAY,
+  DFI_APP_FLAG_HIDDEN,
+  DFI_APP_FLAG_TERMINAL,
+  DFI_APP_FLAG_DBUS_ACTIVATABLE,
+
+  DFI_APP_FLAG_N_FLAGS
+};
+
+struct dfi_app_flags
+{
+  dfi_uint32 n_apps;
+  dfi_uint32 n_flags;
+  dfi_uint32 words[1];
+};
+
+/* For each desktop name found in OnlyShowIn or NotShowIn, a bitmap of
+ * the apps that list it in OnlyShowIn followed by a bitmap of those
+ * that list it in NotShowIn, laid out as in struct dfi_app_flags.  The
+ * entry for "" has the apps that have the key at all.
+ */
+struct dfi_show_in
+{
+  dfi_uint32 n_apps;
+  dfi_uint32 words[1];
+};
+
 struct dfi_pointer_array
 {
   dfi_pointer associated_string_list;
   dfi_pointer pointers[1];
 };
 
-struct dfi_header
+/* When compile is run with --split-locales, the cache is split into a
+ * core file (index.cache) and one file per locale group
+ * (index-<group>.cache).  All pointers in the cache are offsets into a
+ * single "logical" file and the segment table describes which part of
+ * which file is found at each logical offset.
+ *
+ * Segments start at page-aligned logical offsets.  The segment table
+ * and the names that it refers to are found in index.cache and their
+ * offsets are relative to the start of that file (not logical offsets)
+ * so that the table can be read before any of the segments are mapped.
+ */
+#define DFI_SEGMENT_ALIGNMENT 4096
+
+struct dfi_segment
 {
-  dfi_pointer app_names;       /* string list */
-  dfi_pointer key_names;       /* string list */
-  dfi_pointer locale_names;    /* string list */
-  dfi_pointer group_names;     /* string list */
+  dfi_uint32 name;             /* offset of the locale group name ("" for the core file) */
+  dfi_uint32 start;            /* logical offset of the segment */
+  dfi_uint32 file_offset;      /* offset of the segment within its file */
+  dfi_uint32 size;
+};
 
-  dfi_pointer implementors;    /* pointer array of id lists, associated with group_names */
-  dfi_pointer text_indexes;    /* pointer array of text indexes, associated with locale_names */
-  dfi_pointer desktop_files;   /* pointer array of desktop files, associated with app_names */
+struct dfi_segment_table
+{
+  dfi_uint32         n_segments;
+  struct dfi_segment segments[1];
+};
 
-  dfi_pointer mime_types;      /* text index */
+/* The segment table is followed by an id of the build (a hash of the
+ * rest of the logical file) and each locale file ends with the same
+ * id, so that readers don't map a locale file from a later build into
+ * an index.cache that they already have open.  The id goes at the end
+ * because the segments must stay page-aligned within their files.
+ */
+struct dfi_segment_build_id
+{
+  dfi_uint32 words[2];
+};
+
+/* The header starts with a magic number and a format version, followed
+ * by a table of sections.  Readers must refuse files with a different
+ * version or with header flags that they don't know about.
+ *
+ * Each section has a type, the offset and length of its root structure
+ * and some flags.  Readers skip sections of types that they don't know
+ * about, unless the section is marked as required.  The other flags are
+ * hints about how the section will be accessed, which readers turn into
+ * madvise() calls.  Without any hints, access is assumed to be random.
+ */
+#define DFI_HEADER_MAGIC                0x63696664u     /* "dfic" */
+#define DFI_HEADER_VERSION              1
+
+#define DFI_HEADER_FLAG_WIDE_IDS        (1u << 0)       /* 32bit ids and counts */
+#define DFI_HEADER_FLAG_STRING_LENGTHS  (1u << 1)       /* see below */
+#define DFI_HEADER_FLAG_OVERLAYS        (1u << 2)       /* see struct dfi_text_index */
+
+/* With DFI_HEADER_FLAG_STRING_LENGTHS, each string in the string tables
+ * is immediately preceded by its length (not counting the nul
+ * terminator, which is still present).  The length is a varint that is
+ * read backwards from the start of the string: the byte before the
+ * string holds the low 7 bits and if its high bit is set, the byte
+ * before that holds the next 7 bits, and so on.  Strings point at their
+ * first character as usual, so they can still be used as C strings.
+ *
+ * Strings can't be tail-merged in this format.
+ */
+#define DFI_STRING_LENGTH_MAX_BYTES     5
+
+enum
+{
+  DFI_SECTION_APP_NAMES = 1,    /* string list */
+  DFI_SECTION_KEY_NAMES,        /* string list */
+  DFI_SECTION_LOCALE_NAMES,     /* string list */
+  DFI_SECTION_GROUP_NAMES,      /* string list */
+
+  DFI_SECTION_IMPLEMENTORS,     /* pointer array of id lists, associated with group_names */
+  DFI_SECTION_TEXT_INDEXES,     /* pointer array of text indexes, associated with locale_names */
+  DFI_SECTION_DESKTOP_FILES,    /* pointer array of desktop files, associated with app_names */
+
+  DFI_SECTION_MIME_TYPES,       /* text index */
+
+  DFI_SECTION_SEGMENTS,         /* segment table (offset within index.cache) */
+
+  DFI_SECTION_SUFFIX_ARRAYS,    /* pointer array of suffix arrays, associated with locale_names */
+  DFI_SECTION_TOKEN_DICTIONARIES, /* pointer array of token dictionaries, associated with locale_names */
+  DFI_SECTION_POSITIONS,        /* pointer array of position tables, associated with locale_names */
+  DFI_SECTION_LOCALE_FALLBACKS, /* pointer array of id lists of locale ids to try, most specific first */
+  DFI_SECTION_SORTED_APPS,      /* pointer array of id lists of app ids in display order, associated with locale_names */
+  DFI_SECTION_APP_SUMMARY,      /* app summary */
+  DFI_SECTION_DISPLAY_NAMES,    /* pointer array of name columns, associated with locale_names */
+  DFI_SECTION_APP_FLAGS,        /* app flags */
+  DFI_SECTION_SHOW_IN,          /* pointer array of show-in bitmaps, associated with its own list of desktop names */
+  DFI_SECTION_CATEGORIES,       /* pointer array of id lists of app ids, associated with its own list of categories */
+  DFI_SECTION_STARTUP_WM_CLASSES, /* pointer array of id lists of app ids, associated with its own list of StartupWMClass values */
+  DFI_SECTION_EXECUTABLES,      /* pointer array of id lists of app ids, associated with its own list of Exec and TryExec basenames */
+
+  DFI_SECTION_N_TYPES
+};
+
+#define DFI_SECTION_FLAG_REQUIRED       (1u << 0)       /* refuse the file if the type is unknown */
+#define DFI_SECTION_FLAG_WILLNEED       (1u << 1)       /* used right away; read it in early */
+#define DFI_SECTION_FLAG_SEQUENTIAL     (1u << 2)       /* read from start to end */
+
+struct dfi_section
+{
+  dfi_uint32 type;
+  dfi_uint32 offset;
+  dfi_uint32 length;
+  dfi_uint32 flags;
+};
+
+struct dfi_header
+{
+  dfi_uint32         magic;
+  dfi_uint16         version;
+  dfi_uint16         n_sections;
+  dfi_uint32         flags;
+  struct dfi_section sections[1];
 };
@@ -5,11 +5,20 @@
 #include "dfi-builder-text-index.h"
 #include "dfi-builder-string-list.h"
 #include "dfi-builder-id-list.h"
+#include "dfi-builder-profile.h"
+#include "dfi-delta.h"
 
 #include <string.h>
 #include <unistd.h>
 #include <locale.h>
 
+typedef struct
+{
+  gchar *group;                      /* locale group, "" for the core file */
+  guint  start;                      /* logical offset */
+  guint  end;
+} DesktopFileIndexSegment;
+
 typedef struct
 {
   GHashTable *locale_string_tables;  /* string tables */
@@ -24,8 +33,32 @@ typedef struct
 
   GHashTable *locale_text_indexes;   /* str -> text index */
   GHashTable *group_implementors;    /* str -> id list */
+  GSequence  *fallback_names;        /* string list */
+  GHashTable *locale_fallbacks;      /* str -> id list of locale ids */
+  GHashTable *sorted_apps;           /* str -> id list of app ids, in Name order */
+  GHashTable *name_columns;          /* str -> offset */
+  GSequence  *desktop_names;         /* string list */
+  GHashTable *show_in;               /* str -> OnlyShowIn and NotShowIn bitmaps */
+  GSequence  *category_names;        /* string list */
+  GHashTable *categories;            /* str -> id list of app ids */
+  GSequence  *wm_class_names;        /* string list */
+  GHashTable *startup_wm_classes;    /* str -> id list of app ids */
+  GSequence  *executable_names;      /* string list */
+  GHashTable *executables;           /* str -> id list of app ids */
   GHashTable *desktop_files;         /* str -> Keyfile */
 
+  DesktopFileIndexProfile *profile;  /* access profile, or NULL */
+  GHashTable *hot_strings;           /* str -> hits, only with a profile */
+
+  GPtrArray  *segments;              /* DesktopFileIndexSegment, only with --split-locales */
+  guint64     build_id;              /* see struct dfi_segment_build_id */
+  GHashTable *suffix_arrays;         /* str -> offset, only with --suffix-arrays */
+  GHashTable *position_tables;       /* str -> offset, only with --positions */
+  gboolean    wide_ids;              /* write 32bit ids and counts */
+  gboolean    string_lengths;        /* write the length before each string */
+  gboolean    front_coded;           /* write token dictionaries instead of text indexes */
+  gboolean    overlays;              /* write translations' text indexes as overlays on the C one */
+
   GString    *string;                /* file contents */
 } DesktopFileIndexBuilder;
 
@@ -76,6 +109,51 @@ desktop_file_index_builder_check_alignment (DesktopFileIndexBuilder *builder,
   g_assert (~builder->string->len & (size - 1));
 }
 
+static void
+desktop_file_index_segment_free (gpointer data)
+{
+  DesktopFileIndexSegment *segment = data;
+
+  g_free (segment->group);
+
+  g_slice_free (DesktopFileIndexSegment, segment);
+}
+
+/* When splitting the cache by locale group, everything written from
+ * now on goes to the file for the given group, until the next call.
+ */
+static void
+desktop_file_index_builder_begin_segment (DesktopFileIndexBuilder *builder,
+                                          const gchar             *group)
+{
+  DesktopFileIndexSegment *segment;
+
+  if (builder->segments == NULL)
+    return;
+
+  segment = builder->segments->pdata[builder->segments->len - 1];
+  if (g_str_equal (segment->group, group))
+    return;
+
+  desktop_file_index_builder_align (builder, DFI_SEGMENT_ALIGNMENT);
+
+  /* Don't leave empty segments lying around */
+  if (segment->start == desktop_file_index_builder_get_offset (builder))
+    {
+      g_free (segment->group);
+      segment->group = g_strdup (group);
+      return;
+    }
+
+  segment->end = desktop_file_index_builder_get_offset (builder);
+
+  segment = g_slice_new (DesktopFileIndexSegment);
+  segment->group = g_strdup (group);
+  segment->start = desktop_file_index_builder_get_offset (builder);
+  segment->end = segment->start;
+  g_ptr_array_add (builder->segments, segment);
+}
+
 static guint
 desktop_file_index_builder_write_uint16 (DesktopFileIndexBuilder *builder,
                                          guint16                  value)
@@ -106,6 +184,27 @@ desktop_file_index_builder_write_uint32 (DesktopFileIndexBuilder *builder,
   return offset;
 }
 
+/* Ids and the counts of things that ids refer to are 16 or 32 bits,
+ * depending on the format.
+ */
+static guint
+desktop_file_index_builder_write_count (DesktopFileIndexBuilder *builder,
+                                        guint                    value)
+{
+  if (builder->wide_ids)
+    return desktop_file_index_builder_write_uint32 (builder, value);
+
+  g_assert_cmpuint (value, <=, G_MAXUINT16);
+
+  return desktop_file_index_builder_write_uint16 (builder, value);
+}
+
+static gsize
+desktop_file_index_builder_get_id_size (DesktopFileIndexBuilder *builder)
+{
+  return builder->wide_ids ? sizeof (guint32) : sizeof (guint16);
+}
+
 #if 0
 static guint
 desktop_file_index_builder_write_raw_string (DesktopFileIndexBuilder *builder,
@@ -140,8 +239,9 @@ desktop_file_index_builder_write_string_list (DesktopFileIndexBuilder *builder,
   guint offset = desktop_file_index_builder_get_aligned (builder, sizeof (guint32));
   GSequenceIter *iter;
 
-  desktop_file_index_builder_write_uint16 (builder, g_sequence_get_length (strings));
-  desktop_file_index_builder_write_uint16 (builder, 0xffff); /* padding */
+  desktop_file_index_builder_write_count (builder, g_sequence_get_length (strings));
+  if (!builder->wide_ids)
+    desktop_file_index_builder_write_uint16 (builder, 0xffff); /* padding */
 
   for (iter = g_sequence_get_begin_iter (strings); !g_sequence_iter_is_end (iter); iter = g_sequence_iter_next (iter))
     desktop_file_index_builder_write_string (builder, "", g_sequence_get (iter));
@@ -155,18 +255,21 @@ desktop_file_index_builder_write_id (DesktopFileIndexBuilder *builder,
                                      const gchar             *string)
 {
   GSequenceIter *iter;
+  guint invalid;
   guint value;
 
+  invalid = builder->wide_ids ? G_MAXUINT32 : G_MAXUINT16;
+
   if (string == NULL)
-    return desktop_file_index_builder_write_uint16 (builder, G_MAXUINT16);
+    return desktop_file_index_builder_write_count (builder, invalid);
 
   iter = g_sequence_lookup (string_list, (gpointer) string, (GCompareDataFunc) strcmp, NULL);
   g_assert (iter != NULL);
 
   value = g_sequence_iter_get_position (iter);
-  g_assert_cmpuint (value, <, G_MAXUINT16);
+  g_assert_cmpuint (value, <, invalid);
 
-  return desktop_file_index_builder_write_uint16 (builder, (gsize) value);
+  return desktop_file_index_builder_write_count (builder, value);
 }
 
 static guint
@@ -174,7 +277,7 @@ desktop_file_index_builder_write_keyfile (DesktopFileIndexBuilder *builder,
                                           const gchar             *app,
                                           gpointer                 data)
 {
-  guint offset = desktop_file_index_builder_get_aligned (builder, sizeof (guint16));
+  guint offset = desktop_file_index_builder_get_aligned (builder, desktop_file_index_builder_get_id_size (builder));
   DesktopFileIndexKeyfile *keyfile = data;
   gint n_groups, n_items;
   gint i;
@@ -182,8 +285,8 @@ desktop_file_index_builder_write_keyfile (DesktopFileIndexBuilder *builder,
   n_groups = desktop_file_index_keyfile_get_n_groups (keyfile);
   n_items = desktop_file_index_keyfile_get_n_items (keyfile);
 
-  desktop_file_index_builder_write_uint16 (builder, n_groups);
-  desktop_file_index_builder_write_uint16 (builder, n_items);
+  desktop_file_index_builder_write_count (builder, n_groups);
+  desktop_file_index_builder_write_count (builder, n_items);
 
   for (i = 0; i < n_groups; i++)
     {
@@ -194,7 +297,7 @@ desktop_file_index_builder_write_keyfile (DesktopFileIndexBuilder *builder,
       desktop_file_index_keyfile_get_group_range (keyfile, i, &start, NULL);
 
       desktop_file_index_builder_write_id (builder, builder->group_names, group_name);
-      desktop_file_index_builder_write_uint16 (builder, start);
+      desktop_file_index_builder_write_count (builder, start);
     }
 
   for (i = 0; i < n_items; i++)
@@ -220,25 +323,38 @@ desktop_file_index_builder_write_pointer_array (DesktopFileIndexBuilder     *bui
                                                 GSequence                   *key_list,
                                                 guint                        key_list_offset,
                                                 GHashTable                  *data_table,
+                                                const guint                 *order,
                                                 DesktopFileIndexBuilderFunc  func)
 {
   GSequenceIter *iter;
+  const gchar **keys;
   guint *offsets;
-  gint n, i = 0;
+  gint n, i, j;
   guint offset;
 
   n = g_sequence_get_length (key_list);
+  keys = g_new (const gchar *, n);
   offsets = g_new0 (guint, n);
 
-  for (iter = g_sequence_get_begin_iter (key_list); !g_sequence_iter_is_end (iter); iter = g_sequence_iter_next (iter))
+  foreach_sequence_item_and_position (iter, key_list, i)
+    keys[i] = g_sequence_get (iter);
+  g_assert (i == n);
+
+  /* The pointer array itself is always in key order, but the items it
+   * points to may be written in a different order (eg: hot items first).
+   */
+  for (j = 0; j < n; j++)
     {
-      const gchar *key = g_sequence_get (iter);
       gpointer data;
 
-      data = g_hash_table_lookup (data_table, key);
-      offsets[i++] = (* func) (builder, key, data);
+      i = order ? order[j] : j;
+
+      data = g_hash_table_lookup (data_table, keys[i]);
+      offsets[i] = (* func) (builder, keys[i], data);
     }
-  g_assert (i == n);
+
+  /* Pointer arrays always go in the core file */
+  desktop_file_index_builder_begin_segment (builder, "");
 
   offset = desktop_file_index_builder_get_aligned (builder, sizeof (guint32));
   desktop_file_index_builder_write_uint32 (builder, key_list_offset);
@@ -247,27 +363,288 @@ desktop_file_index_builder_write_pointer_array (DesktopFileIndexBuilder     *bui
     desktop_file_index_builder_write_uint32 (builder, offsets[i]);
 
   g_free (offsets);
+  g_free (keys);
 
   return offset;
 }
 
+/* For pointer arrays of things that have already been written */
+static guint
+desktop_file_index_builder_get_written (DesktopFileIndexBuilder *builder,
+                                        const gchar             *key,
+                                        gpointer                 data)
+{
+  return GPOINTER_TO_UINT (data);
+}
+
+typedef guint (* DesktopFileIndexProfileFunc) (DesktopFileIndexProfile *profile,
+                                               const gchar             *name);
+
+static gint
+desktop_file_index_builder_compare_hits (gconstpointer a,
+                                         gconstpointer b,
+                                         gpointer      user_data)
+{
+  const guint *hits = user_data;
+  guint index_a = *(const guint *) a;
+  guint index_b = *(const guint *) b;
+
+  if (hits[index_a] != hits[index_b])
+    return hits[index_a] > hits[index_b] ? -1 : 1;
+
+  /* Keep key order for items with the same number of hits */
+  return index_a < index_b ? -1 : index_a > index_b;
+}
+
+static gint
+desktop_file_index_builder_compare_ranks (gconstpointer a,
+                                          gconstpointer b,
+                                          gpointer      user_data)
+{
+  const guint *ranks = user_data;
+  guint rank_a = ranks[*(const guint *) a];
+  guint rank_b = ranks[*(const guint *) b];
+
+  return rank_a < rank_b ? -1 : rank_a > rank_b;
+}
+
+static guint *
+desktop_file_index_builder_get_write_order (DesktopFileIndexBuilder     *builder,
+                                            GSequence                   *key_list,
+                                            DesktopFileIndexProfileFunc  get_hits)
+{
+  GSequenceIter *iter;
+  guint *order;
+  guint *hits;
+  guint i, n;
+
+  if (builder->profile == NULL)
+    return NULL;
+
+  n = g_sequence_get_length (key_list);
+  order = g_new (guint, n);
+  hits = g_new (guint, n);
+
+  foreach_sequence_item_and_position (iter, key_list, i)
+    {
+      order[i] = i;
+      hits[i] = (* get_hits) (builder->profile, g_sequence_get (iter));
+    }
+
+  g_qsort_with_data (order, n, sizeof (guint), desktop_file_index_builder_compare_hits, hits);
+
+  g_free (hits);
+
+  return order;
+}
+
 static guint
 desktop_file_index_builder_write_id_list (DesktopFileIndexBuilder *builder,
                                           const gchar             *key,
                                           gpointer                 data)
 {
   GArray *id_list = data;
-  const guint16 *ids;
+  const guint *ids;
   guint offset;
   guint n_ids;
   guint i;
 
   ids = desktop_file_index_id_list_get_ids (id_list, &n_ids);
 
-  offset = desktop_file_index_builder_write_uint16 (builder, n_ids);
+  offset = desktop_file_index_builder_write_count (builder, n_ids);
 
   for (i = 0; i < n_ids; i++)
-    desktop_file_index_builder_write_uint16 (builder, ids[i]);
+    desktop_file_index_builder_write_count (builder, ids[i]);
+
+  return offset;
+}
+
+static gint
+desktop_file_index_builder_compare_suffixes (gconstpointer a,
+                                             gconstpointer b,
+                                             gpointer      user_data)
+{
+  const gchar **strings = user_data;
+  guint suffix_a = *(const guint *) a;
+  guint suffix_b = *(const guint *) b;
+  gint x;
+
+  x = strcmp (strings[suffix_a >> 8] + (suffix_a & 0xff), strings[suffix_b >> 8] + (suffix_b & 0xff));
+
+  /* Keep the order deterministic for equal suffixes */
+  if (x == 0)
+    x = suffix_a < suffix_b ? -1 : suffix_a > suffix_b;
+
+  return x;
+}
+
+static guint
+desktop_file_index_builder_write_suffix_array (DesktopFileIndexBuilder  *builder,
+                                               const gchar             **strings,
+                                               guint                     n_items,
+                                               guint                     text_index_offset)
+{
+  GArray *suffixes;
+  guint offset;
+  guint i;
+
+  g_assert_cmpuint (n_items, <, 1u << 24);
+
+  suffixes = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  for (i = 0; i < n_items; i++)
+    {
+      const gchar *s;
+
+      for (s = strings[i]; *s && s - strings[i] <= DFI_SUFFIX_ARRAY_MAX_OFFSET; s = g_utf8_next_char (s))
+        {
+          guint suffix = (i << 8) | (s - strings[i]);
+
+          g_array_append_val (suffixes, suffix);
+        }
+    }
+
+  g_qsort_with_data (suffixes->data, suffixes->len, sizeof (guint), desktop_file_index_builder_compare_suffixes, strings);
+
+  offset = desktop_file_index_builder_get_aligned (builder, sizeof (guint32));
+
+  desktop_file_index_builder_write_uint32 (builder, text_index_offset);
+  desktop_file_index_builder_write_uint32 (builder, suffixes->len);
+
+  for (i = 0; i < suffixes->len; i++)
+    desktop_file_index_builder_write_uint32 (builder, g_array_index (suffixes, guint, i));
+
+  g_array_free (suffixes, TRUE);
+
+  return offset;
+}
+
+/* Text indexes and token dictionaries go in the locale's segment,
+ * after its string table.
+ */
+static void
+desktop_file_index_builder_begin_text_index (DesktopFileIndexBuilder *builder,
+                                             const gchar             *locale)
+{
+  GHashTable *string_table;
+
+  if (locale)
+    {
+      gchar *group;
+
+      group = desktop_file_index_string_tables_get_locale_group (locale);
+      desktop_file_index_builder_begin_segment (builder, group);
+      g_free (group);
+    }
+
+  string_table = desktop_file_index_builder_get_string_table (builder, locale);
+  if (!desktop_file_index_string_table_is_written (string_table))
+    {
+      GHashTable *c_string_table;
+
+      c_string_table = desktop_file_index_string_tables_get_table (builder->locale_string_tables, "");
+      desktop_file_index_string_table_write (string_table, c_string_table, builder->hot_strings, builder->string_lengths, builder->string);
+    }
+}
+
+/* See struct dfi_position_table in common.h */
+static guint
+desktop_file_index_builder_write_position_table (DesktopFileIndexBuilder *builder,
+                                                 GSequence               *text_index,
+                                                 guint                    text_index_offset)
+{
+  GSequenceIter *iter;
+  guint n_extra;
+  guint *lists;
+  guint n_items;
+  guint offset;
+  guint i, j;
+
+  n_items = g_sequence_get_length (text_index);
+  lists = g_new0 (guint, n_items);
+
+  foreach_sequence_item_and_position (iter, text_index, i)
+    {
+      GArray *starts, *positions;
+
+      desktop_file_index_text_index_get_positions (iter, &starts, &positions);
+      if (starts == NULL)
+        continue;
+
+      lists[i] = desktop_file_index_builder_get_aligned (builder, sizeof (guint16));
+
+      /* Every position that isn't the first of its entry is an extra */
+      n_extra = 0;
+      for (j = 0; j < starts->len && j <= G_MAXUINT16; j++)
+        {
+          guint end = j + 1 < starts->len ? g_array_index (starts, guint, j + 1) : positions->len;
+
+          n_extra += end - g_array_index (starts, guint, j) - 1;
+        }
+
+      n_extra = MIN (n_extra, G_MAXUINT16);
+      desktop_file_index_builder_write_uint16 (builder, n_extra);
+
+      for (j = 0; j < starts->len && j <= G_MAXUINT16 && n_extra; j++)
+        {
+          guint end = j + 1 < starts->len ? g_array_index (starts, guint, j + 1) : positions->len;
+          guint k;
+
+          for (k = g_array_index (starts, guint, j) + 1; k < end && n_extra; k++, n_extra--)
+            {
+              desktop_file_index_builder_write_uint16 (builder, j);
+              desktop_file_index_builder_write_uint16 (builder, MIN (g_array_index (positions, guint, k), G_MAXUINT16));
+            }
+        }
+
+      for (j = 0; j < starts->len; j++)
+        desktop_file_index_builder_write_uint16 (builder, MIN (g_array_index (positions, guint, g_array_index (starts, guint, j)), G_MAXUINT16));
+    }
+
+  offset = desktop_file_index_builder_get_aligned (builder, sizeof (guint32));
+
+  desktop_file_index_builder_write_uint32 (builder, text_index_offset);
+  desktop_file_index_builder_write_uint32 (builder, n_items);
+
+  for (i = 0; i < n_items; i++)
+    desktop_file_index_builder_write_uint32 (builder, lists[i]);
+
+  g_free (lists);
+
+  return offset;
+}
+
+/* See struct dfi_name_column in common.h.  The Names were all added to
+ * the locale's string table by add_display_names().
+ */
+static guint
+desktop_file_index_builder_write_name_column (DesktopFileIndexBuilder *builder,
+                                              const gchar             *locale)
+{
+  gchar **locale_variants;
+  GSequenceIter *iter;
+  guint offset;
+
+  locale_variants = g_get_locale_variants (locale);
+
+  offset = desktop_file_index_builder_get_aligned (builder, sizeof (guint32));
+  desktop_file_index_builder_write_uint32 (builder, g_sequence_get_length (builder->app_names));
+
+  foreach_sequence_item (iter, builder->app_names)
+    {
+      DesktopFileIndexKeyfile *kf;
+      const gchar *name;
+
+      kf = g_hash_table_lookup (builder->desktop_files, g_sequence_get (iter));
+      name = desktop_file_index_keyfile_get_value (kf, (const gchar **) locale_variants, "Desktop Entry", "Name");
+
+      if (name)
+        desktop_file_index_builder_write_string (builder, locale, name);
+      else
+        desktop_file_index_builder_write_uint32 (builder, 0);
+    }
+
+  g_strfreev (locale_variants);
 
   return offset;
 }
@@ -279,7 +656,6 @@ desktop_file_index_builder_write_text_index (DesktopFileIndexBuilder *builder,
 {
   GSequence *text_index = data;
   const gchar *locale = key;
-  GHashTable *string_table;
   GSequenceIter *iter;
   const gchar **strings;
   guint *id_lists;
@@ -287,21 +663,14 @@ desktop_file_index_builder_write_text_index (DesktopFileIndexBuilder *builder,
   guint n_items;
   guint i;
 
-  string_table = desktop_file_index_builder_get_string_table (builder, locale);
-  if (!desktop_file_index_string_table_is_written (string_table))
-    {
-      GHashTable *c_string_table;
-
-      c_string_table = desktop_file_index_string_tables_get_table (builder->locale_string_tables, "");
-      desktop_file_index_string_table_write (string_table, c_string_table, builder->string);
-    }
+  desktop_file_index_builder_begin_text_index (builder, locale);
 
   n_items = g_sequence_get_length (text_index);
 
   strings = g_new (const gchar *, n_items);
   id_lists = g_new (guint, n_items);
 
-  desktop_file_index_builder_align (builder, sizeof (guint16));
+  desktop_file_index_builder_align (builder, desktop_file_index_builder_get_id_size (builder));
 
   foreach_sequence_item_and_position (iter, text_index, i)
     {
@@ -315,7 +684,10 @@ desktop_file_index_builder_write_text_index (DesktopFileIndexBuilder *builder,
 
   offset = desktop_file_index_builder_get_offset (builder);
 
-  desktop_file_index_builder_write_uint32 (builder, n_items);
+  if (builder->overlays && locale && locale[0])
+    desktop_file_index_builder_write_uint32 (builder, n_items | DFI_TEXT_INDEX_FLAG_OVERLAY);
+  else
+    desktop_file_index_builder_write_uint32 (builder, n_items);
 
   for (i = 0; i < n_items; i++)
     {
@@ -323,139 +695,1271 @@ desktop_file_index_builder_write_text_index (DesktopFileIndexBuilder *builder,
       desktop_file_index_builder_write_uint32 (builder, id_lists[i]);
     }
 
+  /* The suffix array goes right next to its text index, in the same
+   * segment.  It gets its own pointer array later.
+   */
+  if (builder->suffix_arrays && locale)
+    {
+      guint suffix_array;
+
+      suffix_array = desktop_file_index_builder_write_suffix_array (builder, strings, n_items, offset);
+      g_hash_table_insert (builder->suffix_arrays, g_strdup (locale), GUINT_TO_POINTER (suffix_array));
+    }
+
+  if (builder->position_tables && locale)
+    {
+      guint position_table;
+
+      position_table = desktop_file_index_builder_write_position_table (builder, text_index, offset);
+      g_hash_table_insert (builder->position_tables, g_strdup (locale), GUINT_TO_POINTER (position_table));
+    }
+
+  /* Likewise for the Names of the apps */
+  if (locale)
+    {
+      guint name_column;
+
+      name_column = desktop_file_index_builder_write_name_column (builder, locale);
+      g_hash_table_insert (builder->name_columns, g_strdup (locale), GUINT_TO_POINTER (name_column));
+    }
+
   g_free (strings);
   g_free (id_lists);
 
   return offset;
 }
 
+static void
+desktop_file_index_builder_write_varint (DesktopFileIndexBuilder *builder,
+                                         guint                    value)
+{
+  while (value >= 0x80)
+    {
+      g_string_append_c (builder->string, (value & 0x7f) | 0x80);
+      value >>= 7;
+    }
+
+  g_string_append_c (builder->string, value);
+}
 
 static void
-desktop_file_index_builder_serialise (DesktopFileIndexBuilder *builder)
+desktop_file_index_builder_set_uint32 (DesktopFileIndexBuilder *builder,
+                                       guint                    offset,
+                                       guint32                  value)
 {
-  guint32 header_fields[8] = { 0, };
+  value = GUINT32_TO_LE (value);
 
-  builder->string = g_string_new (NULL);
+  memcpy (builder->string->str + offset, &value, sizeof value);
+}
 
-  /* Make room for the header */
-  g_string_append_len (builder->string, (char *) header_fields, sizeof header_fields);
+/* See struct dfi_token_dictionary in common.h */
+static guint
+desktop_file_index_builder_write_token_dictionary (DesktopFileIndexBuilder *builder,
+                                                   const gchar             *key,
+                                                   gpointer                 data)
+{
+  GSequence *text_index = data;
+  const gchar *locale = key;
+  const gchar *previous = "";
+  GSequenceIter *iter;
+  guint n_blocks;
+  guint offset;
+  guint n_items;
+  guint i;
 
-  /* Write out the C string table, filling in the offsets
-   *
-   * We have to do this first because all of the string lists (apps,
-   * keys, locales, groups) are stored as strings in the C locale.
-   */
-  {
-    GHashTable *c_table;
+  desktop_file_index_builder_begin_text_index (builder, locale);
 
-    c_table = desktop_file_index_builder_get_string_table (builder, "");
-    desktop_file_index_string_table_write (c_table, NULL, builder->string);
-  }
+  n_items = g_sequence_get_length (text_index);
+  n_blocks = (n_items + DFI_TOKEN_DICTIONARY_BLOCK_SIZE - 1) / DFI_TOKEN_DICTIONARY_BLOCK_SIZE;
 
-  /* Write out the string lists.  This will work because they only
-   * refer to strings in the C locale.
-   */
-  {
-    header_fields[0] = desktop_file_index_builder_write_string_list (builder, builder->app_names);
-    header_fields[1] = desktop_file_index_builder_write_string_list (builder, builder->key_names);
-    header_fields[2] = desktop_file_index_builder_write_string_list (builder, builder->locale_names);
-    header_fields[3] = desktop_file_index_builder_write_string_list (builder, builder->group_names);
-  }
+  offset = desktop_file_index_builder_get_aligned (builder, sizeof (guint32));
 
-  /* Write out the group implementors */
-  {
-    /*
-    header_fields[4] = desktop_file_index_builder_write_pointer_array (builder,
-                                                                       builder->group_names,
-                                                                       header_fields[3],
-                                                                       builder->group_implementors,
-                                                                       desktop_file_index_builder_write_id_list);
-                                                                       */
-  }
+  desktop_file_index_builder_write_uint32 (builder, n_items);
+  desktop_file_index_builder_write_uint32 (builder, 0);
 
-  /* Write out the text indexes for the actual locales.
-   *
-   * Note: we do this by visiting each item in the locale string list,
-   * which doesn't include the C locale, so we won't end up emitting the
-   * C locale again here.
-   *
-   * Note: this function will write out the locale-specific string
-   * tables alongside the table for each locale in order to improve
-   * locality.
-   */
-  {
-    header_fields[5] = desktop_file_index_builder_write_pointer_array (builder,
-                                                                       builder->locale_names,
-                                                                       header_fields[2],
-                                                                       builder->locale_text_indexes,
-                                                                       desktop_file_index_builder_write_text_index);
-  }
+  /* Block offsets get filled in as we go */
+  for (i = 0; i < n_blocks; i++)
+    desktop_file_index_builder_write_uint32 (builder, 0);
 
-  /* Write out the desktop file contents.
-   *
-   * We have to do this last because the desktop files refer to strings
-   * from all the locales and those are only actually written in the
-   * last step.
-   *
-   * TODO: we could improve things a bit by storing the desktop files at
-   * the front of the cache, but this would require a two-pass
+  foreach_sequence_item_and_position (iter, text_index, i)
+    {
+      const gchar *token;
+      GArray *id_list;
+      guint shared = 0;
+      guint length;
+
+      desktop_file_index_text_index_get_item (iter, &token, &id_list);
+
+      if (i % DFI_TOKEN_DICTIONARY_BLOCK_SIZE == 0)
+        desktop_file_index_builder_set_uint32 (builder,
+                                               offset + G_STRUCT_OFFSET (struct dfi_token_dictionary, blocks) +
+                                               i / DFI_TOKEN_DICTIONARY_BLOCK_SIZE * sizeof (guint32),
+                                               desktop_file_index_builder_get_offset (builder) - offset);
+      else
+        while (token[shared] && token[shared] == previous[shared])
+          shared++;
+
+      length = strlen (token + shared);
+
+      desktop_file_index_builder_write_varint (builder, shared);
+      desktop_file_index_builder_write_varint (builder, length);
+      g_string_append_len (builder->string, token + shared, length);
+
+      desktop_file_index_builder_align (builder, desktop_file_index_builder_get_id_size (builder));
+      desktop_file_index_builder_write_id_list (builder, NULL, id_list);
+
+      previous = token;
+    }
+
+  desktop_file_index_builder_set_uint32 (builder, offset + G_STRUCT_OFFSET (struct dfi_token_dictionary, n_bytes),
+                                         desktop_file_index_builder_get_offset (builder) - offset);
+
+  if (locale)
+    {
+      guint name_column;
+
+      name_column = desktop_file_index_builder_write_name_column (builder, locale);
+      g_hash_table_insert (builder->name_columns, g_strdup (locale), GUINT_TO_POINTER (name_column));
+    }
+
+  return offset;
+}
+
+
+static guint *
+desktop_file_index_builder_group_write_order (DesktopFileIndexBuilder *builder,
+                                              GSequence               *locale_list,
+                                              guint                   *order)
+{
+  GHashTable *group_ranks;
+  GSequenceIter *iter;
+  guint *ranks;
+  guint n, i;
+
+  /* Locales in the same group must be written next to each other so
+   * that they end up in the same file.  Groups are ordered by their
+   * first appearance in the original order, so hot groups stay first.
+   */
+  n = g_sequence_get_length (locale_list);
+
+  if (order == NULL)
+    {
+      order = g_new (guint, n);
+      for (i = 0; i < n; i++)
+        order[i] = i;
+    }
+
+  group_ranks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  ranks = g_new (guint, n);
+
+  for (i = 0; i < n; i++)
+    {
+      gpointer rank;
+      gchar *group;
+
+      iter = g_sequence_get_iter_at_pos (locale_list, order[i]);
+      group = desktop_file_index_string_tables_get_locale_group (g_sequence_get (iter));
+
+      if (!g_hash_table_lookup_extended (group_ranks, group, NULL, &rank))
+        {
+          rank = GUINT_TO_POINTER (g_hash_table_size (group_ranks));
+          g_hash_table_insert (group_ranks, g_strdup (group), rank);
+        }
+
+      ranks[order[i]] = GPOINTER_TO_UINT (rank) * n + i;
+      g_free (group);
+    }
+
+  /* rank * n + i is unique, so the sort is stable */
+  g_qsort_with_data (order, n, sizeof (guint), desktop_file_index_builder_compare_ranks, ranks);
+
+  g_hash_table_unref (group_ranks);
+  g_free (ranks);
+
+  return order;
+}
+
+/* 64bit FNV-1a of everything written so far */
+static guint64
+desktop_file_index_builder_get_build_id (DesktopFileIndexBuilder *builder)
+{
+  guint64 hash = G_GUINT64_CONSTANT (14695981039346656037);
+  gsize i;
+
+  for (i = 0; i < builder->string->len; i++)
+    hash = (hash ^ (guchar) builder->string->str[i]) * G_GUINT64_CONSTANT (1099511628211);
+
+  return hash;
+}
+
+static guint
+desktop_file_index_builder_write_segment_table (DesktopFileIndexBuilder *builder,
+                                                guint                   *length)
+{
+  DesktopFileIndexSegment *last;
+  GHashTable *file_offsets;
+  guint *name_offsets;
+  guint core_offset;
+  guint table_offset;
+  guint n, i;
+
+  n = builder->segments->len;
+  last = builder->segments->pdata[n - 1];
+  g_assert (last->group[0] == '\0');
+
+  builder->build_id = desktop_file_index_builder_get_build_id (builder);
+
+  /* Find where the last segment starts within index.cache */
+  core_offset = 0;
+  for (i = 0; i < n - 1; i++)
+    {
+      DesktopFileIndexSegment *segment = builder->segments->pdata[i];
+
+      if (segment->group[0] == '\0')
+        core_offset += segment->end - segment->start;
+    }
+
+#define core_file_offset(logical) (core_offset + (logical) - last->start)
+
+  name_offsets = g_new (guint, n);
+
+  for (i = 0; i < n; i++)
+    {
+      DesktopFileIndexSegment *segment = builder->segments->pdata[i];
+
+      name_offsets[i] = core_file_offset (desktop_file_index_builder_get_offset (builder));
+      g_string_append_len (builder->string, segment->group, strlen (segment->group) + 1);
+    }
+
+  desktop_file_index_builder_align (builder, sizeof (guint32));
+  table_offset = core_file_offset (desktop_file_index_builder_get_offset (builder));
+
+  *length = sizeof (dfi_uint32) + n * sizeof (struct dfi_segment) + sizeof (struct dfi_segment_build_id);
+
+  /* The last segment ends with the table itself */
+  last->end = desktop_file_index_builder_get_offset (builder) + *length;
+
+  desktop_file_index_builder_write_uint32 (builder, n);
+
+  file_offsets = g_hash_table_new (g_str_hash, g_str_equal);
+
+  for (i = 0; i < n; i++)
+    {
+      DesktopFileIndexSegment *segment = builder->segments->pdata[i];
+      guint file_offset;
+
+      file_offset = GPOINTER_TO_UINT (g_hash_table_lookup (file_offsets, segment->group));
+      g_hash_table_insert (file_offsets, segment->group, GUINT_TO_POINTER (file_offset + segment->end - segment->start));
+
+      desktop_file_index_builder_write_uint32 (builder, name_offsets[i]);
+      desktop_file_index_builder_write_uint32 (builder, segment->start);
+      desktop_file_index_builder_write_uint32 (builder, file_offset);
+      desktop_file_index_builder_write_uint32 (builder, segment->end - segment->start);
+    }
+
+  desktop_file_index_builder_write_uint32 (builder, builder->build_id);
+  desktop_file_index_builder_write_uint32 (builder, builder->build_id >> 32);
+
+#undef core_file_offset
+
+  g_assert (desktop_file_index_builder_get_offset (builder) == last->end);
+
+  g_hash_table_unref (file_offsets);
+  g_free (name_offsets);
+
+  return table_offset;
+}
+
+static gboolean
+desktop_file_index_builder_get_boolean (DesktopFileIndexKeyfile *keyfile,
+                                        const gchar             *key)
+{
+  const gchar *no_locales[] = { NULL };
+  const gchar *value;
+
+  value = desktop_file_index_keyfile_get_value (keyfile, no_locales, "Desktop Entry", key);
+
+  /* As accepted by GKeyFile */
+  return value && (g_str_equal (value, "true") || g_str_equal (value, "1"));
+}
+
+/* See struct dfi_app_summary in common.h */
+static guint
+desktop_file_index_builder_write_app_summary (DesktopFileIndexBuilder *builder)
+{
+  const gchar *no_locales[] = { NULL };
+  GSequenceIter *iter;
+  guint offset;
+
+  offset = desktop_file_index_builder_get_aligned (builder, sizeof (guint32));
+  desktop_file_index_builder_write_uint32 (builder, g_sequence_get_length (builder->app_names));
+
+  foreach_sequence_item (iter, builder->app_names)
+    {
+      const gchar *keys[] = { "Icon", "Exec" };
+      DesktopFileIndexKeyfile *kf;
+      guint32 flags = 0;
+      gint i;
+
+      kf = g_hash_table_lookup (builder->desktop_files, g_sequence_get (iter));
+
+      for (i = 0; i < G_N_ELEMENTS (keys); i++)
+        {
+          const gchar *value;
+
+          value = desktop_file_index_keyfile_get_value (kf, no_locales, "Desktop Entry", keys[i]);
+
+          if (value)
+            desktop_file_index_builder_write_string (builder, "", value);
+          else
+            desktop_file_index_builder_write_uint32 (builder, 0);
+        }
+
+      if (desktop_file_index_builder_get_boolean (kf, "NoDisplay"))
+        flags |= DFI_APP_SUMMARY_FLAG_NO_DISPLAY;
+
+      if (desktop_file_index_builder_get_boolean (kf, "Hidden"))
+        flags |= DFI_APP_SUMMARY_FLAG_HIDDEN;
+
+      desktop_file_index_builder_write_uint32 (builder, flags);
+    }
+
+  return offset;
+}
+
+/* See struct dfi_app_flags in common.h */
+static guint
+desktop_file_index_builder_write_app_flags (DesktopFileIndexBuilder *builder)
+{
+  const gchar *keys[DFI_APP_FLAG_N_FLAGS] = { "NoDisplay", "Hidden", "Terminal", "DBusActivatable" };
+  GSequenceIter *iter;
+  guint32 *bitmaps;
+  guint n_apps, n_words;
+  guint offset;
+  guint i;
+
+  n_apps = g_sequence_get_length (builder->app_names);
+  n_words = (n_apps + 31) / 32;
+  bitmaps = g_new0 (guint32, DFI_APP_FLAG_N_FLAGS * n_words);
+
+  foreach_sequence_item_and_position (iter, builder->app_names, i)
+    {
+      DesktopFileIndexKeyfile *kf;
+      guint flag;
+
+      kf = g_hash_table_lookup (builder->desktop_files, g_sequence_get (iter));
+
+      for (flag = 0; flag < DFI_APP_FLAG_N_FLAGS; flag++)
+        if (desktop_file_index_builder_get_boolean (kf, keys[flag]))
+          bitmaps[flag * n_words + i / 32] |= 1u << (i % 32);
+    }
+
+  offset = desktop_file_index_builder_get_aligned (builder, sizeof (guint32));
+  desktop_file_index_builder_write_uint32 (builder, n_apps);
+  desktop_file_index_builder_write_uint32 (builder, DFI_APP_FLAG_N_FLAGS);
+
+  for (i = 0; i < DFI_APP_FLAG_N_FLAGS * n_words; i++)
+    desktop_file_index_builder_write_uint32 (builder, bitmaps[i]);
+
+  g_free (bitmaps);
+
+  return offset;
+}
+
+/* See struct dfi_show_in in common.h */
+static guint
+desktop_file_index_builder_write_show_in (DesktopFileIndexBuilder *builder,
+                                          const gchar             *key,
+                                          gpointer                 data)
+{
+  const guint32 *bitmaps = data;
+  guint n_apps, n_words;
+  guint offset;
+  guint i;
+
+  n_apps = g_sequence_get_length (builder->app_names);
+  n_words = (n_apps + 31) / 32;
+
+  offset = desktop_file_index_builder_get_aligned (builder, sizeof (guint32));
+  desktop_file_index_builder_write_uint32 (builder, n_apps);
+
+  for (i = 0; i < 2 * n_words; i++)
+    desktop_file_index_builder_write_uint32 (builder, bitmaps[i]);
+
+  return offset;
+}
+
+/* Adds a section whose root structure was the last thing written */
+static void
+desktop_file_index_builder_add_section (DesktopFileIndexBuilder *builder,
+                                        struct dfi_section      *sections,
+                                        guint                   *n_sections,
+                                        guint                    type,
+                                        guint                    offset,
+                                        guint                    flags)
+{
+  struct dfi_section *section = &sections[(*n_sections)++];
+
+  section->type.le = GUINT32_TO_LE (type);
+  section->offset.le = GUINT32_TO_LE (offset);
+  section->length.le = GUINT32_TO_LE (desktop_file_index_builder_get_offset (builder) - offset);
+  section->flags.le = GUINT32_TO_LE (flags);
+}
+
+static void
+desktop_file_index_builder_serialise (DesktopFileIndexBuilder *builder)
+{
+  struct dfi_section sections[DFI_SECTION_N_TYPES - 1];
+  guint32 offsets[DFI_SECTION_N_TYPES] = { 0, };
+  guint n_sections = 0;
+
+  builder->string = g_string_new (NULL);
+  builder->name_columns = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  if (builder->segments)
+    {
+      DesktopFileIndexSegment *core;
+
+      core = g_slice_new0 (DesktopFileIndexSegment);
+      core->group = g_strdup ("");
+      g_ptr_array_add (builder->segments, core);
+    }
+
+  /* Make room for the header, with enough space for all the sections */
+  g_string_set_size (builder->string, G_STRUCT_OFFSET (struct dfi_header, sections) + sizeof sections);
+  memset (builder->string->str, 0, builder->string->len);
+
+  /* Write out the C string table, filling in the offsets
+   *
+   * We have to do this first because all of the string lists (apps,
+   * keys, locales, groups) are stored as strings in the C locale.
+   */
+  {
+    GHashTable *c_table;
+
+    c_table = desktop_file_index_builder_get_string_table (builder, "");
+    desktop_file_index_string_table_write (c_table, NULL, builder->hot_strings, builder->string_lengths, builder->string);
+  }
+
+  /* Write out the string lists.  This will work because they only
+   * refer to strings in the C locale.
+   */
+  {
+    offsets[DFI_SECTION_APP_NAMES] = desktop_file_index_builder_write_string_list (builder, builder->app_names);
+    desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_APP_NAMES,
+                                            offsets[DFI_SECTION_APP_NAMES], DFI_SECTION_FLAG_WILLNEED);
+    offsets[DFI_SECTION_KEY_NAMES] = desktop_file_index_builder_write_string_list (builder, builder->key_names);
+    desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_KEY_NAMES,
+                                            offsets[DFI_SECTION_KEY_NAMES], DFI_SECTION_FLAG_WILLNEED);
+    offsets[DFI_SECTION_LOCALE_NAMES] = desktop_file_index_builder_write_string_list (builder, builder->locale_names);
+    desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_LOCALE_NAMES,
+                                            offsets[DFI_SECTION_LOCALE_NAMES], DFI_SECTION_FLAG_WILLNEED);
+    offsets[DFI_SECTION_GROUP_NAMES] = desktop_file_index_builder_write_string_list (builder, builder->group_names);
+    desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_GROUP_NAMES,
+                                            offsets[DFI_SECTION_GROUP_NAMES], DFI_SECTION_FLAG_WILLNEED);
+  }
+
+  /* Write out the locale fallbacks, with their own list of names */
+  {
+    guint names_offset;
+
+    names_offset = desktop_file_index_builder_write_string_list (builder, builder->fallback_names);
+    offsets[DFI_SECTION_LOCALE_FALLBACKS] = desktop_file_index_builder_write_pointer_array (builder,
+                                                                                            builder->fallback_names,
+                                                                                            names_offset,
+                                                                                            builder->locale_fallbacks,
+                                                                                            NULL,
+                                                                                            desktop_file_index_builder_write_id_list);
+    desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_LOCALE_FALLBACKS,
+                                            offsets[DFI_SECTION_LOCALE_FALLBACKS], 0);
+  }
+
+  /* Write out the display order of the apps (see
+   * desktop_file_index_builder_sort_apps() for the collation).  Locales
+   * that collate the same names in the same way share their list.
+   */
+  {
+    GHashTable *written;
+    GHashTable *lists;
+    GSequenceIter *iter;
+
+    written = g_hash_table_new_full (g_bytes_hash, g_bytes_equal, (GDestroyNotify) g_bytes_unref, NULL);
+    lists = g_hash_table_new (g_str_hash, g_str_equal);
+
+    foreach_sequence_item (iter, builder->locale_names)
+      {
+        const gchar *locale = g_sequence_get (iter);
+        GArray *id_list;
+        gpointer offset;
+        GBytes *bytes;
+
+        id_list = g_hash_table_lookup (builder->sorted_apps, locale);
+        bytes = g_bytes_new (id_list->data, id_list->len * sizeof (guint));
+
+        if (!g_hash_table_lookup_extended (written, bytes, NULL, &offset))
+          {
+            offset = GUINT_TO_POINTER (desktop_file_index_builder_write_id_list (builder, locale, id_list));
+            g_hash_table_insert (written, g_bytes_ref (bytes), offset);
+          }
+
+        g_hash_table_insert (lists, (gpointer) locale, offset);
+        g_bytes_unref (bytes);
+      }
+
+    offsets[DFI_SECTION_SORTED_APPS] = desktop_file_index_builder_write_pointer_array (builder,
+                                                                                       builder->locale_names,
+                                                                                       offsets[DFI_SECTION_LOCALE_NAMES],
+                                                                                       lists,
+                                                                                       NULL,
+                                                                                       desktop_file_index_builder_get_written);
+    desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_SORTED_APPS,
+                                            offsets[DFI_SECTION_SORTED_APPS], 0);
+
+    g_hash_table_unref (written);
+    g_hash_table_unref (lists);
+  }
+
+  /* Write out the app summary */
+  {
+    offsets[DFI_SECTION_APP_SUMMARY] = desktop_file_index_builder_write_app_summary (builder);
+    desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_APP_SUMMARY,
+                                            offsets[DFI_SECTION_APP_SUMMARY], DFI_SECTION_FLAG_SEQUENTIAL);
+  }
+
+  /* Write out the bitmaps of the boolean keys */
+  {
+    offsets[DFI_SECTION_APP_FLAGS] = desktop_file_index_builder_write_app_flags (builder);
+    desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_APP_FLAGS,
+                                            offsets[DFI_SECTION_APP_FLAGS], DFI_SECTION_FLAG_WILLNEED);
+  }
+
+  /* Write out the per-desktop visibility, with its own list of names */
+  {
+    guint names_offset;
+
+    names_offset = desktop_file_index_builder_write_string_list (builder, builder->desktop_names);
+    offsets[DFI_SECTION_SHOW_IN] = desktop_file_index_builder_write_pointer_array (builder,
+                                                                                   builder->desktop_names,
+                                                                                   names_offset,
+                                                                                   builder->show_in,
+                                                                                   NULL,
+                                                                                   desktop_file_index_builder_write_show_in);
+    desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_SHOW_IN,
+                                            offsets[DFI_SECTION_SHOW_IN], DFI_SECTION_FLAG_WILLNEED);
+  }
+
+  /* Write out the apps in each category, with their own list of names */
+  {
+    guint names_offset;
+
+    names_offset = desktop_file_index_builder_write_string_list (builder, builder->category_names);
+    offsets[DFI_SECTION_CATEGORIES] = desktop_file_index_builder_write_pointer_array (builder,
+                                                                                      builder->category_names,
+                                                                                      names_offset,
+                                                                                      builder->categories,
+                                                                                      NULL,
+                                                                                      desktop_file_index_builder_write_id_list);
+    desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_CATEGORIES,
+                                            offsets[DFI_SECTION_CATEGORIES], 0);
+  }
+
+  /* Write out the apps for each window class and program name */
+  {
+    guint names_offset;
+
+    names_offset = desktop_file_index_builder_write_string_list (builder, builder->wm_class_names);
+    offsets[DFI_SECTION_STARTUP_WM_CLASSES] = desktop_file_index_builder_write_pointer_array (builder,
+                                                                                              builder->wm_class_names,
+                                                                                              names_offset,
+                                                                                              builder->startup_wm_classes,
+                                                                                              NULL,
+                                                                                              desktop_file_index_builder_write_id_list);
+    desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_STARTUP_WM_CLASSES,
+                                            offsets[DFI_SECTION_STARTUP_WM_CLASSES], 0);
+
+    names_offset = desktop_file_index_builder_write_string_list (builder, builder->executable_names);
+    offsets[DFI_SECTION_EXECUTABLES] = desktop_file_index_builder_write_pointer_array (builder,
+                                                                                       builder->executable_names,
+                                                                                       names_offset,
+                                                                                       builder->executables,
+                                                                                       NULL,
+                                                                                       desktop_file_index_builder_write_id_list);
+    desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_EXECUTABLES,
+                                            offsets[DFI_SECTION_EXECUTABLES], 0);
+  }
+
+  /* Write out the group implementors */
+  {
+    /*
+    offsets[DFI_SECTION_IMPLEMENTORS] = desktop_file_index_builder_write_pointer_array (builder,
+                                                                       builder->group_names,
+                                                                       offsets[DFI_SECTION_GROUP_NAMES],
+                                                                       builder->group_implementors,
+                                                                       NULL,
+                                                                       desktop_file_index_builder_write_id_list);
+                                                                       */
+  }
+
+  /* Write out the text indexes for the actual locales.
+   *
+   * Note: we do this by visiting each item in the locale string list,
+   * which doesn't include the C locale, so we won't end up emitting the
+   * C locale again here.
+   *
+   * Note: this function will write out the locale-specific string
+   * tables alongside the table for each locale in order to improve
+   * locality.  When splitting by locale, it also takes care of putting
+   * each locale group into its own segment.
+   */
+  {
+    guint *order;
+
+    order = desktop_file_index_builder_get_write_order (builder, builder->locale_names,
+                                                        desktop_file_index_profile_get_locale_hits);
+    if (builder->segments)
+      order = desktop_file_index_builder_group_write_order (builder, builder->locale_names, order);
+
+    if (builder->front_coded)
+      {
+        offsets[DFI_SECTION_TOKEN_DICTIONARIES] = desktop_file_index_builder_write_pointer_array (builder,
+                                                                                                builder->locale_names,
+                                                                                                offsets[DFI_SECTION_LOCALE_NAMES],
+                                                                                                builder->locale_text_indexes,
+                                                                                                order,
+                                                                                                desktop_file_index_builder_write_token_dictionary);
+        desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_TOKEN_DICTIONARIES,
+                                                offsets[DFI_SECTION_TOKEN_DICTIONARIES], DFI_SECTION_FLAG_WILLNEED);
+      }
+    else
+      {
+        offsets[DFI_SECTION_TEXT_INDEXES] = desktop_file_index_builder_write_pointer_array (builder,
+                                                                                            builder->locale_names,
+                                                                                            offsets[DFI_SECTION_LOCALE_NAMES],
+                                                                                            builder->locale_text_indexes,
+                                                                                            order,
+                                                                                            desktop_file_index_builder_write_text_index);
+        desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_TEXT_INDEXES,
+                                                offsets[DFI_SECTION_TEXT_INDEXES], DFI_SECTION_FLAG_WILLNEED);
+      }
+    g_free (order);
+  }
+
+  /* Write out the pointer array for the Names, which were written along
+   * with the text indexes
+   */
+  {
+    offsets[DFI_SECTION_DISPLAY_NAMES] = desktop_file_index_builder_write_pointer_array (builder,
+                                                                                         builder->locale_names,
+                                                                                         offsets[DFI_SECTION_LOCALE_NAMES],
+                                                                                         builder->name_columns,
+                                                                                         NULL,
+                                                                                         desktop_file_index_builder_get_written);
+    desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_DISPLAY_NAMES,
+                                            offsets[DFI_SECTION_DISPLAY_NAMES], 0);
+  }
+
+  /* Write out the pointer array for the suffix arrays, if we have them */
+  if (builder->suffix_arrays)
+    {
+      offsets[DFI_SECTION_SUFFIX_ARRAYS] = desktop_file_index_builder_write_pointer_array (builder,
+                                                                                           builder->locale_names,
+                                                                                           offsets[DFI_SECTION_LOCALE_NAMES],
+                                                                                           builder->suffix_arrays,
+                                                                                           NULL,
+                                                                                           desktop_file_index_builder_get_written);
+      desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_SUFFIX_ARRAYS,
+                                              offsets[DFI_SECTION_SUFFIX_ARRAYS], 0);
+    }
+
+  /* Likewise for the position tables */
+  if (builder->position_tables)
+    {
+      offsets[DFI_SECTION_POSITIONS] = desktop_file_index_builder_write_pointer_array (builder,
+                                                                                       builder->locale_names,
+                                                                                       offsets[DFI_SECTION_LOCALE_NAMES],
+                                                                                       builder->position_tables,
+                                                                                       NULL,
+                                                                                       desktop_file_index_builder_get_written);
+      desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_POSITIONS,
+                                              offsets[DFI_SECTION_POSITIONS], 0);
+    }
+
+  /* Write out the desktop file contents.
+   *
+   * We have to do this last because the desktop files refer to strings
+   * from all the locales and those are only actually written in the
+   * last step.
+   *
+   * TODO: we could improve things a bit by storing the desktop files at
+   * the front of the cache, but this would require a two-pass
    * approach...
+   *
+   * If we have a profile, the most used desktop files go first.
+   */
+  {
+    guint *order;
+
+    order = desktop_file_index_builder_get_write_order (builder, builder->app_names,
+                                                        desktop_file_index_profile_get_app_hits);
+    offsets[DFI_SECTION_DESKTOP_FILES] = desktop_file_index_builder_write_pointer_array (builder,
+                                                                                         builder->app_names,
+                                                                                         offsets[DFI_SECTION_APP_NAMES],
+                                                                                         builder->desktop_files,
+                                                                                         order,
+                                                                                         desktop_file_index_builder_write_keyfile);
+    desktop_file_index_builder_add_section (builder, sections, &n_sections, DFI_SECTION_DESKTOP_FILES,
+                                            offsets[DFI_SECTION_DESKTOP_FILES], DFI_SECTION_FLAG_WILLNEED);
+    g_free (order);
+  }
+
+  /* Write out the mime types index */
+  {
+    //offsets[DFI_SECTION_MIME_TYPES] = desktop_file_index_builder_write_text_index (builder, NULL, builder->mime_types);
+  }
+
+  /* Write out the segment table, if we are splitting.  Readers that
+   * don't know about segments would misread everything else.
    */
+  if (builder->segments)
+    {
+      guint length;
+
+      offsets[DFI_SECTION_SEGMENTS] = desktop_file_index_builder_write_segment_table (builder, &length);
+      sections[n_sections].type.le = GUINT32_TO_LE (DFI_SECTION_SEGMENTS);
+      sections[n_sections].offset.le = GUINT32_TO_LE (offsets[DFI_SECTION_SEGMENTS]);
+      sections[n_sections].length.le = GUINT32_TO_LE (length);
+      sections[n_sections].flags.le = GUINT32_TO_LE (DFI_SECTION_FLAG_REQUIRED);
+      n_sections++;
+    }
+
+  /* Replace the header */
   {
-    header_fields[6] = desktop_file_index_builder_write_pointer_array (builder,
-                                                                       builder->app_names,
-                                                                       header_fields[0],
-                                                                       builder->desktop_files,
-                                                                       desktop_file_index_builder_write_keyfile);
+    struct dfi_header *header = (struct dfi_header *) builder->string->str;
+    guint32 flags = 0;
+
+    header->magic.le = GUINT32_TO_LE (DFI_HEADER_MAGIC);
+    header->version.le = GUINT16_TO_LE (DFI_HEADER_VERSION);
+    header->n_sections.le = GUINT16_TO_LE (n_sections);
+
+    if (builder->wide_ids)
+      flags |= DFI_HEADER_FLAG_WIDE_IDS;
+
+    if (builder->string_lengths)
+      flags |= DFI_HEADER_FLAG_STRING_LENGTHS;
+
+    if (builder->overlays)
+      flags |= DFI_HEADER_FLAG_OVERLAYS;
+
+    header->flags.le = GUINT32_TO_LE (flags);
+    memcpy (header->sections, sections, n_sections * sizeof (struct dfi_section));
   }
+}
+
+static void
+desktop_file_index_builder_mark_hot (DesktopFileIndexBuilder *builder,
+                                     const gchar             *string,
+                                     guint                    hits)
+{
+  guint old_hits;
+
+  old_hits = GPOINTER_TO_UINT (g_hash_table_lookup (builder->hot_strings, string));
+
+  /* saturate */
+  if (hits > G_MAXUINT - old_hits)
+    hits = G_MAXUINT - old_hits;
+
+  if (old_hits + hits)
+    g_hash_table_insert (builder->hot_strings, g_strdup (string), GUINT_TO_POINTER (old_hits + hits));
+}
+
+static void
+desktop_file_index_builder_mark_list_hot (DesktopFileIndexBuilder *builder,
+                                          GSequence               *string_list)
+{
+  GSequenceIter *iter;
+
+  /* The string lists are binary searched on almost every access, so
+   * they are the hottest strings of all.
+   */
+  foreach_sequence_item (iter, string_list)
+    desktop_file_index_builder_mark_hot (builder, g_sequence_get (iter), G_MAXUINT);
+}
+
+static void
+desktop_file_index_builder_add_strings_for_keyfile (DesktopFileIndexBuilder *builder,
+                                                    DesktopFileIndexKeyfile *keyfile)
+{
+  guint n_groups;
+  guint i;
+
+  n_groups = desktop_file_index_keyfile_get_n_groups (keyfile);
+
+  for (i = 0; i < n_groups; i++)
+    {
+      const gchar *group_name;
+      guint start, end;
+      guint j;
+
+      group_name = desktop_file_index_keyfile_get_group_name (keyfile, i);
+      desktop_file_index_keyfile_get_group_range (keyfile, i, &start, &end);
+
+      desktop_file_index_string_list_ensure (builder->group_names, group_name);
+
+      for (j = start; j < end; j++)
+        {
+          const gchar *key, *locale, *value;
+
+          desktop_file_index_keyfile_get_item (keyfile, j, &key, &locale, &value);
+
+          desktop_file_index_string_list_ensure (builder->key_names, key);
+
+          if (locale)
+            desktop_file_index_string_list_ensure (builder->locale_names, locale);
+
+          desktop_file_index_string_tables_add_string (builder->locale_string_tables, locale, value);
+
+          /* Values are hot if the profile says that their key is used,
+           * and in the case of translations, that their locale is used.
+           */
+          if (builder->profile && (locale[0] == '\0' || desktop_file_index_profile_get_locale_hits (builder->profile, locale)))
+            desktop_file_index_builder_mark_hot (builder, value, desktop_file_index_profile_get_key_hits (builder->profile, key));
+        }
+    }
+}
+
+/* language[_territory][@modifier] -> language[_territory].codeset[@modifier] */
+static gchar *
+desktop_file_index_builder_add_codeset (const gchar *locale,
+                                        const gchar *codeset)
+{
+  const gchar *modifier;
+
+  modifier = strchr (locale, '@');
+  if (modifier == NULL)
+    modifier = locale + strlen (locale);
+
+  return g_strdup_printf ("%.*s.%s%s", (gint) (modifier - locale), locale, codeset, modifier);
+}
+
+static void
+desktop_file_index_builder_add_locale_fallback (DesktopFileIndexBuilder *builder,
+                                                const gchar             *name,
+                                                GArray                  *locale_ids)
+{
+  GArray *id_list;
+
+  id_list = desktop_file_index_id_list_new ();
+  desktop_file_index_id_list_add_ids (id_list, (const guint *) locale_ids->data, locale_ids->len);
+
+  desktop_file_index_string_list_ensure (builder->fallback_names, name);
+  g_hash_table_replace (builder->locale_fallbacks, g_strdup (name), id_list);
+}
+
+/* For each locale, the ids of the locales to look in, most specific
+ * first, so that readers don't have to work them out.  The same goes
+ * for the UTF-8 versions of the names, as found in the environment.
+ */
+static void
+desktop_file_index_builder_add_locale_fallbacks (DesktopFileIndexBuilder *builder)
+{
+  const gchar *c_names[] = { "C", "C.UTF-8", "C.utf8", "POSIX" };
+  GSequenceIter *iter;
+  GArray *locale_ids;
+  guint c_id;
+  guint i;
+
+  builder->fallback_names = desktop_file_index_string_list_new ();
+  builder->locale_fallbacks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                     (GDestroyNotify) desktop_file_index_id_list_free);
+
+  desktop_file_index_string_list_ensure (builder->locale_names, "");
+  c_id = desktop_file_index_string_list_get_id (builder->locale_names, "");
+
+  locale_ids = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  foreach_sequence_item (iter, builder->locale_names)
+    {
+      const gchar *locale = g_sequence_get (iter);
+      gchar **variants;
+      gchar *name;
+
+      g_array_set_size (locale_ids, 0);
+
+      if (locale[0])
+        {
+          variants = g_get_locale_variants (locale);
+
+          for (i = 0; variants[i]; i++)
+            {
+              GSequenceIter *variant;
+
+              variant = g_sequence_lookup (builder->locale_names, variants[i], (GCompareDataFunc) strcmp, NULL);
+              if (variant)
+                {
+                  guint id = g_sequence_iter_get_position (variant);
+
+                  g_array_append_val (locale_ids, id);
+                }
+            }
+
+          g_strfreev (variants);
+        }
+
+      g_array_append_val (locale_ids, c_id);
+
+      desktop_file_index_builder_add_locale_fallback (builder, locale, locale_ids);
+
+      /* Desktop files don't give codesets, so fr_FR.UTF-8 is the same as fr_FR */
+      if (!locale[0] || strchr (locale, '.'))
+        continue;
+
+      name = desktop_file_index_builder_add_codeset (locale, "UTF-8");
+      desktop_file_index_builder_add_locale_fallback (builder, name, locale_ids);
+      g_free (name);
+
+      name = desktop_file_index_builder_add_codeset (locale, "utf8");
+      desktop_file_index_builder_add_locale_fallback (builder, name, locale_ids);
+      g_free (name);
+    }
+
+  g_array_set_size (locale_ids, 0);
+  g_array_append_val (locale_ids, c_id);
+
+  for (i = 0; i < G_N_ELEMENTS (c_names); i++)
+    desktop_file_index_builder_add_locale_fallback (builder, c_names[i], locale_ids);
+
+  g_array_free (locale_ids, TRUE);
+}
+
+/* The Name that each locale displays for an app can come from one of
+ * its fallbacks.  Give every locale's string table all of its Names so
+ * that its name column doesn't have to point into another segment.
+ */
+static void
+desktop_file_index_builder_add_display_names (DesktopFileIndexBuilder *builder)
+{
+  GSequenceIter *iter;
+
+  foreach_sequence_item (iter, builder->locale_names)
+    {
+      const gchar *locale = g_sequence_get (iter);
+      gchar **locale_variants;
+      GSequenceIter *app_iter;
+
+      locale_variants = g_get_locale_variants (locale);
+
+      foreach_sequence_item (app_iter, builder->app_names)
+        {
+          DesktopFileIndexKeyfile *kf;
+          const gchar *from_locale;
+          const gchar *name;
+
+          kf = g_hash_table_lookup (builder->desktop_files, g_sequence_get (app_iter));
+          name = desktop_file_index_keyfile_get_localised_value (kf, (const gchar **) locale_variants,
+                                                                 "Desktop Entry", "Name", &from_locale);
+
+          if (name && !g_str_equal (from_locale, locale))
+            desktop_file_index_string_tables_add_string (builder->locale_string_tables, locale, name);
+        }
+
+      g_strfreev (locale_variants);
+    }
+}
+
+static void
+desktop_file_index_builder_set_show_in (DesktopFileIndexBuilder *builder,
+                                        const gchar             *name,
+                                        guint                    which,
+                                        guint                    app_id)
+{
+  guint32 *bitmaps;
+  guint n_words;
+
+  n_words = (g_sequence_get_length (builder->app_names) + 31) / 32;
+
+  bitmaps = g_hash_table_lookup (builder->show_in, name);
+  if (bitmaps == NULL)
+    {
+      bitmaps = g_new0 (guint32, 2 * n_words);
+      desktop_file_index_string_list_ensure (builder->desktop_names, name);
+      g_hash_table_insert (builder->show_in, g_strdup (name), bitmaps);
+    }
+
+  bitmaps[which * n_words + app_id / 32] |= 1u << (app_id % 32);
+}
+
+/* Collects OnlyShowIn and NotShowIn into a pair of bitmaps over the
+ * apps for each desktop name, so that readers don't have to split the
+ * lists of every app to filter them for XDG_CURRENT_DESKTOP.
+ */
+static void
+desktop_file_index_builder_add_show_in (DesktopFileIndexBuilder *builder)
+{
+  const gchar *keys[] = { "OnlyShowIn", "NotShowIn" };
+  const gchar *no_locales[] = { NULL };
+  GSequenceIter *iter;
+  guint app_id;
+
+  builder->desktop_names = desktop_file_index_string_list_new ();
+  builder->show_in = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  desktop_file_index_string_list_ensure (builder->desktop_names, "");
+  g_hash_table_insert (builder->show_in, g_strdup (""),
+                       g_new0 (guint32, 2 * ((g_sequence_get_length (builder->app_names) + 31) / 32)));
+
+  foreach_sequence_item_and_position (iter, builder->app_names, app_id)
+    {
+      DesktopFileIndexKeyfile *kf;
+      guint i;
+
+      kf = g_hash_table_lookup (builder->desktop_files, g_sequence_get (iter));
+
+      for (i = 0; i < G_N_ELEMENTS (keys); i++)
+        {
+          const gchar *value;
+          gchar **names;
+          gint j;
+
+          value = desktop_file_index_keyfile_get_value (kf, no_locales, "Desktop Entry", keys[i]);
+          if (value == NULL)
+            continue;
+
+          desktop_file_index_builder_set_show_in (builder, "", i, app_id);
 
-  /* Write out the mime types index */
-  {
-    //header_fields[7] = desktop_file_index_builder_write_text_index (builder, NULL, builder->mime_types);
-  }
+          names = g_strsplit (value, ";", 0);
+          for (j = 0; names[j]; j++)
+            if (names[j][0])
+              desktop_file_index_builder_set_show_in (builder, names[j], i, app_id);
+          g_strfreev (names);
+        }
+    }
+}
 
-  /* Replace the header */
-  {
-    guint32 *file = (guint32 *) builder->string->str;
-    gint i;
+/* Adds app_id to the id list for name, which must come after any ids
+ * already in it.
+ */
+static void
+desktop_file_index_builder_add_app_to_list (GSequence   *names,
+                                            GHashTable  *lists,
+                                            const gchar *name,
+                                            guint        app_id)
+{
+  const guint *ids;
+  GArray *id_list;
+  guint n_ids;
 
-    for (i = 0; i < G_N_ELEMENTS (header_fields); i++)
-      file[i] = GUINT32_TO_LE (header_fields[i]);
-  }
+  id_list = g_hash_table_lookup (lists, name);
+  if (id_list == NULL)
+    {
+      id_list = desktop_file_index_id_list_new ();
+      desktop_file_index_string_list_ensure (names, name);
+      g_hash_table_insert (lists, g_strdup (name), id_list);
+    }
+
+  ids = desktop_file_index_id_list_get_ids (id_list, &n_ids);
+  if (n_ids == 0 || ids[n_ids - 1] != app_id)
+    desktop_file_index_id_list_add_ids (id_list, &app_id, 1);
 }
 
+/* The apps in each category, for building menus without splitting the
+ * Categories of every app.
+ */
 static void
-desktop_file_index_builder_add_strings_for_keyfile (DesktopFileIndexBuilder *builder,
-                                                    DesktopFileIndexKeyfile *keyfile)
+desktop_file_index_builder_add_categories (DesktopFileIndexBuilder *builder)
 {
-  guint n_groups;
-  guint i;
+  const gchar *no_locales[] = { NULL };
+  GSequenceIter *iter;
+  guint app_id;
 
-  n_groups = desktop_file_index_keyfile_get_n_groups (keyfile);
+  builder->category_names = desktop_file_index_string_list_new ();
+  builder->categories = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                               (GDestroyNotify) desktop_file_index_id_list_free);
 
-  for (i = 0; i < n_groups; i++)
+  foreach_sequence_item_and_position (iter, builder->app_names, app_id)
     {
-      const gchar *group_name;
-      guint start, end;
-      guint j;
+      DesktopFileIndexKeyfile *kf;
+      const gchar *value;
+      gchar **names;
+      gint i;
 
-      group_name = desktop_file_index_keyfile_get_group_name (keyfile, i);
-      desktop_file_index_keyfile_get_group_range (keyfile, i, &start, &end);
+      kf = g_hash_table_lookup (builder->desktop_files, g_sequence_get (iter));
 
-      desktop_file_index_string_list_ensure (builder->group_names, group_name);
+      value = desktop_file_index_keyfile_get_value (kf, no_locales, "Desktop Entry", "Categories");
+      if (value == NULL)
+        continue;
 
-      for (j = start; j < end; j++)
+      names = g_strsplit (value, ";", 0);
+      for (i = 0; names[i]; i++)
+        if (names[i][0])
+          desktop_file_index_builder_add_app_to_list (builder->category_names, builder->categories, names[i], app_id);
+      g_strfreev (names);
+    }
+}
+
+/* Gives the index of the program that the env at argv[i] runs, or -1 */
+static gint
+desktop_file_index_builder_skip_env (gchar **argv,
+                                     gint    i)
+{
+  for (i++; argv[i]; i++)
+    {
+      /* Options that take the next argument */
+      if (g_str_equal (argv[i], "-u") || g_str_equal (argv[i], "--unset") ||
+          g_str_equal (argv[i], "-C") || g_str_equal (argv[i], "--chdir"))
         {
-          const gchar *key, *locale, *value;
+          if (argv[++i] == NULL)
+            break;
+        }
 
-          desktop_file_index_keyfile_get_item (keyfile, j, &key, &locale, &value);
+      /* -S splits a string into more arguments */
+      else if (g_str_has_prefix (argv[i], "-S") || g_str_has_prefix (argv[i], "--split-string"))
+        break;
 
-          desktop_file_index_string_list_ensure (builder->key_names, key);
+      else if (g_str_equal (argv[i], "--"))
+        return argv[i + 1] ? i + 1 : -1;
 
-          if (locale)
-            desktop_file_index_string_list_ensure (builder->locale_names, locale);
+      else if (argv[i][0] != '-' && !strchr (argv[i], '='))
+        return i;
+    }
 
-          desktop_file_index_string_tables_add_string (builder->locale_string_tables, locale, value);
+  return -1;
+}
+
+static gboolean
+desktop_file_index_builder_is_shell (const gchar *name)
+{
+  const gchar *shells[] = { "sh", "bash", "dash", "zsh", "ksh", "csh", "tcsh", "fish" };
+  gint i;
+
+  for (i = 0; i < G_N_ELEMENTS (shells); i++)
+    if (g_str_equal (name, shells[i]))
+      return TRUE;
+
+  return FALSE;
+}
+
+/* Gives the program of the --command option of the flatpak run at
+ * argv[i], or NULL
+ */
+static gchar *
+desktop_file_index_builder_get_flatpak_command (gchar **argv,
+                                                gint    i)
+{
+  if (argv[i + 1] == NULL || !g_str_equal (argv[i + 1], "run"))
+    return NULL;
+
+  /* The options end at the app id */
+  for (i += 2; argv[i] && argv[i][0] == '-'; i++)
+    {
+      if (g_str_has_prefix (argv[i], "--command="))
+        return g_strdup (argv[i] + strlen ("--command="));
+
+      if (g_str_equal (argv[i], "--command"))
+        return g_strdup (argv[i + 1]);
+    }
+
+  return NULL;
+}
+
+/* The program that Exec runs, or NULL if it can't be parsed or if it
+ * isn't known until the app runs.  Windows get matched to apps by the
+ * program that really runs, so:
+ *
+ *  - env is skipped, along with its options and NAME=value arguments
+ *  - flatpak run gives the program of its --command option, if any
+ *  - a shell, or flatpak without --command, gives NULL, so that the
+ *    launcher doesn't get all of the apps that use it
+ *
+ * Other wrappers are taken to be the program.
+ */
+static gchar *
+desktop_file_index_builder_get_exec_program (const gchar *exec)
+{
+  gchar *program = NULL;
+  gchar *name = NULL;
+  gchar **argv;
+  gint i = 0;
+
+  if (!g_shell_parse_argv (exec, NULL, &argv, NULL))
+    return NULL;
+
+  while (i >= 0)
+    {
+      g_free (name);
+      name = g_path_get_basename (argv[i]);
+
+      if (!g_str_equal (name, "env"))
+        break;
+
+      i = desktop_file_index_builder_skip_env (argv, i);
+    }
+
+  if (i < 0 || desktop_file_index_builder_is_shell (name))
+    ;
+  else if (g_str_equal (name, "flatpak"))
+    program = desktop_file_index_builder_get_flatpak_command (argv, i);
+  else
+    program = g_strdup (argv[i]);
+
+  g_free (name);
+  g_strfreev (argv);
+
+  return program;
+}
+
+/* The apps for each StartupWMClass and for the basename of each program
+ * in Exec (see desktop_file_index_builder_get_exec_program()) and
+ * TryExec, for matching windows to their apps.
+ */
+static void
+desktop_file_index_builder_add_window_matches (DesktopFileIndexBuilder *builder)
+{
+  const gchar *no_locales[] = { NULL };
+  GSequenceIter *iter;
+  guint app_id;
+
+  builder->wm_class_names = desktop_file_index_string_list_new ();
+  builder->startup_wm_classes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                       (GDestroyNotify) desktop_file_index_id_list_free);
+  builder->executable_names = desktop_file_index_string_list_new ();
+  builder->executables = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify) desktop_file_index_id_list_free);
+
+  foreach_sequence_item_and_position (iter, builder->app_names, app_id)
+    {
+      DesktopFileIndexKeyfile *kf;
+      const gchar *value;
+      gchar *programs[2];
+      gint i;
+
+      kf = g_hash_table_lookup (builder->desktop_files, g_sequence_get (iter));
+
+      value = desktop_file_index_keyfile_get_value (kf, no_locales, "Desktop Entry", "StartupWMClass");
+      if (value && value[0])
+        desktop_file_index_builder_add_app_to_list (builder->wm_class_names, builder->startup_wm_classes, value, app_id);
+
+      value = desktop_file_index_keyfile_get_value (kf, no_locales, "Desktop Entry", "Exec");
+      programs[0] = value ? desktop_file_index_builder_get_exec_program (value) : NULL;
+
+      value = desktop_file_index_keyfile_get_value (kf, no_locales, "Desktop Entry", "TryExec");
+      programs[1] = g_strdup (value);
+
+      for (i = 0; i < G_N_ELEMENTS (programs); i++)
+        {
+          gchar *basename;
+
+          if (programs[i] == NULL || !programs[i][0])
+            {
+              g_free (programs[i]);
+              continue;
+            }
+
+          basename = g_path_get_basename (programs[i]);
+          if (!g_str_equal (basename, "/") && !g_str_equal (basename, "."))
+            desktop_file_index_builder_add_app_to_list (builder->executable_names, builder->executables, basename, app_id);
+
+          g_free (basename);
+          g_free (programs[i]);
         }
     }
 }
@@ -464,7 +1968,8 @@ static void
 desktop_file_index_builder_add_strings (DesktopFileIndexBuilder *builder)
 {
   GHashTableIter keyfile_iter;
-  gpointer key, value;
+  GSequenceIter *iter;
+  gpointer key;
 
   builder->locale_string_tables = desktop_file_index_string_tables_create ();
   builder->app_names = desktop_file_index_string_list_new ();
@@ -472,16 +1977,31 @@ desktop_file_index_builder_add_strings (DesktopFileIndexBuilder *builder)
   builder->locale_names = desktop_file_index_string_list_new ();
   builder->group_names = desktop_file_index_string_list_new ();
 
+  if (builder->profile)
+    builder->hot_strings = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  /* Visit the desktop files in sorted order (rather than hash table
+   * order) so that the output doesn't depend on the order that the
+   * files were found in.
+   */
   g_hash_table_iter_init (&keyfile_iter, builder->desktop_files);
-  while (g_hash_table_iter_next (&keyfile_iter, &key, &value))
+  while (g_hash_table_iter_next (&keyfile_iter, &key, NULL))
+    desktop_file_index_string_list_ensure (builder->app_names, key);
+
+  foreach_sequence_item (iter, builder->app_names)
     {
-      DesktopFileIndexKeyfile *keyfile = value;
-      const gchar *app = key;
+      DesktopFileIndexKeyfile *keyfile;
 
-      desktop_file_index_string_list_ensure (builder->app_names, app);
+      keyfile = g_hash_table_lookup (builder->desktop_files, g_sequence_get (iter));
       desktop_file_index_builder_add_strings_for_keyfile (builder, keyfile);
     }
 
+  desktop_file_index_builder_add_locale_fallbacks (builder);
+  desktop_file_index_builder_add_display_names (builder);
+  desktop_file_index_builder_add_show_in (builder);
+  desktop_file_index_builder_add_categories (builder);
+  desktop_file_index_builder_add_window_matches (builder);
+
   {
     GHashTable *c_string_table;
 
@@ -491,18 +2011,32 @@ desktop_file_index_builder_add_strings (DesktopFileIndexBuilder *builder)
     desktop_file_index_string_list_populate_strings (builder->group_names, c_string_table);
     desktop_file_index_string_list_populate_strings (builder->key_names, c_string_table);
     desktop_file_index_string_list_populate_strings (builder->locale_names, c_string_table);
+    desktop_file_index_string_list_populate_strings (builder->fallback_names, c_string_table);
+    desktop_file_index_string_list_populate_strings (builder->desktop_names, c_string_table);
+    desktop_file_index_string_list_populate_strings (builder->category_names, c_string_table);
+    desktop_file_index_string_list_populate_strings (builder->wm_class_names, c_string_table);
+    desktop_file_index_string_list_populate_strings (builder->executable_names, c_string_table);
   }
+
+  if (builder->hot_strings)
+    {
+      desktop_file_index_builder_mark_list_hot (builder, builder->app_names);
+      desktop_file_index_builder_mark_list_hot (builder, builder->group_names);
+      desktop_file_index_builder_mark_list_hot (builder, builder->key_names);
+      desktop_file_index_builder_mark_list_hot (builder, builder->locale_names);
+    }
 }
 
 static GSequence *
 desktop_file_index_builder_index_one_locale (DesktopFileIndexBuilder *builder,
+                                             DfiTokenizer            *tokenizer,
                                              const gchar             *locale)
 {
   const gchar *fields[] = { "Name", "GenericName", "X-GNOME-FullName", "Comment", "Keywords" };
   gchar **locale_variants;
-  GHashTableIter keyfile_iter;
-  gpointer key, val;
+  GSequenceIter *iter;
   GSequence *text_index;
+  guint app_id;
 
   if (locale)
     locale_variants = g_get_locale_variants (locale);
@@ -511,13 +2045,16 @@ desktop_file_index_builder_index_one_locale (DesktopFileIndexBuilder *builder,
 
   text_index = desktop_file_index_text_index_new ();
 
-  g_hash_table_iter_init (&keyfile_iter, builder->desktop_files);
-  while (g_hash_table_iter_next (&keyfile_iter, &key, &val))
+  /* Visit the apps in id order so that each id list comes out sorted
+   * and the output is reproducible.
+   */
+  foreach_sequence_item_and_position (iter, builder->app_names, app_id)
     {
-      DesktopFileIndexKeyfile *kf = val;
-      const gchar *app = key;
+      DesktopFileIndexKeyfile *kf;
       gint i;
 
+      kf = g_hash_table_lookup (builder->desktop_files, g_sequence_get (iter));
+
       for (i = 0; i < G_N_ELEMENTS (fields); i++)
         {
           const gchar *value;
@@ -526,13 +2063,13 @@ desktop_file_index_builder_index_one_locale (DesktopFileIndexBuilder *builder,
 
           if (value)
             {
-              guint16 ids[3];
+              guint ids[3];
 
-              ids[0] = desktop_file_index_string_list_get_id (builder->app_names, app);
+              ids[0] = app_id;
               ids[1] = desktop_file_index_string_list_get_id (builder->group_names, "Desktop Entry");
               ids[2] = desktop_file_index_string_list_get_id (builder->key_names, fields[i]);
 
-              desktop_file_index_text_index_add_ids_tokenised (text_index, value, ids, 3);
+              desktop_file_index_text_index_add_ids_tokenised (text_index, tokenizer, value, ids, 3, builder->position_tables != NULL);
             }
         }
     }
@@ -546,11 +2083,17 @@ static void
 desktop_file_index_builder_index_strings (DesktopFileIndexBuilder *builder)
 {
   GHashTable *c_string_table;
+  DfiTokenizer *tokenizer;
   GSequenceIter *iter;
 
+  tokenizer = dfi_tokenizer_new (DFI_TOKENIZER_FLAGS_UNACCENTED | DFI_TOKENIZER_FLAGS_CJK_UNIGRAMS);
+
   c_string_table = desktop_file_index_string_tables_get_table (builder->locale_string_tables, "");
-  builder->c_text_index = desktop_file_index_builder_index_one_locale (builder, "");
-  desktop_file_index_text_index_populate_strings (builder->c_text_index, c_string_table);
+  builder->c_text_index = desktop_file_index_builder_index_one_locale (builder, tokenizer, "");
+
+  /* Token dictionaries store their tokens inline */
+  if (!builder->front_coded)
+    desktop_file_index_text_index_populate_strings (builder->c_text_index, c_string_table);
 
   builder->locale_text_indexes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
                                                         (GDestroyNotify) g_sequence_free);
@@ -561,11 +2104,323 @@ desktop_file_index_builder_index_strings (DesktopFileIndexBuilder *builder)
       GHashTable *string_table;
       GSequence *text_index;
 
-      text_index = desktop_file_index_builder_index_one_locale (builder, locale);
+      text_index = desktop_file_index_builder_index_one_locale (builder, tokenizer, locale);
+
+      /* Untranslated strings give the same tokens as in the C locale */
+      if (builder->overlays && locale[0])
+        {
+          GSequence *overlay;
+
+          overlay = desktop_file_index_text_index_new_overlay (text_index, builder->c_text_index);
+          g_sequence_free (text_index);
+          text_index = overlay;
+        }
+
       g_hash_table_insert (builder->locale_text_indexes, g_strdup (locale), text_index);
+
+      if (builder->front_coded)
+        continue;
+
       string_table = desktop_file_index_string_tables_get_table (builder->locale_string_tables, locale);
       desktop_file_index_text_index_populate_strings (text_index, string_table);
+
+      /* The tokens of used locales get binary searched, so they're hot */
+      if (builder->hot_strings)
+        {
+          guint hits = desktop_file_index_profile_get_locale_hits (builder->profile, locale);
+          GSequenceIter *item_iter;
+
+          if (hits)
+            foreach_sequence_item (item_iter, text_index)
+              {
+                const gchar *token;
+                GArray *id_list;
+
+                desktop_file_index_text_index_get_item (item_iter, &token, &id_list);
+                desktop_file_index_builder_mark_hot (builder, token, hits);
+              }
+        }
+    }
+
+  dfi_tokenizer_free (tokenizer);
+}
+
+typedef struct
+{
+  gchar *key;                        /* sort key of the Name, or NULL */
+  guint  app_id;
+} DesktopFileIndexSortEntry;
+
+static gint
+desktop_file_index_builder_compare_sort_entries (gconstpointer a,
+                                                 gconstpointer b)
+{
+  const DesktopFileIndexSortEntry *entry_a = a;
+  const DesktopFileIndexSortEntry *entry_b = b;
+
+  /* Apps without a Name go last */
+  if (entry_a->key && entry_b->key)
+    {
+      gint x = strcmp (entry_a->key, entry_b->key);
+
+      if (x != 0)
+        return x;
+    }
+  else if (entry_a->key || entry_b->key)
+    return entry_a->key ? -1 : 1;
+
+  return entry_a->app_id < entry_b->app_id ? -1 : entry_a->app_id > entry_b->app_id;
+}
+
+static GArray *
+desktop_file_index_builder_sort_apps_for_locale (DesktopFileIndexBuilder *builder,
+                                                 const gchar             *locale,
+                                                 gboolean                 collate)
+{
+  DesktopFileIndexSortEntry *entries;
+  gchar **locale_variants;
+  GSequenceIter *iter;
+  GArray *id_list;
+  guint n_apps;
+  guint i;
+
+  locale_variants = g_get_locale_variants (locale);
+
+  n_apps = g_sequence_get_length (builder->app_names);
+  entries = g_new (DesktopFileIndexSortEntry, n_apps);
+
+  foreach_sequence_item_and_position (iter, builder->app_names, i)
+    {
+      DesktopFileIndexKeyfile *kf;
+      const gchar *name;
+
+      kf = g_hash_table_lookup (builder->desktop_files, g_sequence_get (iter));
+      name = desktop_file_index_keyfile_get_value (kf, (const gchar **) locale_variants, "Desktop Entry", "Name");
+
+      if (name == NULL)
+        entries[i].key = NULL;
+      else if (collate)
+        entries[i].key = g_utf8_collate_key (name, -1);
+      else if (g_utf8_validate (name, -1, NULL))
+        entries[i].key = dfi_tokenizer_fold (name, -1);
+      else
+        entries[i].key = g_strdup (name);
+
+      entries[i].app_id = i;
+    }
+
+  if (n_apps > 1)
+    qsort (entries, n_apps, sizeof (DesktopFileIndexSortEntry), desktop_file_index_builder_compare_sort_entries);
+
+  id_list = desktop_file_index_id_list_new ();
+
+  for (i = 0; i < n_apps; i++)
+    {
+      desktop_file_index_id_list_add_ids (id_list, &entries[i].app_id, 1);
+      g_free (entries[i].key);
+    }
+
+  g_strfreev (locale_variants);
+  g_free (entries);
+
+  return id_list;
+}
+
+/* Puts the apps in the order that each locale displays them in, so
+ * that readers don't need to collate.  A locale that is installed on
+ * the build machine gets its own collation rules.  The untranslated
+ * names, and locales that aren't installed, are in codepoint order of
+ * the folded name (as for the tokens of the text indexes) rather than
+ * in whatever order the environment of the build would give.
+ */
+static void
+desktop_file_index_builder_sort_apps (DesktopFileIndexBuilder *builder)
+{
+  GSequenceIter *iter;
+  gchar *ctype;
+
+  builder->sorted_apps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                (GDestroyNotify) desktop_file_index_id_list_free);
+
+  /* g_utf8_collate_key() converts to the charset of LC_CTYPE */
+  ctype = g_strdup (setlocale (LC_CTYPE, NULL));
+
+  foreach_sequence_item (iter, builder->locale_names)
+    {
+      const gchar *locale = g_sequence_get (iter);
+      gboolean collate = FALSE;
+
+      if (locale[0])
+        {
+          gchar *name;
+
+          name = desktop_file_index_builder_add_codeset (locale, "UTF-8");
+          collate = (setlocale (LC_COLLATE, name) && setlocale (LC_CTYPE, name)) ||
+                    (setlocale (LC_COLLATE, locale) && setlocale (LC_CTYPE, locale));
+          g_free (name);
+        }
+
+      g_hash_table_insert (builder->sorted_apps, g_strdup (locale),
+                           desktop_file_index_builder_sort_apps_for_locale (builder, locale, collate));
+    }
+
+  setlocale (LC_COLLATE, "C");
+  setlocale (LC_CTYPE, ctype);
+  g_free (ctype);
+}
+
+static gboolean
+desktop_file_index_builder_text_index_needs_wide_ids (GSequence *text_index)
+{
+  GSequenceIter *iter;
+
+  foreach_sequence_item (iter, text_index)
+    {
+      const gchar *token;
+      GArray *id_list;
+
+      desktop_file_index_text_index_get_item (iter, &token, &id_list);
+
+      if (id_list->len > G_MAXUINT16)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* The compact format can't represent more than 0xfffe of anything (as
+ * 0xffff is the invalid id), so switch to the wide format if needed.
+ */
+static gboolean
+desktop_file_index_builder_needs_wide_ids (DesktopFileIndexBuilder *builder)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  if (g_sequence_get_length (builder->app_names) >= G_MAXUINT16 ||
+      g_sequence_get_length (builder->key_names) >= G_MAXUINT16 ||
+      g_sequence_get_length (builder->locale_names) >= G_MAXUINT16 ||
+      g_sequence_get_length (builder->group_names) >= G_MAXUINT16)
+    return TRUE;
+
+  g_hash_table_iter_init (&iter, builder->desktop_files);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    if (desktop_file_index_keyfile_get_n_items (value) >= G_MAXUINT16)
+      return TRUE;
+
+  if (desktop_file_index_builder_text_index_needs_wide_ids (builder->c_text_index))
+    return TRUE;
+
+  g_hash_table_iter_init (&iter, builder->locale_text_indexes);
+  while (g_hash_table_iter_next (&iter, NULL, &value))
+    if (desktop_file_index_builder_text_index_needs_wide_ids (value))
+      return TRUE;
+
+  return FALSE;
+}
+
+static gboolean
+desktop_file_index_builder_write_files (DesktopFileIndexBuilder  *builder,
+                                        GError                  **error)
+{
+  GHashTableIter iter;
+  GHashTable *files;
+  gpointer key, val;
+  gboolean success;
+  guint i;
+
+  if (builder->segments == NULL)
+    return g_file_set_contents ("index.cache", builder->string->str, builder->string->len, error);
+
+  files = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, (GDestroyNotify) g_string_free);
+
+  for (i = 0; i < builder->segments->len; i++)
+    {
+      DesktopFileIndexSegment *segment = builder->segments->pdata[i];
+      GString *file;
+
+      file = g_hash_table_lookup (files, segment->group);
+      if (file == NULL)
+        {
+          file = g_string_new (NULL);
+          g_hash_table_insert (files, segment->group, file);
+        }
+
+      g_string_append_len (file, builder->string->str + segment->start, segment->end - segment->start);
+    }
+
+  success = TRUE;
+
+  /* The locale files go first, so that a reader that opens the new
+   * index.cache never finds the old locale files.
+   */
+  g_hash_table_iter_init (&iter, files);
+  while (success && g_hash_table_iter_next (&iter, &key, &val))
+    {
+      const gchar *group = key;
+      GString *file = val;
+      guint32 build_id[2];
+      gchar *filename;
+
+      if (!group[0])
+        continue;
+
+      build_id[0] = GUINT32_TO_LE (builder->build_id);
+      build_id[1] = GUINT32_TO_LE (builder->build_id >> 32);
+      g_string_append_len (file, (gpointer) build_id, sizeof build_id);
+
+      filename = g_strdup_printf ("index-%s.cache", group);
+      success = g_file_set_contents (filename, file->str, file->len, error);
+      g_free (filename);
+    }
+
+  if (success)
+    {
+      GString *file = g_hash_table_lookup (files, "");
+
+      success = g_file_set_contents ("index.cache", file->str, file->len, error);
+    }
+
+  g_hash_table_unref (files);
+
+  return success;
+}
+
+/* Writes index.cache.delta, which turns the given old index.cache into
+ * the one that was just built (see apply-delta.c)
+ */
+static gboolean
+desktop_file_index_builder_write_delta (DesktopFileIndexBuilder  *builder,
+                                        const gchar              *old_filename,
+                                        GError                  **error)
+{
+  gboolean success;
+  gchar *old_data;
+  GString *delta;
+  GString *check;
+  gsize old_size;
+
+  if (!g_file_get_contents (old_filename, &old_data, &old_size, error))
+    return FALSE;
+
+  delta = dfi_delta_create (old_data, old_size, builder->string->str, builder->string->len);
+
+  /* Never ship a delta that doesn't give back what we just built */
+  check = dfi_delta_apply (old_data, old_size, delta->str, delta->len);
+  if (check && check->len == builder->string->len && memcmp (check->str, builder->string->str, check->len) == 0)
+    success = g_file_set_contents ("index.cache.delta", delta->str, delta->len, error);
+  else
+    {
+      g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_FAILED, "The delta from %s does not reproduce index.cache", old_filename);
+      success = FALSE;
     }
+
+  if (check)
+    g_string_free (check, TRUE);
+  g_string_free (delta, TRUE);
+  g_free (old_data);
+
+  return success;
 }
 
 static DesktopFileIndexBuilder *
@@ -601,13 +2456,83 @@ int
 main (int argc, char **argv)
 {
   DesktopFileIndexBuilder *builder;
+  GOptionContext *context;
+  gboolean split_locales = FALSE;
+  gboolean wide_ids = FALSE;
+  gboolean string_lengths = FALSE;
+  gboolean suffix_arrays = FALSE;
+  gboolean front_coded = FALSE;
+  gboolean positions = FALSE;
+  gboolean overlays = FALSE;
+  gchar *profile = NULL;
+  gchar *delta = NULL;
   GError *error = NULL;
   const gchar *name;
   GDir *dir;
+  const GOptionEntry entries[] = {
+    { "profile", 0, 0, G_OPTION_ARG_FILENAME, &profile, "Lay out the cache according to an access profile", "FILE" },
+    { "split-locales", 0, 0, G_OPTION_ARG_NONE, &split_locales, "Write each locale group to its own file", NULL },
+    { "delta", 0, 0, G_OPTION_ARG_FILENAME, &delta, "Also write a delta from an old index.cache", "FILE" },
+    { "string-lengths", 0, 0, G_OPTION_ARG_NONE, &string_lengths, "Store the length of each string (disables tail merging)", NULL },
+    { "front-coded", 0, 0, G_OPTION_ARG_NONE, &front_coded, "Write front-coded token dictionaries instead of text indexes", NULL },
+    { "positions", 0, 0, G_OPTION_ARG_NONE, &positions, "Record the positions of words, for phrase searches", NULL },
+    { "overlays", 0, 0, G_OPTION_ARG_NONE, &overlays, "Only store how each translation's text index differs from the untranslated one", NULL },
+    { "suffix-arrays", 0, 0, G_OPTION_ARG_NONE, &suffix_arrays, "Add suffix arrays for substring searches", NULL },
+    { "wide-ids", 0, 0, G_OPTION_ARG_NONE, &wide_ids, "Always use 32bit ids (the default is to only do so if needed)", NULL },
+    { NULL }
+  };
 
   setlocale (LC_ALL, "");
 
+  /* The output mustn't depend on the environment of the build */
+  setlocale (LC_COLLATE, "C");
+
+  context = g_option_context_new ("DIRECTORY");
+  g_option_context_add_main_entries (context, entries, NULL);
+  if (!g_option_context_parse (context, &argc, &argv, &error) || argc != 2)
+    {
+      g_printerr ("%s\n", error ? error->message : "A single directory must be given");
+      return 1;
+    }
+  g_option_context_free (context);
+
+  if (delta && split_locales)
+    {
+      g_printerr ("--delta can not be used with --split-locales\n");
+      return 1;
+    }
+
+  if ((suffix_arrays || positions) && front_coded)
+    {
+      g_printerr ("--suffix-arrays and --positions can not be used with --front-coded\n");
+      return 1;
+    }
+
+  if (overlays && (suffix_arrays || positions || front_coded))
+    {
+      g_printerr ("--overlays can not be used with --suffix-arrays, --positions or --front-coded\n");
+      return 1;
+    }
+
   builder = desktop_file_index_builder_new ();
+  builder->string_lengths = string_lengths;
+  builder->front_coded = front_coded;
+  builder->overlays = overlays;
+
+  if (suffix_arrays)
+    builder->suffix_arrays = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  if (positions)
+    builder->position_tables = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  if (profile)
+    {
+      builder->profile = desktop_file_index_profile_new (profile, &error);
+      g_assert_no_error (error);
+    }
+
+  if (split_locales)
+    builder->segments = g_ptr_array_new_with_free_func (desktop_file_index_segment_free);
 
   dir = g_dir_open (argv[1], 0, &error);
   g_assert_no_error (error);
@@ -634,10 +2559,20 @@ main (int argc, char **argv)
 
   desktop_file_index_builder_index_strings (builder);
 
+  desktop_file_index_builder_sort_apps (builder);
+
+  builder->wide_ids = wide_ids || desktop_file_index_builder_needs_wide_ids (builder);
+
   desktop_file_index_builder_serialise (builder);
 
-  g_file_set_contents ("index.cache", builder->string->str, builder->string->len, &error);
+  desktop_file_index_builder_write_files (builder, &error);
   g_assert_no_error (error);
 
+  if (delta)
+    {
+      desktop_file_index_builder_write_delta (builder, delta, &error);
+      g_assert_no_error (error);
+    }
+
   return 0;
 }
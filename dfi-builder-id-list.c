@@ -5,7 +5,7 @@
 GArray *
 desktop_file_index_id_list_new (void)
 {
-  return g_array_new (FALSE, FALSE, sizeof (guint16));
+  return g_array_new (FALSE, FALSE, sizeof (guint));
 }
 
 void
@@ -16,17 +16,17 @@ desktop_file_index_id_list_free (GArray *id_list)
 
 void
 desktop_file_index_id_list_add_ids (GArray        *id_list,
-                                    const guint16 *ids,
+                                    const guint   *ids,
                                     gint           n_ids)
 {
   g_array_append_vals (id_list, ids, n_ids);
 }
 
-const guint16 *
+const guint *
 desktop_file_index_id_list_get_ids (GArray *id_list,
                                     guint  *n_ids)
 {
   *n_ids = id_list->len;
 
-  return (guint16 *) id_list->data;
+  return (guint *) id_list->data;
 }
@@ -114,11 +114,15 @@ desktop_file_index_keyfile_get_item (DesktopFileIndexKeyfile  *keyfile,
   *value = kfi->value;
 }
 
+/* Like desktop_file_index_keyfile_get_value(), but also gives the
+ * locale of the value that was found ("" for the untranslated one).
+ */
 const gchar *
-desktop_file_index_keyfile_get_value (DesktopFileIndexKeyfile *keyfile,
-                                      const gchar * const     *locale_variants,
-                                      const gchar             *group_name,
-                                      const gchar             *key)
+desktop_file_index_keyfile_get_localised_value (DesktopFileIndexKeyfile  *keyfile,
+                                                const gchar * const      *locale_variants,
+                                                const gchar              *group_name,
+                                                const gchar              *key,
+                                                const gchar             **locale)
 {
   gint start = 0, end = 0;
   gint i;
@@ -157,7 +161,10 @@ desktop_file_index_keyfile_get_value (DesktopFileIndexKeyfile *keyfile,
            * those first.
            */
           if (item->locale && g_str_equal (item->locale, locale_variants[i]) && g_str_equal (item->key, key))
-            return item->value;
+            {
+              *locale = item->locale;
+              return item->value;
+            }
         }
     }
 
@@ -167,12 +174,27 @@ desktop_file_index_keyfile_get_value (DesktopFileIndexKeyfile *keyfile,
       DesktopFileIndexKeyfileItem *item = keyfile->items->pdata[i];
 
       if (item->locale[0] == '\0' && g_str_equal (item->key, key))
-        return item->value;
+        {
+          *locale = item->locale;
+          return item->value;
+        }
     }
 
+  *locale = NULL;
   return NULL;
 }
 
+const gchar *
+desktop_file_index_keyfile_get_value (DesktopFileIndexKeyfile *keyfile,
+                                      const gchar * const     *locale_variants,
+                                      const gchar             *group_name,
+                                      const gchar             *key)
+{
+  const gchar *locale;
+
+  return desktop_file_index_keyfile_get_localised_value (keyfile, locale_variants, group_name, key, &locale);
+}
+
 DesktopFileIndexKeyfile *
 desktop_file_index_keyfile_new (const gchar  *filename,
                                 GError      **error)
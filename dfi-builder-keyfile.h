@@ -12,6 +12,12 @@ const gchar *           desktop_file_index_keyfile_get_value            (Desktop
                                                                          const gchar              *group_name,
                                                                          const gchar              *key);
 
+const gchar *           desktop_file_index_keyfile_get_localised_value  (DesktopFileIndexKeyfile  *keyfile,
+                                                                         const gchar * const      *locale_variants,
+                                                                         const gchar              *group_name,
+                                                                         const gchar              *key,
+                                                                         const gchar             **locale);
+
 guint                   desktop_file_index_keyfile_get_n_groups         (DesktopFileIndexKeyfile  *keyfile);
 
 guint                   desktop_file_index_keyfile_get_n_items          (DesktopFileIndexKeyfile  *keyfile);
@@ -0,0 +1,136 @@
+#include "dfi-builder-profile.h"
+
+#include <string.h>
+
+/* The profile is a plain text file written by the reader when the
+ * DFI_PROFILE environment variable is set.  Each line has the form
+ *
+ *   <kind> <name> <hits>
+ *
+ * where kind is one of "app", "locale" or "key".  The same name may
+ * appear many times (the reader appends once per process) in which case
+ * the hits are summed.
+ */
+struct _DesktopFileIndexProfile
+{
+  GHashTable *apps;
+  GHashTable *locales;
+  GHashTable *keys;
+};
+
+static void
+desktop_file_index_profile_add_hits (GHashTable  *table,
+                                     const gchar *name,
+                                     guint        hits)
+{
+  guint old_hits;
+
+  old_hits = GPOINTER_TO_UINT (g_hash_table_lookup (table, name));
+
+  g_hash_table_insert (table, g_strdup (name), GUINT_TO_POINTER (old_hits + hits));
+}
+
+static guint
+desktop_file_index_profile_get_hits (GHashTable  *table,
+                                     const gchar *name)
+{
+  return GPOINTER_TO_UINT (g_hash_table_lookup (table, name));
+}
+
+void
+desktop_file_index_profile_free (DesktopFileIndexProfile *profile)
+{
+  g_hash_table_unref (profile->apps);
+  g_hash_table_unref (profile->locales);
+  g_hash_table_unref (profile->keys);
+
+  g_slice_free (DesktopFileIndexProfile, profile);
+}
+
+guint
+desktop_file_index_profile_get_app_hits (DesktopFileIndexProfile *profile,
+                                         const gchar             *app)
+{
+  return desktop_file_index_profile_get_hits (profile->apps, app);
+}
+
+guint
+desktop_file_index_profile_get_locale_hits (DesktopFileIndexProfile *profile,
+                                            const gchar             *locale)
+{
+  return desktop_file_index_profile_get_hits (profile->locales, locale);
+}
+
+guint
+desktop_file_index_profile_get_key_hits (DesktopFileIndexProfile *profile,
+                                         const gchar             *key)
+{
+  return desktop_file_index_profile_get_hits (profile->keys, key);
+}
+
+DesktopFileIndexProfile *
+desktop_file_index_profile_new (const gchar  *filename,
+                                GError      **error)
+{
+  DesktopFileIndexProfile *profile;
+  gchar *contents;
+  gchar **lines;
+  gint i;
+
+  if (!g_file_get_contents (filename, &contents, NULL, error))
+    return NULL;
+
+  profile = g_slice_new (DesktopFileIndexProfile);
+  profile->apps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  profile->locales = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  profile->keys = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  lines = g_strsplit (contents, "\n", -1);
+  g_free (contents);
+
+  for (i = 0; lines[i]; i++)
+    {
+      GHashTable *table;
+      gchar *name, *hits;
+
+      if (lines[i][0] == '\0' || lines[i][0] == '#')
+        continue;
+
+      /* Names may contain spaces (locales can't, but be careful), so
+       * split on the first and last space only.
+       */
+      name = strchr (lines[i], ' ');
+      hits = strrchr (lines[i], ' ');
+      if (name == NULL || name == hits)
+        {
+          g_set_error (error, G_KEY_FILE_ERROR, G_KEY_FILE_ERROR_PARSE,
+                       "%s:%d: Lines must have the form '<kind> <name> <hits>'", filename, i + 1);
+          goto err;
+        }
+
+      *name++ = '\0';
+      *hits++ = '\0';
+
+      if (g_str_equal (lines[i], "app"))
+        table = profile->apps;
+      else if (g_str_equal (lines[i], "locale"))
+        table = profile->locales;
+      else if (g_str_equal (lines[i], "key"))
+        table = profile->keys;
+      else
+        /* ignore unknown kinds for forwards compatibility */
+        continue;
+
+      desktop_file_index_profile_add_hits (table, name, g_ascii_strtoull (hits, NULL, 10));
+    }
+
+  g_strfreev (lines);
+
+  return profile;
+
+err:
+  g_strfreev (lines);
+  desktop_file_index_profile_free (profile);
+
+  return NULL;
+}
@@ -0,0 +1,17 @@
+#include <glib.h>
+
+typedef struct _DesktopFileIndexProfile DesktopFileIndexProfile;
+
+DesktopFileIndexProfile * desktop_file_index_profile_new                (const gchar              *filename,
+                                                                         GError                  **error);
+
+void                    desktop_file_index_profile_free                 (DesktopFileIndexProfile  *profile);
+
+guint                   desktop_file_index_profile_get_app_hits         (DesktopFileIndexProfile  *profile,
+                                                                         const gchar              *app);
+
+guint                   desktop_file_index_profile_get_locale_hits      (DesktopFileIndexProfile  *profile,
+                                                                         const gchar              *locale);
+
+guint                   desktop_file_index_profile_get_key_hits         (DesktopFileIndexProfile  *profile,
+                                                                         const gchar              *key);
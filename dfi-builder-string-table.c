@@ -1,5 +1,7 @@
 #include "dfi-builder-string-table.h"
 
+#include "common.h"
+
 #include <string.h>
 
 static guint
@@ -21,8 +23,8 @@ desktop_file_index_string_tables_create (void)
   return g_hash_table_new_full (str_hash0, str_equal0, g_free, (GDestroyNotify) g_hash_table_unref);
 }
 
-static gchar *
-get_locale_group (const gchar *for_locale)
+gchar *
+desktop_file_index_string_tables_get_locale_group (const gchar *for_locale)
 {
   /* This function decides how to group the string tables of locales in
    * order to improve sharing of strings between similar locales while
@@ -76,7 +78,7 @@ desktop_file_index_string_tables_get_table (GHashTable  *string_tables,
 
   if (!string_table)
     {
-      gchar *locale_group = get_locale_group (locale);
+      gchar *locale_group = desktop_file_index_string_tables_get_locale_group (locale);
 
       string_table = g_hash_table_lookup (string_tables, locale_group);
 
@@ -150,13 +152,87 @@ desktop_file_index_string_table_is_written (GHashTable *string_table)
   return val != NULL;
 }
 
+static gint
+desktop_file_index_string_table_compare_reversed (gconstpointer a,
+                                                  gconstpointer b)
+{
+  const gchar *str_a = *(const gchar * const *) a;
+  const gchar *str_b = *(const gchar * const *) b;
+  gsize len_a = strlen (str_a);
+  gsize len_b = strlen (str_b);
+
+  while (len_a && len_b)
+    {
+      guchar c_a = str_a[--len_a];
+      guchar c_b = str_b[--len_b];
+
+      if (c_a != c_b)
+        return c_a < c_b ? -1 : 1;
+    }
+
+  /* If one is a suffix of the other, the shorter one comes first */
+  return (len_a != 0) - (len_b != 0);
+}
+
+static gint
+desktop_file_index_string_table_compare_hits (gconstpointer a,
+                                              gconstpointer b,
+                                              gpointer      user_data)
+{
+  const guint *hits = user_data;
+  guint index_a = *(const guint *) a;
+  guint index_b = *(const guint *) b;
+
+  if (hits[index_a] != hits[index_b])
+    return hits[index_a] > hits[index_b] ? -1 : 1;
+
+  return index_a < index_b ? -1 : index_a > index_b;
+}
+
+/* See DFI_HEADER_FLAG_STRING_LENGTHS in common.h */
+static void
+desktop_file_index_string_table_write_length (GString *file,
+                                              gsize    length)
+{
+  guchar bytes[DFI_STRING_LENGTH_MAX_BYTES];
+  gint n = 0;
+
+  g_assert_cmpuint (length, <=, G_MAXUINT32);
+
+  do
+    {
+      bytes[n] = length & 0x7f;
+      length >>= 7;
+
+      if (length)
+        bytes[n] |= 0x80;
+
+      n++;
+    }
+  while (length);
+
+  while (n--)
+    g_string_append_c (file, bytes[n]);
+}
+
 void
 desktop_file_index_string_table_write (GHashTable *string_table,
                                        GHashTable *shared_table,
+                                       GHashTable *hot_strings,
+                                       gboolean    with_lengths,
                                        GString    *file)
 {
   GHashTableIter iter;
+  GPtrArray *strings;
   gpointer key, val;
+  guint *offsets;
+  guint *hosts;
+  guint *order;
+  guint n_hosts;
+  guint i, n;
+
+  /* Strings that are also in the shared table don't get written again */
+  strings = g_ptr_array_new ();
 
   g_hash_table_iter_init (&iter, string_table);
   while (g_hash_table_iter_next (&iter, &key, &val))
@@ -166,12 +242,89 @@ desktop_file_index_string_table_write (GHashTable *string_table,
       if (shared_table)
         val = g_hash_table_lookup (shared_table, key);
 
-      if (val == NULL)
+      if (val != NULL)
+        g_hash_table_iter_replace (&iter, val);
+      else
+        g_ptr_array_add (strings, key);
+    }
+
+  /* Tail merging: after sorting by reversed bytes, any string that is a
+   * suffix of another string is immediately followed by a string that
+   * it is a suffix of.  Walking backwards, we can therefore find the
+   * longest string (the "host") that each string is a suffix of, and
+   * only write out the hosts.
+   *
+   * There is nowhere to put the length of a suffix, so we can't do this
+   * if we are writing lengths.
+   */
+  g_ptr_array_sort (strings, desktop_file_index_string_table_compare_reversed);
+  n = strings->len;
+
+  hosts = g_new (guint, n);
+  order = g_new (guint, n);
+  n_hosts = 0;
+
+  for (i = n; i-- > 0; )
+    {
+      if (!with_lengths && i + 1 < n && g_str_has_suffix (strings->pdata[i + 1], strings->pdata[i]))
+        hosts[i] = hosts[i + 1];
+      else
+        hosts[i] = i;
+    }
+
+  for (i = 0; i < n; i++)
+    if (hosts[i] == i)
+      order[n_hosts++] = i;
+
+  /* If we have been given a profile, write the hot strings first (most
+   * frequently used first) so that they end up packed together into as
+   * few pages as possible.  A host is as hot as its hottest suffix.
+   */
+  if (hot_strings)
+    {
+      guint *hits;
+
+      hits = g_new0 (guint, n);
+
+      for (i = 0; i < n; i++)
         {
-          g_hash_table_iter_replace (&iter, GUINT_TO_POINTER (file->len));
-          g_string_append_len (file, key, strlen (key) + 1);
+          guint string_hits;
+
+          string_hits = GPOINTER_TO_UINT (g_hash_table_lookup (hot_strings, strings->pdata[i]));
+          hits[hosts[i]] = MAX (hits[hosts[i]], string_hits);
         }
-      else
-        g_hash_table_iter_replace (&iter, val);
+
+      g_qsort_with_data (order, n_hosts, sizeof (guint), desktop_file_index_string_table_compare_hits, hits);
+
+      g_free (hits);
+    }
+
+  offsets = g_new (guint, n);
+
+  for (i = 0; i < n_hosts; i++)
+    {
+      const gchar *host = strings->pdata[order[i]];
+      gsize length = strlen (host);
+
+      if (with_lengths)
+        desktop_file_index_string_table_write_length (file, length);
+
+      offsets[order[i]] = file->len;
+      g_string_append_len (file, host, length + 1);
     }
+
+  for (i = 0; i < n; i++)
+    {
+      const gchar *host = strings->pdata[hosts[i]];
+      const gchar *string = strings->pdata[i];
+      guint offset;
+
+      offset = offsets[hosts[i]] + strlen (host) - strlen (string);
+      g_hash_table_insert (string_table, g_strdup (string), GUINT_TO_POINTER (offset));
+    }
+
+  g_ptr_array_free (strings, TRUE);
+  g_free (offsets);
+  g_free (hosts);
+  g_free (order);
 }
@@ -5,6 +5,8 @@ GHashTable *            desktop_file_index_string_tables_create         (void);
 GHashTable *            desktop_file_index_string_tables_get_table      (GHashTable  *string_tables,
                                                                          const gchar *locale);
 
+gchar *                 desktop_file_index_string_tables_get_locale_group (const gchar *for_locale);
+
 void                    desktop_file_index_string_tables_add_string     (GHashTable  *string_tables,
                                                                          const gchar *locale,
                                                                          const gchar *string);
@@ -23,4 +25,6 @@ gboolean                desktop_file_index_string_table_is_written      (GHashTa
 
 void                    desktop_file_index_string_table_write           (GHashTable *string_table,
                                                                          GHashTable *shared_table,
+                                                                         GHashTable *hot_strings,
+                                                                         gboolean    with_lengths,
                                                                          GString    *file);
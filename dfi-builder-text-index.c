@@ -15,6 +15,13 @@ typedef struct
   gchar *token;
 
   GArray *id_list;
+
+  /* Only when recording positions: the positions of the token in the
+   * string for each entry of id_list are positions[starts[i]] up to
+   * the next entry's start.
+   */
+  GArray *starts;
+  GArray *positions;
 } DesktopFileIndexTextIndexItem;
 
 static gint
@@ -39,6 +46,8 @@ desktop_file_index_text_index_item_new (const gchar *token)
   item = g_slice_new (DesktopFileIndexTextIndexItem);
   item->token = g_strdup (token);
   item->id_list = desktop_file_index_id_list_new ();
+  item->starts = NULL;
+  item->positions = NULL;
 
   return item;
 }
@@ -49,6 +58,11 @@ desktop_file_index_text_index_item_free (gpointer data)
   DesktopFileIndexTextIndexItem *item = data;
 
   desktop_file_index_id_list_free (item->id_list);
+  if (item->starts)
+    {
+      g_array_free (item->starts, TRUE);
+      g_array_free (item->positions, TRUE);
+    }
   g_free (item->token);
 
   g_slice_free (DesktopFileIndexTextIndexItem, item);
@@ -60,11 +74,9 @@ desktop_file_index_text_index_new (void)
   return g_sequence_new (desktop_file_index_text_index_item_free);
 }
 
-void
-desktop_file_index_text_index_add_ids (GSequence     *text_index,
-                                       const gchar   *token,
-                                       const guint16 *ids,
-                                       gint           n_ids)
+static DesktopFileIndexTextIndexItem *
+desktop_file_index_text_index_get_token_item (GSequence   *text_index,
+                                              const gchar *token)
 {
   DesktopFileIndexTextIndexItem *item;
   GSequenceIter *iter;
@@ -80,118 +92,89 @@ desktop_file_index_text_index_add_ids (GSequence     *text_index,
       g_sequence_insert_sorted (text_index, item, desktop_file_index_text_index_string_compare, NULL);
     }
 
-  desktop_file_index_id_list_add_ids (item->id_list, ids, n_ids);
+  return item;
 }
 
-static void
-desktop_file_index_text_index_add_folded (GPtrArray   *array,
-                                          const gchar *start,
-                                          const gchar *end)
+void
+desktop_file_index_text_index_add_ids (GSequence     *text_index,
+                                       const gchar   *token,
+                                       const guint   *ids,
+                                       gint           n_ids)
 {
-  gchar *normal;
+  DesktopFileIndexTextIndexItem *item;
 
-  normal = g_utf8_normalize (start, end - start, G_NORMALIZE_ALL_COMPOSE);
+  item = desktop_file_index_text_index_get_token_item (text_index, token);
+  desktop_file_index_id_list_add_ids (item->id_list, ids, n_ids);
+}
 
-  /* TODO: Invent time machine.  Converse with Mustafa Ataturk... */
-  if (strstr (normal, "ı") || strstr (normal, "İ"))
+static void
+desktop_file_index_text_index_item_add_position (DesktopFileIndexTextIndexItem *item,
+                                                 gboolean                       new_entry,
+                                                 guint                          position)
+{
+  if (item->starts == NULL)
     {
-      gchar *s = normal;
-      GString *tmp;
-
-      tmp = g_string_new (NULL);
-
-      while (*s)
-        {
-          gchar *i, *I, *e;
-
-          i = strstr (s, "ı");
-          I = strstr (s, "İ");
-
-          if (!i && !I)
-            break;
-          else if (i && !I)
-            e = i;
-          else if (I && !i)
-            e = I;
-          else if (i < I)
-            e = i;
-          else
-            e = I;
-
-          g_string_append_len (tmp, s, e - s);
-          g_string_append_c (tmp, 'i');
-          s = g_utf8_next_char (e);
-        }
-
-      g_string_append (tmp, s);
-      g_free (normal);
-      normal = g_string_free (tmp, FALSE);
+      item->starts = g_array_new (FALSE, FALSE, sizeof (guint));
+      item->positions = g_array_new (FALSE, FALSE, sizeof (guint));
     }
 
-  g_ptr_array_add (array, g_utf8_casefold (normal, -1));
-  g_free (normal);
+  if (new_entry)
+    g_array_append_val (item->starts, item->positions->len);
+
+  g_array_append_val (item->positions, position);
 }
 
-static gchar **
-desktop_file_index_text_index_split_words (const gchar *value)
+typedef struct
+{
+  GSequence   *text_index;
+  const guint *ids;
+  gint         n_ids;
+  gboolean     positions;
+} DesktopFileIndexTextIndexAdd;
+
+static void
+desktop_file_index_text_index_add_token (const gchar *token,
+                                         gsize        length,
+                                         guint        position,
+                                         gpointer     user_data)
 {
-  const gchar *start = NULL;
-  GPtrArray *result;
-  const gchar *s;
+  DesktopFileIndexTextIndexAdd *add = user_data;
+  DesktopFileIndexTextIndexItem *item;
+  const guint *last_ids;
+  guint n_ids;
 
-  result = g_ptr_array_new ();
+  item = desktop_file_index_text_index_get_token_item (add->text_index, token);
 
-  for (s = value; *s; s = g_utf8_next_char (s))
+  /* A string is only ever tokenised once for a given set of ids, so if
+   * the id list already ends with our ids then the token appeared
+   * earlier in the same string.
+   */
+  last_ids = desktop_file_index_id_list_get_ids (item->id_list, &n_ids);
+  if (n_ids >= add->n_ids && memcmp (last_ids + n_ids - add->n_ids, add->ids, add->n_ids * sizeof (guint)) == 0)
     {
-      gunichar c = g_utf8_get_char (s);
+      if (add->positions)
+        desktop_file_index_text_index_item_add_position (item, FALSE, position);
 
-      if (start == NULL)
-        {
-          if (g_unichar_isalnum (c))
-            start = s;
-        }
-      else
-        {
-          if (!g_unichar_isalnum (c))
-            {
-              desktop_file_index_text_index_add_folded (result, start, s);
-              start = NULL;
-            }
-        }
+      return;
     }
 
-  if (start)
-    desktop_file_index_text_index_add_folded (result, start, s);
-
-  g_ptr_array_add (result, NULL);
+  desktop_file_index_id_list_add_ids (item->id_list, add->ids, add->n_ids);
 
-  return (gchar **) g_ptr_array_free (result, FALSE);
+  if (add->positions)
+    desktop_file_index_text_index_item_add_position (item, TRUE, position);
 }
 
 void
 desktop_file_index_text_index_add_ids_tokenised (GSequence     *text_index,
+                                                 DfiTokenizer  *tokenizer,
                                                  const gchar   *string_to_tokenise,
-                                                 const guint16 *ids,
-                                                 gint           n_ids)
+                                                 const guint   *ids,
+                                                 gint           n_ids,
+                                                 gboolean       positions)
 {
-  gchar **tokens;
-  gint i;
-
-  tokens = desktop_file_index_text_index_split_words (string_to_tokenise);
-  for (i = 0; tokens[i]; i++)
-    {
-      gint j;
-
-      for (j = 0; j < i; j++)
-        if (g_str_equal (tokens[i], tokens[j]))
-          break;
-
-      if (j < i)
-        continue;
-
-      desktop_file_index_text_index_add_ids (text_index, tokens[i], ids, n_ids);
-    }
+  DesktopFileIndexTextIndexAdd add = { text_index, ids, n_ids, positions };
 
+  dfi_tokenizer_split (tokenizer, string_to_tokenise, desktop_file_index_text_index_add_token, &add);
 }
 
 void
@@ -207,6 +190,79 @@ desktop_file_index_text_index_get_item (GSequenceIter  *iter,
   *id_list = item->id_list;
 }
 
+/* Gives NULL for both unless positions were recorded */
+void
+desktop_file_index_text_index_get_positions (GSequenceIter  *iter,
+                                             GArray        **starts,
+                                             GArray        **positions)
+{
+  DesktopFileIndexTextIndexItem *item;
+
+  item = g_sequence_get (iter);
+
+  *starts = item->starts;
+  *positions = item->positions;
+}
+
+/* Gives a text index with only the tokens of text_index whose id lists
+ * differ from those in base, including an empty id list for each token
+ * that is only in base.  Positions are not copied.
+ */
+GSequence *
+desktop_file_index_text_index_new_overlay (GSequence *text_index,
+                                           GSequence *base)
+{
+  GSequenceIter *iter, *base_iter;
+  GSequence *overlay;
+
+  overlay = desktop_file_index_text_index_new ();
+
+  iter = g_sequence_get_begin_iter (text_index);
+  base_iter = g_sequence_get_begin_iter (base);
+
+  while (!g_sequence_iter_is_end (iter) || !g_sequence_iter_is_end (base_iter))
+    {
+      DesktopFileIndexTextIndexItem *item = NULL;
+      DesktopFileIndexTextIndexItem *base_item = NULL;
+      DesktopFileIndexTextIndexItem *copy;
+      gint x;
+
+      if (!g_sequence_iter_is_end (iter))
+        item = g_sequence_get (iter);
+      if (!g_sequence_iter_is_end (base_iter))
+        base_item = g_sequence_get (base_iter);
+
+      if (item && base_item)
+        x = strcmp (item->token, base_item->token);
+      else
+        x = item ? -1 : 1;
+
+      if (x > 0)
+        {
+          /* Every string that had the token was translated */
+          copy = desktop_file_index_text_index_item_new (base_item->token);
+          g_sequence_append (overlay, copy);
+
+          base_iter = g_sequence_iter_next (base_iter);
+          continue;
+        }
+
+      if (x < 0 || item->id_list->len != base_item->id_list->len ||
+          memcmp (item->id_list->data, base_item->id_list->data, item->id_list->len * sizeof (guint)) != 0)
+        {
+          copy = desktop_file_index_text_index_item_new (item->token);
+          g_array_append_vals (copy->id_list, item->id_list->data, item->id_list->len);
+          g_sequence_append (overlay, copy);
+        }
+
+      if (x == 0)
+        base_iter = g_sequence_iter_next (base_iter);
+      iter = g_sequence_iter_next (iter);
+    }
+
+  return overlay;
+}
+
 void
 desktop_file_index_text_index_populate_strings (GSequence  *text_index,
                                                 GHashTable *string_table)
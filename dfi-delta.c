@@ -0,0 +1,838 @@
+#include "dfi-delta.h"
+
+#include <string.h>
+
+/* Binary deltas between two versions of index.cache.
+ *
+ * The delta is a list of operations that rebuild the new file from the
+ * old one: copy a range of the old file, insert literal bytes, or copy
+ * a range of the old file while relocating the pointers in it.
+ *
+ * Adding or changing a single desktop file moves almost everything
+ * that follows it, which changes nearly every pointer in the file even
+ * though the things that they point at are unchanged.  To deal with
+ * this, the delta carries a relocation map that says where ranges of
+ * the old file ended up in the new file.  An aligned 32bit word of the
+ * old file that points into one of those ranges is "ambiguous": it may
+ * be a pointer that needs relocating or just a pair of ids that happen
+ * to look like one, so relocating copies say which (see
+ * dfi_delta_predict_bit()).
+ *
+ * The first round of matching is plain.  Each later round builds the
+ * relocation map from the copies found by the previous one and matches
+ * again with relocation, since each round extends the map (eg: once
+ * the keyfiles are matched, the pointers to them can be relocated
+ * too).  Copies are matched word by word against the image that the
+ * applier will take each word from, so a bad map just means a bigger
+ * delta.  The delta also carries a hash of the new file, which the
+ * applier checks, so a bug can't silently produce a wrong file.
+ *
+ * Format (all numbers are LEB128 varints):
+ *
+ *   "DFIDELTA"
+ *   old_size, new_size, old_hash, new_hash
+ *   n_relocations, (old_start, new_start, length) * n_relocations
+ *   operations until new_size bytes have been produced:
+ *     0, length, <bytes>                 insert
+ *     1, old_offset, length              copy
+ *     2, old_offset, length,             copy with relocation
+ *       n_mispredicted, (gap) * n_mispredicted
+ */
+
+#define DFI_DELTA_MAGIC         "DFIDELTA"
+#define DFI_DELTA_BLOCK_SIZE    16
+#define DFI_DELTA_MIN_COPY      16
+#define DFI_DELTA_ROUNDS        3
+
+enum
+{
+  DFI_DELTA_INSERT,
+  DFI_DELTA_COPY,
+  DFI_DELTA_COPY_RELOCATED
+};
+
+typedef struct
+{
+  guint old_start;
+  guint new_start;
+  guint length;
+} DfiDeltaRelocation;
+
+typedef struct
+{
+  gboolean relocated;
+  guint old_offset;
+  guint new_offset;
+  guint length;
+} DfiDeltaCopy;
+
+/* hashing {{{1 */
+#define DFI_DELTA_HASH_MULTIPLIER 16777619u
+
+static guint32
+dfi_delta_hash_block (const guchar *data)
+{
+  guint32 hash = 0;
+  gint i;
+
+  for (i = 0; i < DFI_DELTA_BLOCK_SIZE; i++)
+    hash = hash * DFI_DELTA_HASH_MULTIPLIER + data[i];
+
+  return hash;
+}
+
+static guint32
+dfi_delta_hash_roll (guint32 hash,
+                     guint32 out_factor,
+                     guchar  out,
+                     guchar  in)
+{
+  return (hash - out * out_factor) * DFI_DELTA_HASH_MULTIPLIER + in;
+}
+
+static guint32
+dfi_delta_hash_data (const gchar *data,
+                     gsize        size)
+{
+  guint32 hash = 2166136261u;
+  gsize i;
+
+  for (i = 0; i < size; i++)
+    hash = (hash ^ (guchar) data[i]) * DFI_DELTA_HASH_MULTIPLIER;
+
+  return hash;
+}
+
+/* varints {{{1 */
+static void
+dfi_delta_write_varint (GString *out,
+                        guint64  value)
+{
+  while (value >= 0x80)
+    {
+      g_string_append_c (out, (value & 0x7f) | 0x80);
+      value >>= 7;
+    }
+
+  g_string_append_c (out, value);
+}
+
+static gboolean
+dfi_delta_read_varint (const guchar **data,
+                       const guchar  *end,
+                       guint         *value)
+{
+  guint64 result = 0;
+  gint shift = 0;
+
+  while (*data < end && shift < 35)
+    {
+      guchar c = *(*data)++;
+
+      result |= (guint64) (c & 0x7f) << shift;
+      shift += 7;
+
+      if (~c & 0x80)
+        {
+          if (result > G_MAXUINT)
+            return FALSE;
+
+          *value = result;
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+/* relocation {{{1 */
+static gint
+dfi_delta_relocation_compare (gconstpointer a,
+                              gconstpointer b)
+{
+  const DfiDeltaRelocation *reloc_a = a;
+  const DfiDeltaRelocation *reloc_b = b;
+
+  return reloc_a->old_start < reloc_b->old_start ? -1 : reloc_a->old_start > reloc_b->old_start;
+}
+
+/* Sorts the map and trims ranges that overlap earlier ones */
+static void
+dfi_delta_relocations_normalise (GArray *relocations)
+{
+  guint i, j;
+
+  g_array_sort (relocations, dfi_delta_relocation_compare);
+
+  for (i = 0, j = 0; i < relocations->len; i++)
+    {
+      DfiDeltaRelocation reloc = g_array_index (relocations, DfiDeltaRelocation, i);
+
+      if (j > 0)
+        {
+          DfiDeltaRelocation *prev = &g_array_index (relocations, DfiDeltaRelocation, j - 1);
+          guint prev_end = prev->old_start + prev->length;
+
+          if (reloc.old_start + reloc.length <= prev_end)
+            continue;
+
+          if (reloc.old_start < prev_end)
+            {
+              reloc.new_start += prev_end - reloc.old_start;
+              reloc.length -= prev_end - reloc.old_start;
+              reloc.old_start = prev_end;
+            }
+        }
+
+      g_array_index (relocations, DfiDeltaRelocation, j++) = reloc;
+    }
+
+  g_array_set_size (relocations, j);
+}
+
+static guint32
+dfi_delta_relocate_word (const DfiDeltaRelocation *relocations,
+                         guint                     n_relocations,
+                         guint32                   word)
+{
+  guint l, r;
+
+  l = 0;
+  r = n_relocations;
+
+  while (l < r)
+    {
+      guint m = l + (r - l) / 2;
+
+      if (word < relocations[m].old_start)
+        r = m;
+      else if (word - relocations[m].old_start >= relocations[m].length)
+        l = m + 1;
+      else
+        return word - relocations[m].old_start + relocations[m].new_start;
+    }
+
+  return word;
+}
+
+static gchar *
+dfi_delta_relocate (const gchar              *old_data,
+                    gsize                     old_size,
+                    const DfiDeltaRelocation *relocations,
+                    guint                     n_relocations)
+{
+  gchar *relocated;
+  gsize i;
+
+  relocated = g_malloc (old_size);
+  memcpy (relocated, old_data, old_size);
+
+  for (i = 0; i + sizeof (guint32) <= old_size; i += sizeof (guint32))
+    {
+      guint32 word;
+
+      memcpy (&word, relocated + i, sizeof word);
+      word = GUINT32_TO_LE (dfi_delta_relocate_word (relocations, n_relocations, GUINT32_FROM_LE (word)));
+      memcpy (relocated + i, &word, sizeof word);
+    }
+
+  return relocated;
+}
+
+/* matching {{{1 */
+
+/* Matches new_data against old_data starting at the given offsets and
+ * going forwards (or backwards, ending at them), taking each word from
+ * either the old file or the relocated old file (if given).  Returns
+ * the length of the match.
+ */
+static gsize
+dfi_delta_extend (const gchar *old_data,
+                  const gchar *relocated,
+                  gsize        old_offset,
+                  gsize        old_size,
+                  const gchar *new_data,
+                  gsize        new_offset,
+                  gsize        max_length,
+                  gboolean     backwards)
+{
+  gint possible = 3;
+  gsize n;
+
+  for (n = 0; n < max_length; n++)
+    {
+      gsize o, i;
+      gint match;
+
+      if (backwards)
+        {
+          if (n >= old_offset)
+            break;
+
+          o = old_offset - n - 1;
+          i = new_offset - n - 1;
+
+          if (o % 4 == 3)
+            possible = 3;
+        }
+      else
+        {
+          if (old_offset + n >= old_size)
+            break;
+
+          o = old_offset + n;
+          i = new_offset + n;
+
+          if (o % 4 == 0)
+            possible = 3;
+        }
+
+      match = 0;
+      if (old_data[o] == new_data[i])
+        match |= 1;
+      if (relocated && relocated[o] == new_data[i])
+        match |= 2;
+
+      possible &= match;
+      if (!possible)
+        break;
+    }
+
+  return n;
+}
+
+static GHashTable *
+dfi_delta_index_blocks (const gchar *data,
+                        gsize        size)
+{
+  GHashTable *blocks;
+  gsize i;
+
+  blocks = g_hash_table_new (NULL, NULL);
+
+  /* insert backwards so that the first block with a given hash wins */
+  for (i = (size / DFI_DELTA_BLOCK_SIZE) * DFI_DELTA_BLOCK_SIZE; i >= DFI_DELTA_BLOCK_SIZE; i -= DFI_DELTA_BLOCK_SIZE)
+    g_hash_table_insert (blocks,
+                         GUINT_TO_POINTER (dfi_delta_hash_block ((const guchar *) data + i - DFI_DELTA_BLOCK_SIZE)),
+                         GUINT_TO_POINTER (i - DFI_DELTA_BLOCK_SIZE + 1));
+
+  return blocks;
+}
+
+/* Looks up a block of the new file in the index of the given image of
+ * the old file, returning its offset + 1, or 0
+ */
+static gsize
+dfi_delta_lookup_block (GHashTable  *blocks,
+                        const gchar *image,
+                        guint32      hash,
+                        const gchar *block)
+{
+  gsize offset;
+
+  if (blocks == NULL)
+    return 0;
+
+  offset = GPOINTER_TO_UINT (g_hash_table_lookup (blocks, GUINT_TO_POINTER (hash)));
+
+  if (offset == 0 || memcmp (image + offset - 1, block, DFI_DELTA_BLOCK_SIZE) != 0)
+    return 0;
+
+  return offset;
+}
+
+static void
+dfi_delta_add_copy (GArray      *copies,
+                    const gchar *old_data,
+                    gsize        old_offset,
+                    const gchar *new_data,
+                    gsize        new_offset,
+                    gsize        length)
+{
+  DfiDeltaCopy copy;
+
+  copy.old_offset = old_offset;
+  copy.new_offset = new_offset;
+  copy.length = length;
+  copy.relocated = memcmp (old_data + old_offset, new_data + new_offset, length) != 0;
+
+  g_array_append_val (copies, copy);
+}
+
+/* A relocating copy takes each word (or the part of it inside the copy)
+ * from either the old file or the relocated one, so a match that mixes
+ * the two within a word can't be a single copy.  Only the word that the
+ * backwards and forwards matches meet in can be mixed, since each of
+ * them checks whole words.
+ */
+static gboolean
+dfi_delta_word_is_mixed (const gchar *old_data,
+                         const gchar *relocated,
+                         gsize        old_start,
+                         gsize        old_end,
+                         const gchar *new_data,
+                         gsize        new_start,
+                         gsize        old_offset)
+{
+  gsize word = old_offset & ~3;
+  gsize start = MAX (word, old_start);
+  gsize end = MIN (word + 4, old_end);
+
+  return memcmp (old_data + start, new_data + new_start + start - old_start, end - start) != 0 &&
+         memcmp (relocated + start, new_data + new_start + start - old_start, end - start) != 0;
+}
+
+/* Finds copies of new_data in old_data (and the relocated old file, if
+ * given).  At each position we first try to continue with the same
+ * shift as the previous copy, which is what finds the structures that
+ * only differ by their pointers.  Failing that, we look the block up
+ * rsync-style in an index of the aligned blocks of the old file.
+ */
+static GArray *
+dfi_delta_find_copies (const gchar *old_data,
+                       const gchar *relocated,
+                       gsize        old_size,
+                       const gchar *new_data,
+                       gsize        new_size)
+{
+  GHashTable *relocated_blocks = NULL;
+  GHashTable *blocks;
+  guint32 out_factor;
+  GArray *copies;
+  guint32 hash;
+  gsize i, pending;
+  gssize shift;
+  gint delta;
+
+  copies = g_array_new (FALSE, FALSE, sizeof (DfiDeltaCopy));
+
+  if (new_size < DFI_DELTA_BLOCK_SIZE || old_size < DFI_DELTA_BLOCK_SIZE)
+    return copies;
+
+  blocks = dfi_delta_index_blocks (old_data, old_size);
+  if (relocated)
+    relocated_blocks = dfi_delta_index_blocks (relocated, old_size);
+
+  out_factor = 1;
+  for (i = 1; i < DFI_DELTA_BLOCK_SIZE; i++)
+    out_factor *= DFI_DELTA_HASH_MULTIPLIER;
+
+  pending = 0;
+  shift = 0;
+  i = 0;
+  hash = dfi_delta_hash_block ((const guchar *) new_data);
+
+  while (i + DFI_DELTA_BLOCK_SIZE <= new_size)
+    {
+      gsize start, end, old;
+
+      /* Padding for alignment may have changed the shift slightly */
+      old = 0;
+      end = 0;
+      for (delta = -3; delta <= 3; delta++)
+        {
+          gssize candidate = (gssize) i + shift + delta;
+          gsize length;
+
+          if (candidate < 0 || candidate >= old_size)
+            continue;
+
+          length = dfi_delta_extend (old_data, relocated, candidate, old_size, new_data, i, new_size - i, FALSE);
+          if (length > end)
+            {
+              old = candidate;
+              end = length;
+            }
+        }
+
+      if (end < DFI_DELTA_MIN_COPY)
+        {
+          old = dfi_delta_lookup_block (blocks, old_data, hash, new_data + i);
+          if (old == 0)
+            old = dfi_delta_lookup_block (relocated_blocks, relocated, hash, new_data + i);
+
+          if (old == 0)
+            {
+              if (i + DFI_DELTA_BLOCK_SIZE < new_size)
+                hash = dfi_delta_hash_roll (hash, out_factor, new_data[i], new_data[i + DFI_DELTA_BLOCK_SIZE]);
+              i++;
+              continue;
+            }
+
+          old--;
+          end = dfi_delta_extend (old_data, relocated, old, old_size, new_data, i, new_size - i, FALSE);
+        }
+
+      /* Extend backwards into the pending literal */
+      start = dfi_delta_extend (old_data, relocated, old, old_size, new_data, i, i - pending, TRUE);
+
+      if (relocated && start > 0 && old % 4 != 0 &&
+          dfi_delta_word_is_mixed (old_data, relocated, old - start, old + end, new_data, i - start, old))
+        {
+          dfi_delta_add_copy (copies, old_data, old - start, new_data, i - start, start);
+          dfi_delta_add_copy (copies, old_data, old, new_data, i, end);
+        }
+      else
+        dfi_delta_add_copy (copies, old_data, old - start, new_data, i - start, start + end);
+
+      shift = (gssize) old - (gssize) i;
+      pending = i = i + end;
+
+      if (i + DFI_DELTA_BLOCK_SIZE <= new_size)
+        hash = dfi_delta_hash_block ((const guchar *) new_data + i);
+    }
+
+  g_hash_table_unref (blocks);
+  if (relocated_blocks)
+    g_hash_table_unref (relocated_blocks);
+
+  return copies;
+}
+
+/* relocation bits {{{1 */
+
+/* Returns the offsets of the ambiguous words that the given range of
+ * the old file touches
+ */
+static GArray *
+dfi_delta_get_ambiguous (const gchar *old_data,
+                         const gchar *relocated,
+                         gsize        old_size,
+                         gsize        old_offset,
+                         gsize        length)
+{
+  GArray *words;
+  gsize word;
+
+  words = g_array_new (FALSE, FALSE, sizeof (gsize));
+
+  for (word = old_offset & ~3; word < old_offset + length && word + 4 <= old_size; word += 4)
+    if (memcmp (old_data + word, relocated + word, 4) != 0)
+      g_array_append_val (words, word);
+
+  return words;
+}
+
+/* Most structures in the file are made of 8 byte records, so whether a
+ * word needs relocating is predicted from the word 8 bytes before it,
+ * falling back to the previous ambiguous word.  Only the words where
+ * the prediction is wrong are recorded.
+ */
+static gboolean
+dfi_delta_predict_bit (GArray   *words,
+                       gboolean *bits,
+                       guint     i)
+{
+  const gsize *offsets = (const gsize *) words->data;
+  guint j;
+
+  for (j = i; j > 0 && j + 2 > i; j--)
+    if (offsets[j - 1] + 8 == offsets[i])
+      return bits[j - 1];
+
+  return i > 0 ? bits[i - 1] : TRUE;
+}
+
+static void
+dfi_delta_write_bits (GString     *out,
+                      const gchar *old_data,
+                      const gchar *relocated,
+                      gsize        old_size,
+                      const gchar *new_data,
+                      DfiDeltaCopy *copy)
+{
+  GArray *mispredicted;
+  gboolean *bits;
+  GArray *words;
+  guint i;
+
+  words = dfi_delta_get_ambiguous (old_data, relocated, old_size, copy->old_offset, copy->length);
+  bits = g_new (gboolean, words->len);
+  mispredicted = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  for (i = 0; i < words->len; i++)
+    {
+      gsize word = g_array_index (words, gsize, i);
+      gsize start = MAX (word, copy->old_offset);
+      gsize end = MIN (word + 4, copy->old_offset + copy->length);
+
+      bits[i] = memcmp (relocated + start, new_data + start - copy->old_offset + copy->new_offset, end - start) == 0;
+
+      if (bits[i] != dfi_delta_predict_bit (words, bits, i))
+        g_array_append_val (mispredicted, i);
+    }
+
+  dfi_delta_write_varint (out, mispredicted->len);
+  for (i = 0; i < mispredicted->len; i++)
+    dfi_delta_write_varint (out, g_array_index (mispredicted, guint, i) - (i ? g_array_index (mispredicted, guint, i - 1) : 0));
+
+  g_array_free (mispredicted, TRUE);
+  g_array_free (words, TRUE);
+  g_free (bits);
+}
+
+static gboolean
+dfi_delta_read_relocated_copy (GString       *out,
+                               const gchar   *old_data,
+                               const gchar   *relocated,
+                               gsize          old_size,
+                               gsize          old_offset,
+                               gsize          length,
+                               const guchar **data,
+                               const guchar  *end)
+{
+  guint n_mispredicted;
+  guint mispredicted;
+  guint previous;
+  gboolean success;
+  gboolean *bits;
+  GArray *words;
+  gsize next;
+  guint i;
+
+  if (!dfi_delta_read_varint (data, end, &n_mispredicted))
+    return FALSE;
+
+  words = dfi_delta_get_ambiguous (old_data, relocated, old_size, old_offset, length);
+  bits = g_new (gboolean, words->len);
+  mispredicted = G_MAXUINT;
+  previous = 0;
+  next = old_offset;
+
+  for (i = 0; i < words->len; i++)
+    {
+      gsize word = g_array_index (words, gsize, i);
+      gsize start = MAX (word, old_offset);
+
+      if (n_mispredicted && mispredicted == G_MAXUINT)
+        {
+          guint gap;
+
+          if (!dfi_delta_read_varint (data, end, &gap))
+            break;
+
+          mispredicted = previous + gap;
+          previous = mispredicted;
+          n_mispredicted--;
+        }
+
+      bits[i] = dfi_delta_predict_bit (words, bits, i);
+      if (i == mispredicted)
+        {
+          bits[i] = !bits[i];
+          mispredicted = G_MAXUINT;
+        }
+
+      g_string_append_len (out, old_data + next, start - next);
+      next = MIN (word + 4, old_offset + length);
+      g_string_append_len (out, (bits[i] ? relocated : old_data) + start, next - start);
+    }
+
+  g_string_append_len (out, old_data + next, old_offset + length - next);
+
+  success = i == words->len && n_mispredicted == 0 && mispredicted == G_MAXUINT;
+
+  g_array_free (words, TRUE);
+  g_free (bits);
+
+  return success;
+}
+
+/* public API {{{1 */
+GString *
+dfi_delta_create (const gchar *old_data,
+                  gsize        old_size,
+                  const gchar *new_data,
+                  gsize        new_size)
+{
+  GArray *relocations;
+  gchar *relocated;
+  GArray *copies;
+  GString *delta;
+  gsize position;
+  gint round;
+  guint i;
+
+  copies = dfi_delta_find_copies (old_data, NULL, old_size, new_data, new_size);
+  relocations = g_array_new (FALSE, FALSE, sizeof (DfiDeltaRelocation));
+  relocated = NULL;
+
+  for (round = 0; round < DFI_DELTA_ROUNDS; round++)
+    {
+      g_array_set_size (relocations, 0);
+
+      for (i = 0; i < copies->len; i++)
+        {
+          DfiDeltaCopy *copy = &g_array_index (copies, DfiDeltaCopy, i);
+          DfiDeltaRelocation reloc = { copy->old_offset, copy->new_offset, copy->length };
+
+          g_array_append_val (relocations, reloc);
+        }
+
+      dfi_delta_relocations_normalise (relocations);
+
+      g_free (relocated);
+      relocated = dfi_delta_relocate (old_data, old_size, (DfiDeltaRelocation *) relocations->data, relocations->len);
+
+      g_array_free (copies, TRUE);
+      copies = dfi_delta_find_copies (old_data, relocated, old_size, new_data, new_size);
+    }
+
+  delta = g_string_new (DFI_DELTA_MAGIC);
+  dfi_delta_write_varint (delta, old_size);
+  dfi_delta_write_varint (delta, new_size);
+  dfi_delta_write_varint (delta, dfi_delta_hash_data (old_data, old_size));
+  dfi_delta_write_varint (delta, dfi_delta_hash_data (new_data, new_size));
+
+  dfi_delta_write_varint (delta, relocations->len);
+  for (i = 0; i < relocations->len; i++)
+    {
+      DfiDeltaRelocation *reloc = &g_array_index (relocations, DfiDeltaRelocation, i);
+
+      dfi_delta_write_varint (delta, reloc->old_start);
+      dfi_delta_write_varint (delta, reloc->new_start);
+      dfi_delta_write_varint (delta, reloc->length);
+    }
+
+  position = 0;
+
+  for (i = 0; i <= copies->len; i++)
+    {
+      DfiDeltaCopy *copy = NULL;
+      gsize next;
+
+      if (i < copies->len)
+        {
+          copy = &g_array_index (copies, DfiDeltaCopy, i);
+          next = copy->new_offset;
+        }
+      else
+        next = new_size;
+
+      if (next > position)
+        {
+          dfi_delta_write_varint (delta, DFI_DELTA_INSERT);
+          dfi_delta_write_varint (delta, next - position);
+          g_string_append_len (delta, new_data + position, next - position);
+        }
+
+      if (copy == NULL)
+        break;
+
+      dfi_delta_write_varint (delta, copy->relocated ? DFI_DELTA_COPY_RELOCATED : DFI_DELTA_COPY);
+      dfi_delta_write_varint (delta, copy->old_offset);
+      dfi_delta_write_varint (delta, copy->length);
+
+      if (copy->relocated)
+        dfi_delta_write_bits (delta, old_data, relocated, old_size, new_data, copy);
+
+      position = copy->new_offset + copy->length;
+    }
+
+  g_array_free (relocations, TRUE);
+  g_array_free (copies, TRUE);
+  g_free (relocated);
+
+  return delta;
+}
+
+GString *
+dfi_delta_apply (const gchar *old_data,
+                 gsize        old_size,
+                 const gchar *delta,
+                 gsize        delta_size)
+{
+  const guchar *data = (const guchar *) delta;
+  const guchar *end = data + delta_size;
+  DfiDeltaRelocation *relocations;
+  guint expected_old_size;
+  guint n_relocations;
+  gchar *relocated;
+  GString *result;
+  guint new_size;
+  guint new_hash;
+  guint hash;
+  guint i;
+
+  if (delta_size < strlen (DFI_DELTA_MAGIC) || memcmp (delta, DFI_DELTA_MAGIC, strlen (DFI_DELTA_MAGIC)) != 0)
+    return NULL;
+
+  data += strlen (DFI_DELTA_MAGIC);
+
+  if (!dfi_delta_read_varint (&data, end, &expected_old_size) ||
+      !dfi_delta_read_varint (&data, end, &new_size) ||
+      !dfi_delta_read_varint (&data, end, &hash) ||
+      !dfi_delta_read_varint (&data, end, &new_hash) ||
+      !dfi_delta_read_varint (&data, end, &n_relocations))
+    return NULL;
+
+  /* Make sure that we're patching the file that the delta is for */
+  if (expected_old_size != old_size || hash != dfi_delta_hash_data (old_data, old_size))
+    return NULL;
+
+  if (n_relocations > (end - data) / 3)
+    return NULL;
+
+  relocations = g_new (DfiDeltaRelocation, n_relocations);
+  for (i = 0; i < n_relocations; i++)
+    if (!dfi_delta_read_varint (&data, end, &relocations[i].old_start) ||
+        !dfi_delta_read_varint (&data, end, &relocations[i].new_start) ||
+        !dfi_delta_read_varint (&data, end, &relocations[i].length) ||
+        (i && relocations[i].old_start < relocations[i - 1].old_start + relocations[i - 1].length))
+      {
+        g_free (relocations);
+        return NULL;
+      }
+
+  relocated = dfi_delta_relocate (old_data, old_size, relocations, n_relocations);
+  g_free (relocations);
+
+  result = g_string_sized_new (new_size);
+
+  while (result->len < new_size)
+    {
+      guint op, offset, length;
+
+      if (!dfi_delta_read_varint (&data, end, &op))
+        break;
+
+      if (op == DFI_DELTA_INSERT)
+        {
+          if (!dfi_delta_read_varint (&data, end, &length) || length > end - data)
+            break;
+
+          g_string_append_len (result, (const gchar *) data, length);
+          data += length;
+        }
+      else if (op == DFI_DELTA_COPY || op == DFI_DELTA_COPY_RELOCATED)
+        {
+          if (!dfi_delta_read_varint (&data, end, &offset) ||
+              !dfi_delta_read_varint (&data, end, &length) ||
+              offset > old_size || length > old_size - offset)
+            break;
+
+          if (op == DFI_DELTA_COPY_RELOCATED)
+            {
+              if (!dfi_delta_read_relocated_copy (result, old_data, relocated, old_size, offset, length, &data, end))
+                break;
+            }
+          else
+            g_string_append_len (result, old_data + offset, length);
+        }
+      else
+        break;
+    }
+
+  g_free (relocated);
+
+  if (result->len != new_size || data != end || new_hash != dfi_delta_hash_data (result->str, result->len))
+    {
+      g_string_free (result, TRUE);
+      return NULL;
+    }
+
+  return result;
+}
+
+/* Epilogue {{{1 */
+/* vim:set foldmethod=marker: */
@@ -0,0 +1,11 @@
+#include <glib.h>
+
+GString *               dfi_delta_create                                (const gchar  *old_data,
+                                                                         gsize         old_size,
+                                                                         const gchar  *new_data,
+                                                                         gsize         new_size);
+
+GString *               dfi_delta_apply                                 (const gchar  *old_data,
+                                                                         gsize         old_size,
+                                                                         const gchar  *delta,
+                                                                         gsize         delta_size);
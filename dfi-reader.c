@@ -21,29 +21,67 @@
 
 #include "dfi-reader.h"
 
+#include "dfi-tokenizer.h"
+
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/fcntl.h>
 #include <unistd.h>
 
 /* struct dfi_index struct {{{1 */
+struct dfi_index_segment
+{
+  guint32                       start;
+  guint32                       size;
+  guint32                       file_offset;
+  gchar                        *filename;
+  gint                          mapped;
+};
+
+struct dfi_index_section
+{
+  guint32                       offset;         /* 0 if the section is missing */
+  guint32                       length;
+  guint32                       flags;
+};
+
 struct dfi_index
 {
   gchar                        *data;
   guint32                       file_size;
+  gboolean                      wide_ids;       /* DFI_HEADER_FLAG_WIDE_IDS */
+  gboolean                      string_lengths; /* DFI_HEADER_FLAG_STRING_LENGTHS */
+  gboolean                      overlays;       /* DFI_HEADER_FLAG_OVERLAYS */
 
   const struct dfi_string_list *app_names;
   const struct dfi_string_list *key_names;
   const struct dfi_string_list *locale_names;
   const struct dfi_string_list *group_names;
 
-  const struct dfi_pointer_array *implementors;    /* id lists, associated with group_names */
-  const struct dfi_pointer_array            *text_indexes;    /* text indexes, associated with locale_names */
-  const struct dfi_pointer_array            *desktop_files;   /* desktop files, associated with app_names */
+  /* The base of overlay text indexes, if there are any */
+  const struct dfi_text_index  *overlay_base;
+
+  /* text index -> struct dfi_fuzzy_trie, built as needed under fuzzy_lock */
+  GHashTable                   *fuzzy_tries;
+  GMutex                        fuzzy_lock;
 
-  const struct dfi_text_index  *mime_types;
+  /* The other sections are only validated when they're used */
+  struct dfi_index_section      sections[DFI_SECTION_N_TYPES];
+
+  /* Access profile, only allocated if DFI_PROFILE is set */
+  GHashTable                   *profile_offsets; /* offset -> hits */
+  guint                        *profile_key_hits;
+  guint                        *profile_locale_hits;
+  gchar                        *profile_filename;
+
+  /* Only for caches split with --split-locales (see struct dfi_segment) */
+  struct dfi_index_segment     *segments;
+  guint                         n_segments;
+  gint                          dir_fd;
+  struct dfi_segment_build_id   build_id;
 };
 
 /* dfi_uint16, dfi_uint32 {{{1 */
@@ -60,6 +98,348 @@ dfi_uint32_get (dfi_uint32 value)
   return GUINT32_FROM_LE (value.le);
 }
 
+/* access profiling {{{1 */
+
+/* If the DFI_PROFILE environment variable is set then we record which
+ * desktop files, text indexes, keys and locales are touched during the
+ * lifetime of the index and append a summary to the named file when the
+ * index is freed.  'compile --profile' uses that file to pack the hot
+ * data together at the front of the cache.
+ */
+static void
+dfi_index_profile_offset (const struct dfi_index *dfi,
+                          dfi_pointer             pointer)
+{
+  gpointer key = GUINT_TO_POINTER (dfi_uint32_get (pointer.offset));
+  guint hits;
+
+  hits = GPOINTER_TO_UINT (g_hash_table_lookup (dfi->profile_offsets, key));
+  g_hash_table_insert (dfi->profile_offsets, key, GUINT_TO_POINTER (hits + 1));
+}
+
+static void
+dfi_index_profile_init (struct dfi_index *dfi)
+{
+  const gchar *filename;
+
+  filename = getenv ("DFI_PROFILE");
+  if (filename == NULL || filename[0] == '\0')
+    return;
+
+  dfi->profile_filename = g_strdup (filename);
+  dfi->profile_offsets = g_hash_table_new (NULL, NULL);
+  dfi->profile_key_hits = g_new0 (guint, dfi_string_list_get_length (dfi->key_names, dfi));
+  dfi->profile_locale_hits = g_new0 (guint, dfi_string_list_get_length (dfi->locale_names, dfi));
+}
+
+static void
+dfi_index_profile_write_array (const struct dfi_index         *dfi,
+                               const struct dfi_pointer_array *array,
+                               const gchar                    *kind,
+                               guint                          *extra_hits,
+                               FILE                           *file)
+{
+  guint n, i;
+
+  if (array == NULL)
+    return;
+
+  n = dfi_pointer_array_get_length (array, dfi);
+
+  for (i = 0; i < n; i++)
+    {
+      gpointer key = GUINT_TO_POINTER (dfi_uint32_get (array->pointers[i].offset));
+      guint hits;
+
+      hits = GPOINTER_TO_UINT (g_hash_table_lookup (dfi->profile_offsets, key));
+      if (extra_hits)
+        hits += extra_hits[i];
+
+      if (hits)
+        fprintf (file, "%s %s %u\n", kind, dfi_pointer_array_get_item_key (array, dfi, i), hits);
+    }
+}
+
+static void
+dfi_index_profile_write (struct dfi_index *dfi)
+{
+  FILE *file;
+  guint n, i;
+
+  file = fopen (dfi->profile_filename, "a");
+  if (file == NULL)
+    return;
+
+  dfi_index_profile_write_array (dfi, dfi_index_get_desktop_files (dfi), "app", NULL, file);
+  dfi_index_profile_write_array (dfi, dfi_index_get_text_indexes (dfi), "locale", dfi->profile_locale_hits, file);
+
+  n = dfi_string_list_get_length (dfi->key_names, dfi);
+  for (i = 0; i < n; i++)
+    if (dfi->profile_key_hits[i])
+      fprintf (file, "key %s %u\n", dfi_string_list_get_string_at_index (dfi->key_names, dfi, i),
+               dfi->profile_key_hits[i]);
+
+  fclose (file);
+}
+
+static void
+dfi_index_profile_free (struct dfi_index *dfi)
+{
+  if (dfi->profile_filename == NULL)
+    return;
+
+  dfi_index_profile_write (dfi);
+
+  g_hash_table_unref (dfi->profile_offsets);
+  g_free (dfi->profile_key_hits);
+  g_free (dfi->profile_locale_hits);
+  g_free (dfi->profile_filename);
+}
+
+/* dfi_header {{{1 */
+
+const struct dfi_header *
+dfi_header_get (const struct dfi_index *dfi)
+{
+  if (dfi->file_size < G_STRUCT_OFFSET (struct dfi_header, sections))
+    return NULL;
+
+  return (const struct dfi_header *) dfi->data;
+}
+
+/* sections {{{1 */
+
+/* Applies the access hints of the sections found in the given range
+ * (which must already be mapped)
+ */
+static void
+dfi_index_advise (const struct dfi_index *dfi,
+                  guint32                 start,
+                  guint32                 size)
+{
+  guintptr page_mask = sysconf (_SC_PAGESIZE) - 1;
+  guint i;
+
+  for (i = 0; i < DFI_SECTION_N_TYPES; i++)
+    {
+      const struct dfi_index_section *section = &dfi->sections[i];
+      guintptr first, last;
+      gint advice;
+
+      if (section->flags & DFI_SECTION_FLAG_WILLNEED)
+        advice = MADV_WILLNEED;
+      else if (section->flags & DFI_SECTION_FLAG_SEQUENTIAL)
+        advice = MADV_SEQUENTIAL;
+      else
+        continue;
+
+      if (section->offset == 0 || section->offset < start || section->offset - start >= size)
+        continue;
+
+      first = (guintptr) (dfi->data + section->offset) & ~page_mask;
+      last = (guintptr) (dfi->data + MIN (section->offset + section->length, start + size));
+      madvise ((gpointer) first, last - first, advice);
+    }
+}
+
+/* Returns a pointer to the root structure of a section, or 0 if the
+ * section is missing or doesn't fit in the file
+ */
+static dfi_pointer
+dfi_index_get_section (const struct dfi_index *dfi,
+                       guint                   type)
+{
+  const struct dfi_index_section *section = &dfi->sections[type];
+  dfi_pointer pointer = { };
+
+  if (section->length <= dfi->file_size && section->offset <= dfi->file_size - section->length)
+    pointer.offset.le = GUINT32_TO_LE (section->offset);
+
+  return pointer;
+}
+
+/* Reads the section table, without looking at any of the sections */
+static gboolean
+dfi_index_read_sections (struct dfi_index *dfi)
+{
+  const struct dfi_header *header;
+  guint n, i;
+
+  header = dfi_header_get (dfi);
+  if (header == NULL)
+    return FALSE;
+
+  if (dfi_uint32_get (header->magic) != DFI_HEADER_MAGIC ||
+      dfi_uint16_get (header->version) != DFI_HEADER_VERSION ||
+      (dfi_uint32_get (header->flags) & ~(DFI_HEADER_FLAG_WIDE_IDS | DFI_HEADER_FLAG_STRING_LENGTHS |
+                                                 DFI_HEADER_FLAG_OVERLAYS)) != 0)
+    return FALSE;
+
+  dfi->wide_ids = (dfi_uint32_get (header->flags) & DFI_HEADER_FLAG_WIDE_IDS) != 0;
+  dfi->string_lengths = (dfi_uint32_get (header->flags) & DFI_HEADER_FLAG_STRING_LENGTHS) != 0;
+  dfi->overlays = (dfi_uint32_get (header->flags) & DFI_HEADER_FLAG_OVERLAYS) != 0;
+
+  /* n_sections is 16bit, so no overflow danger */
+  n = dfi_uint16_get (header->n_sections);
+  if (dfi->file_size < G_STRUCT_OFFSET (struct dfi_header, sections) + n * sizeof (struct dfi_section))
+    return FALSE;
+
+  for (i = 0; i < n; i++)
+    {
+      const struct dfi_section *section = &header->sections[i];
+      guint type = dfi_uint32_get (section->type);
+      guint offset = dfi_uint32_get (section->offset);
+
+      if (type == 0 || type >= DFI_SECTION_N_TYPES)
+        {
+          if (dfi_uint32_get (section->flags) & DFI_SECTION_FLAG_REQUIRED)
+            return FALSE;
+
+          continue;
+        }
+
+      /* Duplicates are as bad as a section at offset 0 */
+      if (offset == 0 || dfi->sections[type].offset != 0)
+        return FALSE;
+
+      dfi->sections[type].offset = offset;
+      dfi->sections[type].length = dfi_uint32_get (section->length);
+      dfi->sections[type].flags = dfi_uint32_get (section->flags);
+    }
+
+  return TRUE;
+}
+
+/* lazily-mapped segments {{{1 */
+
+/* Opens the file of segment, or gives -1 if the file is too short or
+ * if it is a locale file from a different build than index.cache.
+ */
+static gint
+dfi_index_segment_open (const struct dfi_index         *dfi,
+                        const struct dfi_index_segment *segment)
+{
+  struct dfi_segment_build_id build_id;
+  struct stat buf;
+  guint64 size;
+  gint fd;
+
+  fd = openat (dfi->dir_fd, segment->filename, O_RDONLY);
+  if (fd < 0)
+    return -1;
+
+  if (fstat (fd, &buf) < 0)
+    goto err;
+
+  size = buf.st_size;
+
+  if (!g_str_equal (segment->filename, "index.cache"))
+    {
+      if (size < sizeof build_id ||
+          pread (fd, &build_id, sizeof build_id, size - sizeof build_id) != sizeof build_id ||
+          memcmp (&build_id, &dfi->build_id, sizeof build_id) != 0)
+        goto err;
+
+      size -= sizeof build_id;
+    }
+
+  if ((guint64) segment->file_offset + segment->size > size)
+    goto err;
+
+  return fd;
+
+err:
+  close (fd);
+
+  return -1;
+}
+
+/* For split caches, 'data' is a PROT_NONE reservation covering the
+ * entire logical file and the segments get mapped into it (at their
+ * logical offset) the first time that something inside of them is
+ * dereferenced.  Unused locales therefore never get mapped at all.
+ */
+static gboolean
+dfi_index_segment_map (const struct dfi_index   *dfi,
+                       struct dfi_index_segment *segment)
+{
+  gpointer mapping;
+  gint fd;
+
+  fd = dfi_index_segment_open (dfi, segment);
+  if (fd < 0)
+    return FALSE;
+
+  /* If two threads race to get here they will both map the same file
+   * contents at the same address.  That's harmless.
+   */
+  mapping = mmap (dfi->data + segment->start, segment->size, PROT_READ,
+                  MAP_SHARED | MAP_FIXED, fd, segment->file_offset);
+  close (fd);
+
+  if (mapping == MAP_FAILED)
+    return FALSE;
+
+  madvise (mapping, segment->size, MADV_RANDOM);
+  dfi_index_advise (dfi, segment->start, segment->size);
+  g_atomic_int_set (&segment->mapped, TRUE);
+
+  return TRUE;
+}
+
+static gboolean
+dfi_index_segment_read (const struct dfi_index   *dfi,
+                        struct dfi_index_segment *segment)
+{
+  gssize result;
+  gint fd;
+
+  fd = dfi_index_segment_open (dfi, segment);
+  if (fd < 0)
+    return FALSE;
+
+  result = pread (fd, dfi->data + segment->start, segment->size, segment->file_offset);
+  close (fd);
+
+  segment->mapped = TRUE;
+
+  return result == segment->size;
+}
+
+static gboolean
+dfi_index_ensure_mapped (const struct dfi_index *dfi,
+                         guint                   offset,
+                         guint                   size)
+{
+  struct dfi_index_segment *segment;
+  guint l, r;
+
+  /* Find the last segment starting at or before offset */
+  l = 0;
+  r = dfi->n_segments;
+
+  while (r - l > 1)
+    {
+      guint m = l + (r - l) / 2;
+
+      if (dfi->segments[m].start <= offset)
+        l = m;
+      else
+        r = m;
+    }
+
+  segment = &dfi->segments[l];
+
+  /* Don't allow reads to cross out of the segment (into a gap) */
+  if (offset < segment->start || offset - segment->start + size > segment->size)
+    return FALSE;
+
+  if G_LIKELY (g_atomic_int_get (&segment->mapped))
+    return TRUE;
+
+  return dfi_index_segment_map (dfi, segment);
+}
+
 /* dfi_string {{{1 */
 
 static gboolean
@@ -76,12 +456,103 @@ dfi_string_get (const struct dfi_index *dfi,
 
   offset &= ~(1u << 31);
 
+  if G_UNLIKELY (dfi->segments != NULL && !dfi_index_ensure_mapped (dfi, offset, 1))
+    return "";
+
   if (offset < dfi->file_size)
     return dfi->data + offset;
   else
     return "";
 }
 
+/* Only for strings from the string tables */
+static const gchar *
+dfi_string_get_with_length (const struct dfi_index *dfi,
+                            dfi_string              string,
+                            gsize                  *length)
+{
+  guint32 offset;
+  guint32 value;
+  guint i;
+
+  if G_LIKELY (!dfi->string_lengths)
+    {
+      const gchar *str = dfi_string_get (dfi, string);
+
+      *length = strlen (str);
+
+      return str;
+    }
+
+  offset = dfi_uint32_get (string.offset) & ~(1u << 31);
+
+  if (offset >= dfi->file_size)
+    goto invalid;
+
+  /* Read the varint backwards from the start of the string */
+  value = 0;
+  for (i = 1; ; i++)
+    {
+      guchar byte;
+
+      if (i > DFI_STRING_LENGTH_MAX_BYTES || i > offset)
+        goto invalid;
+
+      if G_UNLIKELY (dfi->segments != NULL && !dfi_index_ensure_mapped (dfi, offset - i, i + 1))
+        goto invalid;
+
+      byte = dfi->data[offset - i];
+      value |= (guint32) (byte & 0x7f) << (7 * (i - 1));
+
+      if (~byte & 0x80)
+        break;
+    }
+
+  if (value >= dfi->file_size - offset)
+    goto invalid;
+
+  if G_UNLIKELY (dfi->segments != NULL && !dfi_index_ensure_mapped (dfi, offset, value + 1))
+    goto invalid;
+
+  if (dfi->data[offset + value] != '\0')
+    goto invalid;
+
+  *length = value;
+
+  return dfi->data + offset;
+
+invalid:
+  *length = 0;
+
+  return "";
+}
+
+/* Compares like strcmp(), but without walking the strings if the file
+ * has their lengths
+ */
+static gint
+dfi_string_compare (const struct dfi_index *dfi,
+                    const gchar            *str,
+                    gsize                   length,
+                    dfi_string              string)
+{
+  const gchar *other;
+  gsize other_length;
+  gint x;
+
+  if G_LIKELY (!dfi->string_lengths)
+    return strcmp (str, dfi_string_get (dfi, string));
+
+  other = dfi_string_get_with_length (dfi, string, &other_length);
+
+  x = memcmp (str, other, MIN (length, other_length));
+
+  if (x == 0)
+    x = (length > other_length) - (length < other_length);
+
+  return x;
+}
+
 /* dfi_pointer, dfi_pointer_array {{{1 */
 static gconstpointer
 dfi_pointer_dereference (const struct dfi_index *dfi,
@@ -90,6 +561,10 @@ dfi_pointer_dereference (const struct dfi_index *dfi,
 {
   guint offset = dfi_uint32_get (pointer.offset);
 
+  /* The header is at offset 0, so nothing can point there */
+  if (offset == 0)
+    return NULL;
+
   /* Check to make sure we don't wrap */
   if (offset + min_size < min_size)
     return NULL;
@@ -98,6 +573,9 @@ dfi_pointer_dereference (const struct dfi_index *dfi,
   if (offset + min_size > dfi->file_size)
     return NULL;
 
+  if G_UNLIKELY (dfi->segments != NULL && !dfi_index_ensure_mapped (dfi, offset, min_size))
+    return NULL;
+
   return dfi->data + offset;
 }
 
@@ -128,8 +606,8 @@ dfi_pointer_array_from_pointer (const struct dfi_index *dfi,
   if (keys == NULL)
     return NULL;
 
-  /* string list length is 16bit, so no overflow danger */
-  need_size += sizeof (dfi_pointer) * dfi_string_list_get_length (keys);
+  /* string list was validated, so its length fits in the file */
+  need_size += sizeof (dfi_pointer) * dfi_string_list_get_length (keys, dfi);
 
   return dfi_pointer_dereference (dfi, pointer, need_size);
 }
@@ -142,7 +620,7 @@ dfi_pointer_array_get_length (const struct dfi_pointer_array *array,
 
   keys = dfi_pointer_dereference_unchecked (dfi, array->associated_string_list);
 
-  return dfi_uint16_get (keys->n_strings);
+  return dfi_string_list_get_length (keys, dfi);
 }
 
 const gchar *
@@ -166,31 +644,55 @@ dfi_pointer_array_get_pointer (const struct dfi_pointer_array *array,
 
 /* dfi_id, dfi_id_list {{{1 */
 
-gboolean
-dfi_id_valid (dfi_id id)
+/* These both return G_MAXUINT for the invalid id */
+static guint
+dfi_id_get (dfi_id id)
+{
+  guint value = dfi_uint16_get (id);
+
+  return G_LIKELY (value != G_MAXUINT16) ? value : G_MAXUINT;
+}
+
+static guint
+dfi_wide_id_get (dfi_wide_id id)
 {
-  return dfi_uint16_get (id) != 0xffff;
+  return dfi_uint32_get (id);
 }
 
 guint
-dfi_id_get (dfi_id id)
+dfi_id_array_get (const dfi_id           *ids,
+                  const struct dfi_index *dfi,
+                  gint                    i)
 {
-  return dfi_uint16_get (id);
+  if G_LIKELY (!dfi->wide_ids)
+    return dfi_id_get (ids[i]);
+  else
+    return dfi_wide_id_get (((const dfi_wide_id *) ids)[i]);
 }
 
 const dfi_id *
 dfi_id_list_get_ids (const struct dfi_id_list *list,
+                     const struct dfi_index   *dfi,
                      gint                     *n_ids)
 {
+  const struct dfi_id_list_wide *wide;
+
   if (list == NULL)
     {
       *n_ids = 0;
       return NULL;
     }
 
-  *n_ids = dfi_uint16_get (list->n_ids);
+  if G_LIKELY (!dfi->wide_ids)
+    {
+      *n_ids = dfi_uint16_get (list->n_ids);
+      return list->ids;
+    }
+
+  wide = (gconstpointer) list;
+  *n_ids = dfi_uint32_get (wide->n_ids);
 
-  return list->ids;
+  return (gconstpointer) wide->ids;
 }
 
 const struct dfi_id_list *
@@ -200,19 +702,68 @@ dfi_id_list_from_pointer (const struct dfi_index *dfi,
   const struct dfi_id_list *list;
   guint need_size;
 
-  need_size = sizeof (dfi_uint16);
+  if G_LIKELY (!dfi->wide_ids)
+    {
+      need_size = sizeof (dfi_uint16);
 
-  list = dfi_pointer_dereference (dfi, pointer, need_size);
+      list = dfi_pointer_dereference (dfi, pointer, need_size);
 
-  if (!list)
-    return NULL;
+      if (!list)
+        return NULL;
+
+      /* n_ids is 16bit, so no overflow danger */
+      need_size += sizeof (dfi_id) * dfi_uint16_get (list->n_ids);
+    }
+  else
+    {
+      const struct dfi_id_list_wide *wide;
+      guint n_ids;
+
+      need_size = sizeof (dfi_uint32);
+
+      wide = dfi_pointer_dereference (dfi, pointer, need_size);
+
+      if (!wide)
+        return NULL;
 
-  /* n_ids is 16bit, so no overflow danger */
-  need_size += sizeof (dfi_id) * dfi_uint16_get (list->n_ids);
+      /* It's 32 bit, so make sure this won't overflow when we multiply */
+      n_ids = dfi_uint32_get (wide->n_ids);
+      if (n_ids > dfi->file_size / sizeof (dfi_wide_id))
+        return NULL;
+
+      need_size += sizeof (dfi_wide_id) * n_ids;
+    }
 
   return dfi_pointer_dereference (dfi, pointer, need_size);
 }
 
+/* Sets the bits of mask (a bitmap over the app ids, as for
+ * dfi_app_flags_mask(), of n_words words) for the apps in id_list.
+ */
+static void
+dfi_id_list_set_bits (const struct dfi_id_list *id_list,
+                      const struct dfi_index   *dfi,
+                      guint32                  *mask,
+                      guint                     n_words)
+{
+  const dfi_id *ids;
+  gint n_ids;
+  gint i;
+
+  if (id_list == NULL)
+    return;
+
+  ids = dfi_id_list_get_ids (id_list, dfi, &n_ids);
+
+  for (i = 0; i < n_ids; i++)
+    {
+      guint app = dfi_id_array_get (ids, dfi, i);
+
+      if (app / 32 < n_words)
+        mask[app / 32] |= 1u << (app % 32);
+    }
+}
+
 /* dfi_string_list {{{1 */
 
 const struct dfi_string_list *
@@ -221,16 +772,25 @@ dfi_string_list_from_pointer (const struct dfi_index *dfi,
 {
   const struct dfi_string_list *list;
   guint need_size;
+  guint n_strings;
 
-  need_size = sizeof (dfi_uint16);
+  /* The strings are at the same place in both formats */
+  G_STATIC_ASSERT (G_STRUCT_OFFSET (struct dfi_string_list, strings) ==
+                   G_STRUCT_OFFSET (struct dfi_string_list_wide, strings));
+
+  need_size = G_STRUCT_OFFSET (struct dfi_string_list, strings);
 
   list = dfi_pointer_dereference (dfi, pointer, need_size);
 
   if (!list)
     return NULL;
 
-  /* n_strings is 16bit, so no overflow danger */
-  need_size += sizeof (dfi_string) * dfi_uint16_get (list->n_strings);
+  /* Might be 32 bit, so make sure this won't overflow when we multiply */
+  n_strings = dfi_string_list_get_length (list, dfi);
+  if (n_strings > dfi->file_size / sizeof (dfi_string))
+    return NULL;
+
+  need_size += sizeof (dfi_string) * n_strings;
 
   return dfi_pointer_dereference (dfi, pointer, need_size);
 }
@@ -240,10 +800,13 @@ dfi_string_list_binary_search (const struct dfi_string_list *list,
                                const struct dfi_index       *dfi,
                                const gchar                  *string)
 {
+  gsize length;
   guint l, r;
 
+  length = strlen (string);
+
   l = 0;
-  r = dfi_uint16_get (list->n_strings);
+  r = dfi_string_list_get_length (list, dfi);
 
   while (l < r)
     {
@@ -252,7 +815,7 @@ dfi_string_list_binary_search (const struct dfi_string_list *list,
 
       m = l + (r - l) / 2;
 
-      x = strcmp (string, dfi_string_get (dfi, list->strings[m]));
+      x = dfi_string_compare (dfi, string, length, list->strings[m]);
 
       if (x > 0)
         l = m + 1;
@@ -266,9 +829,13 @@ dfi_string_list_binary_search (const struct dfi_string_list *list,
 }
 
 guint
-dfi_string_list_get_length (const struct dfi_string_list *list)
+dfi_string_list_get_length (const struct dfi_string_list *list,
+                            const struct dfi_index       *dfi)
 {
-  return dfi_uint16_get (list->n_strings);
+  if G_LIKELY (!dfi->wide_ids)
+    return dfi_uint16_get (list->n_strings);
+  else
+    return dfi_uint32_get (((const struct dfi_string_list_wide *) list)->n_strings);
 }
 
 const gchar *
@@ -282,24 +849,61 @@ dfi_string_list_get_string_at_index (const struct dfi_string_list *list,
 const gchar *
 dfi_string_list_get_string (const struct dfi_string_list *list,
                             const struct dfi_index       *dfi,
-                            dfi_id                        id)
+                            guint                         id)
+{
+  if (list == NULL)
+    return NULL;
+
+  if (id == G_MAXUINT)
+    return NULL;
+
+  if (id < dfi_string_list_get_length (list, dfi))
+    return dfi_string_list_get_string_at_index (list, dfi, id);
+  else
+    return "";
+}
+
+const gchar *
+dfi_string_list_get_string_with_length (const struct dfi_string_list *list,
+                                        const struct dfi_index       *dfi,
+                                        guint                         id,
+                                        gsize                        *length)
 {
-  gint i = dfi_id_get (id);
+  *length = 0;
 
   if (list == NULL)
     return NULL;
 
-  if (i == 0xffff)
+  if (id == G_MAXUINT)
     return NULL;
 
-  if (i < dfi_uint16_get (list->n_strings))
-    return dfi_string_list_get_string_at_index (list, dfi, i);
+  if (id < dfi_string_list_get_length (list, dfi))
+    return dfi_string_get_with_length (dfi, list->strings[id], length);
   else
     return "";
 }
 
 /* dfi_text_index, dfi_text_index_item {{{1 */
 
+static guint
+dfi_text_index_get_n_items (const struct dfi_text_index *text_index)
+{
+  return dfi_uint32_get (text_index->n_items) & ~DFI_TEXT_INDEX_FLAG_OVERLAY;
+}
+
+/* Item ids of an overlay carry on into its base: id n_items is the
+ * first item of the base.
+ */
+static const struct dfi_text_index *
+dfi_text_index_get_base (const struct dfi_index      *dfi,
+                         const struct dfi_text_index *text_index)
+{
+  if (dfi->overlays && (dfi_uint32_get (text_index->n_items) & DFI_TEXT_INDEX_FLAG_OVERLAY))
+    return dfi->overlay_base;
+  else
+    return NULL;
+}
+
 const struct dfi_text_index *
 dfi_text_index_from_pointer (const struct dfi_index *dfi,
                              dfi_pointer             pointer)
@@ -316,43 +920,75 @@ dfi_text_index_from_pointer (const struct dfi_index *dfi,
     return NULL;
 
   /* It's 32 bit, so make sure this won't overflow when we multiply */
-  n_items = dfi_uint32_get (text_index->n_items);
+  n_items = dfi_text_index_get_n_items (text_index);
   if (n_items > (1u << 24))
     return NULL;
 
   need_size += sizeof (struct dfi_text_index_item) * n_items;
 
+  if G_UNLIKELY (dfi->profile_offsets)
+    dfi_index_profile_offset (dfi, pointer);
+
   return dfi_pointer_dereference (dfi, pointer, need_size);
 }
 
 const gchar *
 dfi_text_index_get_string (const struct dfi_index      *dfi,
                            const struct dfi_text_index *text_index,
-                           dfi_id                       id)
+                           guint                        id)
 {
-  guint i = dfi_id_get (id);
+  const struct dfi_text_index *base;
+  guint n_items;
 
   if G_UNLIKELY (text_index == NULL)
     return "";
 
-  if (i < dfi_uint32_get (text_index->n_items))
-    return dfi_string_get (dfi, text_index->items[i].key);
+  n_items = dfi_text_index_get_n_items (text_index);
+
+  if (id < n_items)
+    return dfi_string_get (dfi, text_index->items[id].key);
+  else if ((base = dfi_text_index_get_base (dfi, text_index)))
+    return dfi_text_index_get_string (dfi, base, id - n_items);
   else
     return "";
 }
 
-const struct dfi_text_index_item *
-dfi_text_index_binary_search (const struct dfi_index      *dfi,
-                              const struct dfi_text_index *text_index,
-                              const gchar                 *string)
+const gchar *
+dfi_text_index_get_string_with_length (const struct dfi_index      *dfi,
+                                       const struct dfi_text_index *text_index,
+                                       guint                        id,
+                                       gsize                       *length)
 {
-  guint l, r;
+  const struct dfi_text_index *base;
+  guint n_items;
+
+  *length = 0;
 
   if G_UNLIKELY (text_index == NULL)
-    return NULL;
+    return "";
+
+  n_items = dfi_text_index_get_n_items (text_index);
+
+  if (id < n_items)
+    return dfi_string_get_with_length (dfi, text_index->items[id].key, length);
+  else if ((base = dfi_text_index_get_base (dfi, text_index)))
+    return dfi_text_index_get_string_with_length (dfi, base, id - n_items, length);
+  else
+    return "";
+}
+
+static gint
+dfi_text_index_bisect (const struct dfi_index      *dfi,
+                       const struct dfi_text_index *text_index,
+                       const gchar                 *string)
+{
+  gsize length;
+  guint l, r;
+
+  length = strlen (string);
 
   l = 0;
-  r = dfi_uint32_get (text_index->n_items);
+  r = dfi_text_index_get_n_items (text_index);
 
   while (l < r)
     {
@@ -361,16 +997,58 @@ dfi_text_index_binary_search (const struct dfi_index      *dfi,
 
       m = l + (r - l) / 2;
 
-      x = strcmp (string, dfi_string_get (dfi, text_index->items[m].key));
+      x = dfi_string_compare (dfi, string, length, text_index->items[m].key);
 
       if (x > 0)
         l = m + 1;
       else if (x < 0)
         r = m;
       else
-        return text_index->items + m;
+        return m;
     }
 
+  return -1;
+}
+
+/* Gives the item for an item id, see dfi_text_index_get_base() */
+static const struct dfi_text_index_item *
+dfi_text_index_get_item (const struct dfi_index      *dfi,
+                         const struct dfi_text_index *text_index,
+                         guint                        id)
+{
+  const struct dfi_text_index *base;
+  guint n_items;
+
+  n_items = dfi_text_index_get_n_items (text_index);
+
+  if (id < n_items)
+    return text_index->items + id;
+  else if ((base = dfi_text_index_get_base (dfi, text_index)))
+    return dfi_text_index_get_item (dfi, base, id - n_items);
+  else
+    return NULL;
+}
+
+const struct dfi_text_index_item *
+dfi_text_index_binary_search (const struct dfi_index      *dfi,
+                              const struct dfi_text_index *text_index,
+                              const gchar                 *string)
+{
+  const struct dfi_text_index *base;
+  gint id;
+
+  if G_UNLIKELY (text_index == NULL)
+    return NULL;
+
+  id = dfi_text_index_bisect (dfi, text_index, string);
+  if (id >= 0)
+    return text_index->items + id;
+
+  /* Overlays only have the tokens that differ from their base */
+  base = dfi_text_index_get_base (dfi, text_index);
+  if (base)
+    return dfi_text_index_binary_search (dfi, base, string);
+
   return NULL;
 }
 
@@ -380,16 +1058,20 @@ dfi_text_index_item_get_ids (const struct dfi_index           *dfi,
                              gint                             *n_results)
 {
   if (item == NULL)
-    return NULL;
+    {
+      *n_results = 0;
+      return NULL;
+    }
 
   if (dfi_string_is_flagged (item->key))
     {
-      if (!dfi_id_valid (item->value.pair[0]))
+      /* Only the compact format has room for inline ids */
+      if (dfi->wide_ids || dfi_id_get (item->value.pair[0]) == G_MAXUINT)
         {
           *n_results = 0;
           return NULL;
         }
-      else if (!dfi_id_valid (item->value.pair[1]))
+      else if (dfi_id_get (item->value.pair[1]) == G_MAXUINT)
         {
           *n_results = 1;
           return item->value.pair;
@@ -401,7 +1083,7 @@ dfi_text_index_item_get_ids (const struct dfi_index           *dfi,
         }
     }
   else
-    return dfi_id_list_get_ids (dfi_id_list_from_pointer (dfi, item->value.pointer), n_results);
+    return dfi_id_list_get_ids (dfi_id_list_from_pointer (dfi, item->value.pointer), dfi, n_results);
 }
 
 const dfi_id *
@@ -417,243 +1099,2283 @@ dfi_text_index_get_ids_for_exact_match (const struct dfi_index      *dfi,
   return dfi_text_index_item_get_ids (dfi, item, n_results);
 }
 
-/* dfi_keyfile, dfi_keyfile_group, dfi_keyfile_item {{{1 */
-const struct dfi_keyfile *
-dfi_keyfile_from_pointer (const struct dfi_index *dfi,
-                          dfi_pointer             pointer)
+static const struct dfi_text_index_item *
+dfi_text_index_get_item_for_folded (const struct dfi_index      *dfi,
+                                    const struct dfi_text_index *index,
+                                    const gchar                 *folded)
 {
-  const struct dfi_keyfile *file;
-  guint need_size;
-
-  need_size = sizeof (struct dfi_keyfile);
+  const struct dfi_text_index_item *item;
+  gchar *unaccented;
 
-  file = dfi_pointer_dereference (dfi, pointer, need_size);
+  unaccented = dfi_tokenizer_unaccent (folded);
+  if (unaccented == NULL)
+    return dfi_text_index_binary_search (dfi, index, folded);
 
-  if (!file)
-    return NULL;
+  item = dfi_text_index_binary_search (dfi, index, unaccented);
+  g_free (unaccented);
 
-  /* All sizes 16bit ints, so no overflow danger */
-  need_size += sizeof (struct dfi_keyfile_group) * dfi_uint16_get (file->n_groups);
-  need_size += sizeof (struct dfi_keyfile_item) * dfi_uint16_get (file->n_items);
+  /* Indexes from before unaccented tokens existed only have the folded form */
+  if (item == NULL)
+    item = dfi_text_index_binary_search (dfi, index, folded);
 
-  return dfi_pointer_dereference (dfi, pointer, need_size);
+  return item;
 }
 
-const struct dfi_keyfile_group *
-dfi_keyfile_get_groups (const struct dfi_keyfile *file,
-                        const struct dfi_index   *dfi,
-                        gint                     *n_groups)
+static const dfi_id *
+dfi_text_index_get_ids_for_folded (const struct dfi_index      *dfi,
+                                   const struct dfi_text_index *index,
+                                   const gchar                 *folded,
+                                   gint                        *n_results)
 {
-  *n_groups = dfi_uint16_get (file->n_groups);
+  const struct dfi_text_index_item *item;
+
+  item = dfi_text_index_get_item_for_folded (dfi, index, folded);
 
-  return G_STRUCT_MEMBER_P (file, sizeof (struct dfi_keyfile));
+  return dfi_text_index_item_get_ids (dfi, item, n_results);
 }
 
-const gchar *
-dfi_keyfile_group_get_name (const struct dfi_keyfile_group *group,
-                            const struct dfi_index         *dfi)
+/* Like dfi_text_index_get_ids_for_exact_match(), but folds the word in
+ * the same way as the tokens in the index were folded (see
+ * dfi-tokenizer.c) first.  The word should be a single token, as
+ * returned by dfi_tokenizer_split().
+ *
+ * Accents are ignored: "systeme" and "système" both find "Système".
+ */
+const dfi_id *
+dfi_text_index_get_ids_for_word (const struct dfi_index      *dfi,
+                                 const struct dfi_text_index *index,
+                                 const gchar                 *word,
+                                 gint                        *n_results)
 {
-  return dfi_string_list_get_string (dfi->group_names, dfi, group->name_id);
+  gchar buffer[DFI_TOKENIZER_MAX_SHORT_TOKEN + 1];
+  const dfi_id *ids;
+  gchar *folded;
+  gsize length;
+
+  length = strlen (word);
+
+  if (length <= DFI_TOKENIZER_MAX_SHORT_TOKEN && dfi_tokenizer_fold_ascii (word, length, buffer))
+    return dfi_text_index_get_ids_for_exact_match (dfi, index, buffer, n_results);
+
+  folded = dfi_tokenizer_fold (word, length);
+  ids = dfi_text_index_get_ids_for_folded (dfi, index, folded, n_results);
+  g_free (folded);
+
+  return ids;
 }
 
-const struct dfi_keyfile_item *
-dfi_keyfile_group_get_items (const struct dfi_keyfile_group *group,
-                             const struct dfi_index         *dfi,
-                             const struct dfi_keyfile       *file,
-                             gint                           *n_items)
+/* Fuzzy matching walks a trie of the tokens, keeping one row of the
+ * Levenshtein table per character of the current prefix and giving up
+ * on a prefix once every entry of its row is over the limit.
+ *
+ * The tokens themselves are scattered over the string table (in suffix
+ * order, thanks to tail merging), so the trie is built from them the
+ * first time that a text index is fuzzy matched and kept with the
+ * dfi_index.  The children of a node are next to each other, in order,
+ * and a subtree with only one token in it is left as a single node,
+ * the rest of which is read from the token itself.
+ *
+ * A built trie never changes, so only finding or building one takes
+ * the lock.  A thread that wants a trie that another thread is still
+ * building waits for it instead of building its own.
+ */
+struct dfi_fuzzy_trie
 {
-  guint start, end;
-  guint n_groups;
-
-  start = dfi_uint16_get (group->items_index);
+  guint     n_nodes;
+  gunichar *labels;     /* the character that leads to each node */
+  guint32  *children;   /* n_nodes + 1 of them: node n's children are children[n] to children[n + 1] */
+  guint32  *items;      /* the token that ends at (or, without children, under) each node, or G_MAXUINT32 */
+};
 
-  G_STATIC_ASSERT (sizeof (struct dfi_keyfile_group) == sizeof (struct dfi_keyfile));
-  n_groups = dfi_uint16_get (file->n_groups);
-  if ((gpointer) (file + n_groups) == (gpointer) group)
-    end = dfi_uint16_get (file->n_items);
-  else
-    end = dfi_uint16_get (group[1].items_index);
+struct dfi_fuzzy_walk
+{
+  const struct dfi_index      *dfi;
+  const struct dfi_text_index *index;
+  const struct dfi_fuzzy_trie *trie;
+  gunichar                    *query;
+  guint                        width;
+  guint                        max_distance;
+  guint                        max_depth;
+  guint                       *rows;
+  GArray                      *items;
+};
 
-  if (start <= end && end <= dfi_uint16_get (file->n_items))
+static gsize
+dfi_text_index_fuzzy_get_char (const gchar *str,
+                               gunichar    *c)
+{
+  if G_LIKELY ((guchar) *str < 0x80)
     {
-      *n_items = end - start;
-      return G_STRUCT_MEMBER_P (file, sizeof (struct dfi_keyfile) +
-                                      sizeof (struct dfi_keyfile_group) * dfi_uint16_get (file->n_groups) +
-                                      sizeof (struct dfi_keyfile_item) * start);
+      *c = *str;
+      return 1;
     }
-  else
+
+  *c = g_utf8_get_char_validated (str, -1);
+
+  /* Count invalid bytes as characters of their own */
+  if (*c & 0x80000000)
     {
-      *n_items = 0;
-      return NULL;
+      *c = (guchar) *str;
+      return 1;
     }
+
+  return g_utf8_next_char (str) - str;
 }
 
-const gchar *
-dfi_keyfile_item_get_key (const struct dfi_keyfile_item *item,
-                          const struct dfi_index        *dfi)
+static void
+dfi_fuzzy_trie_free (gpointer data)
 {
-  return dfi_string_list_get_string (dfi->key_names, dfi, item->key_id);
+  struct dfi_fuzzy_trie *trie = data;
+
+  g_free (trie->labels);
+  g_free (trie->children);
+  g_free (trie->items);
+  g_free (trie);
 }
 
-const gchar *
-dfi_keyfile_item_get_locale (const struct dfi_keyfile_item *item,
-                             const struct dfi_index        *dfi)
+/* While building the trie, each node has the range of tokens under it,
+ * all of which have the same first offset bytes.
+ */
+struct dfi_fuzzy_trie_node
 {
-  return dfi_string_list_get_string (dfi->locale_names, dfi, item->locale_id);
-}
+  gunichar label;
+  guint32  first;
+  guint32  last;
+  guint32  offset;
+  guint32  children;
+  guint32  item;
+};
 
-const gchar *
-dfi_keyfile_item_get_value (const struct dfi_keyfile_item *item,
-                            const struct dfi_index        *dfi)
+static struct dfi_fuzzy_trie *
+dfi_fuzzy_trie_new (const struct dfi_index      *dfi,
+                    const struct dfi_text_index *index)
 {
-  return dfi_string_get (dfi, item->value);
-}
+  struct dfi_fuzzy_trie_node *nodes;
+  struct dfi_fuzzy_trie *trie;
+  guint n_nodes, n_allocated;
+  const gchar **strings;
+  guint n, i;
+
+  n = dfi_text_index_get_n_items (index);
+  strings = g_new (const gchar *, n);
+  for (i = 0; i < n; i++)
+    strings[i] = dfi_text_index_get_string (dfi, index, i);
+
+  n_allocated = n + 1;
+  nodes = g_new (struct dfi_fuzzy_trie_node, n_allocated);
+  nodes[0].label = 0;
+  nodes[0].first = 0;
+  nodes[0].last = n;
+  nodes[0].offset = 0;
+  n_nodes = 1;
+
+  /* The nodes are numbered breadth first, so that each node's children
+   * can be added as soon as it comes up.
+   */
+  for (i = 0; i < n_nodes; i++)
+    {
+      guint first = nodes[i].first;
+      guint last = nodes[i].last;
+      guint offset = nodes[i].offset;
 
-/* dfi_header {{{1 */
+      nodes[i].children = n_nodes;
+      nodes[i].item = G_MAXUINT32;
 
-const struct dfi_header *
-dfi_header_get (const struct dfi_index *dfi)
-{
-  dfi_pointer ptr = { };
+      if (i > 0 && last - first == 1)
+        {
+          nodes[i].item = first;
+          continue;
+        }
+
+      /* Only one token can end here, unless the index is broken */
+      while (first < last && strings[first][offset] == '\0')
+        {
+          nodes[i].item = MIN (nodes[i].item, first);
+          first++;
+        }
+
+      while (first < last)
+        {
+          struct dfi_fuzzy_trie_node *child;
+          gunichar c, d;
+          gsize length;
+
+          if (n_nodes == n_allocated)
+            {
+              n_allocated *= 2;
+              nodes = g_renew (struct dfi_fuzzy_trie_node, nodes, n_allocated);
+            }
+
+          length = dfi_text_index_fuzzy_get_char (strings[first] + offset, &c);
+
+          child = &nodes[n_nodes++];
+          child->label = c;
+          child->first = first;
+          while (++first < last && dfi_text_index_fuzzy_get_char (strings[first] + offset, &d) == length && d == c)
+            ;
+          child->last = first;
+          child->offset = offset + length;
+        }
+    }
+
+  trie = g_new (struct dfi_fuzzy_trie, 1);
+  trie->n_nodes = n_nodes;
+  trie->labels = g_new (gunichar, n_nodes);
+  trie->children = g_new (guint32, n_nodes + 1);
+  trie->items = g_new (guint32, n_nodes);
+
+  for (i = 0; i < n_nodes; i++)
+    {
+      trie->labels[i] = nodes[i].label;
+      trie->children[i] = nodes[i].children;
+      trie->items[i] = nodes[i].item;
+    }
+  trie->children[n_nodes] = n_nodes;
+
+  g_free (nodes);
+  g_free (strings);
 
-  return dfi_pointer_dereference (dfi, ptr, sizeof (struct dfi_header));
+  return trie;
 }
 
-/* struct dfi_index implementation {{{1 */
+static const struct dfi_fuzzy_trie *
+dfi_text_index_get_fuzzy_trie (const struct dfi_index      *dfi,
+                               const struct dfi_text_index *index)
+{
+  GMutex *lock = (GMutex *) &dfi->fuzzy_lock;
+  struct dfi_fuzzy_trie *trie;
 
-void
-dfi_index_free (struct dfi_index *dfi)
+  g_mutex_lock (lock);
+
+  trie = g_hash_table_lookup (dfi->fuzzy_tries, index);
+  if (trie == NULL)
+    {
+      trie = dfi_fuzzy_trie_new (dfi, index);
+      g_hash_table_insert (dfi->fuzzy_tries, (gpointer) index, trie);
+    }
+
+  g_mutex_unlock (lock);
+
+  return trie;
+}
+
+/* Works out the row for one more character c after the row at depth
+ * and returns its smallest entry.  Entries more than max_distance off
+ * the diagonal can't be under the limit, so only the band around it is
+ * filled in, and it's fenced in on either side.
+ */
+static guint
+dfi_fuzzy_walk_add_char (struct dfi_fuzzy_walk *walk,
+                         guint                  depth,
+                         gunichar               c)
 {
-  munmap (dfi->data, dfi->file_size);
-  free (dfi);
+  guint max_distance = walk->max_distance;
+  guint width = walk->width;
+  const guint *above = walk->rows + depth * width;
+  guint *row = walk->rows + (depth + 1) * width;
+  guint min, lo, hi, j;
+
+  lo = depth + 1 > max_distance ? depth + 1 - max_distance : 1;
+  hi = MIN (depth + 1 + max_distance, width - 1);
+  if (lo > 1)
+    row[lo - 1] = max_distance + 1;
+  if (hi + 1 < width)
+    row[hi + 1] = max_distance + 1;
+
+  row[0] = min = depth + 1;
+  for (j = lo; j <= hi; j++)
+    {
+      guint cost = above[j - 1] + (walk->query[j - 1] != c);
+
+      cost = MIN (cost, above[j] + 1);
+      cost = MIN (cost, row[j - 1] + 1);
+      row[j] = cost;
+      min = MIN (min, cost);
+    }
+
+  return min;
 }
 
-static gpointer
-dfi_index_map_file (const gchar *directory,
-                    guint32     *size)
+static void
+dfi_fuzzy_walk_add_item (struct dfi_fuzzy_walk *walk,
+                         guint                  depth,
+                         guint32                item)
 {
-  struct stat dir_buf, file_buf;
-  gpointer mapping = NULL;
-  gint file_fd = -1;
-  gint dir_fd = -1;
+  guint max_distance = walk->max_distance;
+  guint width = walk->width;
 
-  dir_fd = open (directory, O_DIRECTORY);
-  if (dir_fd < 0)
-    goto out;
+  if (depth + max_distance + 1 >= width && depth <= width - 1 + max_distance &&
+      walk->rows[depth * width + width - 1] <= max_distance)
+    g_array_append_val (walk->items, item);
+}
 
-  if (fstat (dir_fd, &dir_buf) < 0)
-    goto out;
+/* The rest of a token that has a subtree to itself */
+static void
+dfi_fuzzy_walk_tail (struct dfi_fuzzy_walk *walk,
+                     guint                  depth,
+                     guint32                item)
+{
+  const gchar *token;
+  guint i;
 
-  file_fd = openat (dir_fd, "index.cache", O_RDONLY);
+  token = dfi_text_index_get_string (walk->dfi, walk->index, item);
 
-  if (file_fd < 0)
-    goto out;
+  for (i = 0; i < depth && *token; i++)
+    {
+      gunichar c;
 
-  if (fstat (file_fd, &file_buf) < 0)
-    goto out;
+      token += dfi_text_index_fuzzy_get_char (token, &c);
+    }
 
-  if (file_buf.st_size > G_MAXUINT32)
-    goto out;
+  while (*token && depth < walk->max_depth)
+    {
+      gunichar c;
 
-  //if (file_buf.st_mtime < dir_buf.st_mtime)
-    //goto out;
+      token += dfi_text_index_fuzzy_get_char (token, &c);
 
-  //if (dir_buf.st_nlink != 2)
-    //goto out;
+      if (dfi_fuzzy_walk_add_char (walk, depth++, c) > walk->max_distance)
+        return;
+    }
 
-  mapping = mmap (NULL, file_buf.st_size, PROT_READ, MAP_SHARED, file_fd, 0);
+  dfi_fuzzy_walk_add_item (walk, depth, item);
+}
 
-  if (mapping == MAP_FAILED)
+/* The row at depth is node's, and min is its smallest entry */
+static void
+dfi_fuzzy_walk_node (struct dfi_fuzzy_walk *walk,
+                     guint                  node,
+                     guint                  depth,
+                     guint                  min)
+{
+  const struct dfi_fuzzy_trie *trie = walk->trie;
+  guint32 first = trie->children[node];
+  guint32 last = trie->children[node + 1];
+  guint32 mask[4];
+  guint32 child;
+
+  if (first == last)
     {
-      mapping = NULL;
-      goto out;
+      if (trie->items[node] != G_MAXUINT32)
+        dfi_fuzzy_walk_tail (walk, depth, trie->items[node]);
+
+      return;
     }
 
-  madvise (mapping, file_buf.st_size, MADV_RANDOM);
+  if (trie->items[node] != G_MAXUINT32)
+    dfi_fuzzy_walk_add_item (walk, depth, trie->items[node]);
 
-out:
-  if (file_fd != -1)
-    close (file_fd);
+  if (depth == walk->max_depth)
+    return;
 
-  if (dir_fd != -1)
-    close (dir_fd);
+  /* If nothing in the row is under the limit, only the characters that
+   * carry on a diagonal that is at the limit can follow it.  Check the
+   * (ASCII) labels against those before working out any rows.
+   */
+  if (min == walk->max_distance)
+    {
+      const guint *row = walk->rows + depth * walk->width;
+      guint lo, hi, j;
 
-  if (mapping)
-    *size = file_buf.st_size;
+      memset (mask, 0, sizeof mask);
 
-  return mapping;
+      lo = depth + 1 > walk->max_distance ? depth + 1 - walk->max_distance : 1;
+      hi = MIN (depth + 1 + walk->max_distance, walk->width - 1);
+      for (j = lo; j <= hi; j++)
+        if (row[j - 1] <= walk->max_distance && walk->query[j - 1] < 0x80)
+          mask[walk->query[j - 1] / 32] |= 1u << (walk->query[j - 1] % 32);
+    }
+  else
+    memset (mask, 0xff, sizeof mask);
+
+  for (child = first; child < last; child++)
+    {
+      gunichar c = trie->labels[child];
+      guint child_min;
+
+      if (c < 0x80 && !(mask[c / 32] & (1u << (c % 32))))
+        continue;
+
+      child_min = dfi_fuzzy_walk_add_char (walk, depth, c);
+      if (child_min <= walk->max_distance)
+        dfi_fuzzy_walk_node (walk, child, depth + 1, child_min);
+    }
 }
 
-struct dfi_index *
-dfi_index_new (const gchar *directory)
+static GArray *
+dfi_text_index_fuzzy_walk_items (const struct dfi_index      *dfi,
+                                 const struct dfi_text_index *index,
+                                 const gchar                 *folded,
+                                 guint                        max_distance)
 {
-  const struct dfi_header *header;
-  struct dfi_index *dfi;
-  gpointer data;
-  guint32 size;
+  struct dfi_fuzzy_walk walk;
+  glong width;
+  guint j;
 
-  data = dfi_index_map_file (directory, &size);
+  walk.items = g_array_new (FALSE, FALSE, sizeof (guint));
 
-  if (data == NULL)
-    return NULL;
+  if G_UNLIKELY (index == NULL)
+    return walk.items;
 
-  dfi = malloc (sizeof (struct dfi_index));
-  dfi->data = data;
-  dfi->file_size = size;
+  walk.dfi = dfi;
+  walk.index = index;
+  walk.trie = dfi_text_index_get_fuzzy_trie (dfi, index);
+  walk.query = g_utf8_to_ucs4_fast (folded, -1, &width);
+  walk.width = width + 1;
+  walk.max_distance = max_distance;
 
-  if (dfi->file_size > G_MAXINT)
-    goto err;
+  /* A row this deep can never come in under the limit */
+  walk.max_depth = walk.width + max_distance;
+  walk.rows = g_new (guint, walk.width * (walk.max_depth + 1));
 
-  header = dfi_header_get (dfi);
-  if (!header)
-    goto err;
+  for (j = 0; j < walk.width; j++)
+    walk.rows[j] = j;
 
-  dfi->app_names = dfi_string_list_from_pointer (dfi, header->app_names);
-  dfi->key_names = dfi_string_list_from_pointer (dfi, header->key_names);
-  dfi->locale_names = dfi_string_list_from_pointer (dfi, header->locale_names);
-  dfi->group_names = dfi_string_list_from_pointer (dfi, header->group_names);
+  /* Tokens come out in order, because the children of each node are
+   * in order and a token comes before the ones that it is a prefix of.
+   */
+  dfi_fuzzy_walk_node (&walk, 0, 0, 0);
 
-  if (!dfi->app_names || !dfi->key_names || !dfi->locale_names || !dfi->group_names)
-   goto err;
+  g_free (walk.rows);
+  g_free (walk.query);
 
-  dfi->implementors = dfi_pointer_array_from_pointer (dfi, header->implementors);
-  dfi->text_indexes = dfi_pointer_array_from_pointer (dfi, header->text_indexes);
-  dfi->desktop_files = dfi_pointer_array_from_pointer (dfi, header->desktop_files);
-  dfi->mime_types = dfi_text_index_from_pointer (dfi, header->mime_types);
+  return walk.items;
+}
 
- // if (!dfi->mime_types || !dfi->implementors || !dfi->text_indexes || !dfi->desktop_files)
-   // goto err;
+static GArray *
+dfi_text_index_fuzzy_walk (const struct dfi_index      *dfi,
+                           const struct dfi_text_index *index,
+                           const gchar                 *folded,
+                           guint                        max_distance)
+{
+  const struct dfi_text_index *base;
+  GArray *items;
 
-  return dfi;
+  items = dfi_text_index_fuzzy_walk_items (dfi, index, folded, max_distance);
 
-err:
-  dfi_index_free (dfi);
+  /* Take the base's matches too, except for the tokens that the overlay
+   * has its own version of.
+   */
+  base = index ? dfi_text_index_get_base (dfi, index) : NULL;
+  if (base)
+    {
+      GArray *base_items;
+      guint n_items;
+      guint i;
 
-  return NULL;
+      base_items = dfi_text_index_fuzzy_walk_items (dfi, base, folded, max_distance);
+      n_items = dfi_text_index_get_n_items (index);
+
+      for (i = 0; i < base_items->len; i++)
+        {
+          guint id = g_array_index (base_items, guint, i);
+
+          if (dfi_text_index_bisect (dfi, index, dfi_text_index_get_string (dfi, base, id)) < 0)
+            {
+              id += n_items;
+              g_array_append_val (items, id);
+            }
+        }
+
+      g_array_free (base_items, TRUE);
+    }
+
+  return items;
 }
 
-const struct dfi_pointer_array *
-dfi_index_get_desktop_files (const struct dfi_index *dfi)
+/* Finds the text index items whose token is within max_distance edits
+ * of word (after folding).  Returns a sorted array of n_items item ids,
+ * for use with dfi_text_index_get_string() and friends (the ids of an
+ * overlay carry on into its base), to be freed with g_free(), or NULL
+ * if there are none.
+ *
+ * The first call for a text index builds a trie of its tokens, which
+ * is kept until dfi_index_free().  That takes a few milliseconds for
+ * 100000 tokens, several times as long as a match with the trie does.
+ * Use dfi_text_index_prepare_fuzzy_match() to build it ahead of time.
+ */
+guint *
+dfi_text_index_fuzzy_match (const struct dfi_index      *dfi,
+                            const struct dfi_text_index *index,
+                            const gchar                 *word,
+                            guint                        max_distance,
+                            gint                        *n_items)
 {
-  return dfi->desktop_files;
+  GArray *items;
+  gchar *folded;
+
+  folded = dfi_tokenizer_fold (word, -1);
+  items = dfi_text_index_fuzzy_walk (dfi, index, folded, max_distance);
+  g_free (folded);
+
+  *n_items = items->len;
+
+  return (guint *) g_array_free (items, items->len == 0);
 }
 
-const struct dfi_string_list *
-dfi_index_get_app_names (const struct dfi_index *dfi)
+/* Builds what dfi_text_index_fuzzy_match() and
+ * dfi_text_index_fuzzy_search() need for index, if it isn't built yet,
+ * so that the first search doesn't wait for it.  This can be called
+ * from another thread while searches go on.
+ */
+void
+dfi_text_index_prepare_fuzzy_match (const struct dfi_index      *dfi,
+                                    const struct dfi_text_index *index)
 {
-  return dfi->app_names;
+  const struct dfi_text_index *base;
+
+  if G_UNLIKELY (index == NULL)
+    return;
+
+  dfi_text_index_get_fuzzy_trie (dfi, index);
+
+  base = dfi_text_index_get_base (dfi, index);
+  if (base)
+    dfi_text_index_get_fuzzy_trie (dfi, base);
 }
 
-const struct dfi_string_list *
-dfi_index_get_key_names (const struct dfi_index *dfi)
+struct dfi_text_index_search
 {
-  return dfi->key_names;
-}
+  const struct dfi_index            *dfi;
+  const struct dfi_text_index       *index;
+  const struct dfi_token_dictionary *dictionary;     /* instead of index, for front-coded files */
+  guint                              max_distance;   /* for fuzzy searches */
+  GArray                            *results;        /* sorted (app, group, key) triples */
+};
 
-const struct dfi_string_list *
-dfi_index_get_locale_names (const struct dfi_index *dfi)
+static gint
+dfi_text_index_search_compare (gconstpointer a,
+                               gconstpointer b)
 {
-  return dfi->locale_names;
+  const guint *triple_a = a;
+  const guint *triple_b = b;
+  gint i;
+
+  for (i = 0; i < 3; i++)
+    if (triple_a[i] != triple_b[i])
+      return triple_a[i] < triple_b[i] ? -1 : 1;
+
+  return 0;
+}
+
+static void
+dfi_text_index_search_append_ids (GArray                 *array,
+                                  const struct dfi_index *dfi,
+                                  const dfi_id           *ids,
+                                  gint                    n_ids)
+{
+  gint i;
+
+  for (i = 0; i < n_ids - n_ids % 3; i++)
+    {
+      guint id = dfi_id_array_get (ids, dfi, i);
+
+      g_array_append_val (array, id);
+    }
+}
+
+static const dfi_id *
+dfi_text_index_search_get_ids (struct dfi_text_index_search *search,
+                               const gchar                  *folded,
+                               gint                         *n_ids)
+{
+  const dfi_id *ids;
+  gchar *unaccented;
+
+  if (search->dictionary == NULL)
+    return dfi_text_index_get_ids_for_folded (search->dfi, search->index, folded, n_ids);
+
+  /* As for dfi_text_index_get_item_for_folded() */
+  unaccented = dfi_tokenizer_unaccent (folded);
+  if (unaccented == NULL)
+    return dfi_token_dictionary_get_ids_for_exact_match (search->dfi, search->dictionary, folded, n_ids);
+
+  ids = dfi_token_dictionary_get_ids_for_exact_match (search->dfi, search->dictionary, unaccented, n_ids);
+  g_free (unaccented);
+
+  if (ids == NULL)
+    ids = dfi_token_dictionary_get_ids_for_exact_match (search->dfi, search->dictionary, folded, n_ids);
+
+  return ids;
+}
+
+static void
+dfi_text_index_search_token (const gchar *token,
+                             gsize        length,
+                             guint        position,
+                             gpointer     user_data)
+{
+  struct dfi_text_index_search *search = user_data;
+  GArray *ids_array;
+  const dfi_id *ids;
+  guint *triples;
+  gint n_ids;
+  guint i, n;
+
+  /* Nothing can match any more */
+  if (search->results && search->results->len == 0)
+    return;
+
+  ids_array = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  if (search->max_distance == 0)
+    {
+      ids = dfi_text_index_search_get_ids (search, token, &n_ids);
+      dfi_text_index_search_append_ids (ids_array, search->dfi, ids, n_ids);
+    }
+  else
+    {
+      GArray *items;
+
+      /* A token matches through any of the tokens close enough to it */
+      items = dfi_text_index_fuzzy_walk (search->dfi, search->index, token, search->max_distance);
+
+      for (i = 0; i < items->len; i++)
+        {
+          const struct dfi_text_index_item *item;
+
+          item = dfi_text_index_get_item (search->dfi, search->index, g_array_index (items, guint, i));
+          ids = dfi_text_index_item_get_ids (search->dfi, item, &n_ids);
+          dfi_text_index_search_append_ids (ids_array, search->dfi, ids, n_ids);
+        }
+
+      g_array_free (items, TRUE);
+    }
+
+  n = ids_array->len / 3;
+  triples = (guint *) g_array_free (ids_array, FALSE);
+
+  if (n > 1)
+    qsort (triples, n, 3 * sizeof (guint), dfi_text_index_search_compare);
+
+  if (search->results == NULL)
+    {
+      search->results = g_array_sized_new (FALSE, FALSE, 3 * sizeof (guint), n);
+
+      /* The same key can turn up through more than one fuzzy match */
+      for (i = 0; i < n; i++)
+        if (i == 0 || dfi_text_index_search_compare (&triples[3 * (i - 1)], &triples[3 * i]) != 0)
+          g_array_append_vals (search->results, &triples[3 * i], 1);
+    }
+  else
+    {
+      guint j = 0;
+
+      for (i = 0; i < search->results->len; i++)
+        {
+          guint *triple = &g_array_index (search->results, guint, 3 * i);
+
+          if (bsearch (triple, triples, n, 3 * sizeof (guint), dfi_text_index_search_compare))
+            memmove (&g_array_index (search->results, guint, 3 * j++), triple, 3 * sizeof (guint));
+        }
+
+      g_array_set_size (search->results, j);
+    }
+
+  g_free (triples);
+}
+
+static guint *
+dfi_text_index_search_internal (const struct dfi_index            *dfi,
+                                const struct dfi_text_index       *index,
+                                const struct dfi_token_dictionary *dictionary,
+                                const gchar                       *query,
+                                guint                              max_distance,
+                                gint                              *n_results)
+{
+  struct dfi_text_index_search search = { dfi, index, dictionary, max_distance, NULL };
+
+  dfi_tokenizer_split (NULL, query, dfi_text_index_search_token, &search);
+
+  if (search.results == NULL || search.results->len == 0)
+    {
+      if (search.results)
+        g_array_free (search.results, TRUE);
+
+      *n_results = 0;
+      return NULL;
+    }
+
+  *n_results = 3 * search.results->len;
+
+  return (guint *) g_array_free (search.results, FALSE);
+}
+
+/* Finds the (app, group, key) triples that contain all of the tokens
+ * of query (so CJK text matches when all of its bigrams do).  Returns a
+ * sorted array of n_results ids (three per match), to be freed with
+ * g_free(), or NULL if there are none.
+ */
+guint *
+dfi_text_index_search (const struct dfi_index      *dfi,
+                       const struct dfi_text_index *index,
+                       const gchar                 *query,
+                       gint                        *n_results)
+{
+  return dfi_text_index_search_internal (dfi, index, NULL, query, 0, n_results);
+}
+
+/* Like dfi_text_index_search(), but each token of query also matches
+ * any token within max_distance edits of it, so "firfox" finds
+ * "Firefox".  A max_distance of 1 or 2 is sensible.  The first call
+ * builds a trie, as for dfi_text_index_fuzzy_match().
+ */
+guint *
+dfi_text_index_fuzzy_search (const struct dfi_index      *dfi,
+                             const struct dfi_text_index *index,
+                             const gchar                 *query,
+                             guint                        max_distance,
+                             gint                        *n_results)
+{
+  return dfi_text_index_search_internal (dfi, index, NULL, query, max_distance, n_results);
+}
+
+/* dfi_suffix_array {{{1 */
+
+const struct dfi_suffix_array *
+dfi_suffix_array_from_pointer (const struct dfi_index *dfi,
+                               dfi_pointer             pointer)
+{
+  const struct dfi_suffix_array *suffix_array;
+  guint need_size;
+  guint n_suffixes;
+
+  need_size = G_STRUCT_OFFSET (struct dfi_suffix_array, suffixes);
+
+  suffix_array = dfi_pointer_dereference (dfi, pointer, need_size);
+
+  if (!suffix_array)
+    return NULL;
+
+  /* It's 32 bit, so make sure this won't overflow when we multiply */
+  n_suffixes = dfi_uint32_get (suffix_array->n_suffixes);
+  if (n_suffixes > (1u << 28))
+    return NULL;
+
+  need_size += sizeof (dfi_uint32) * n_suffixes;
+
+  return dfi_pointer_dereference (dfi, pointer, need_size);
+}
+
+const struct dfi_text_index *
+dfi_suffix_array_get_text_index (const struct dfi_index         *dfi,
+                                 const struct dfi_suffix_array  *suffix_array)
+{
+  if G_UNLIKELY (suffix_array == NULL)
+    return NULL;
+
+  return dfi_text_index_from_pointer (dfi, suffix_array->text_index);
+}
+
+static const gchar *
+dfi_suffix_array_get_suffix (const struct dfi_index         *dfi,
+                             const struct dfi_suffix_array  *suffix_array,
+                             const struct dfi_text_index    *text_index,
+                             guint                           i)
+{
+  const gchar *token;
+  guint suffix;
+  guint offset;
+
+  suffix = dfi_uint32_get (suffix_array->suffixes[i]);
+  offset = suffix & DFI_SUFFIX_ARRAY_MAX_OFFSET;
+
+  token = dfi_text_index_get_string (dfi, text_index, suffix >> 8);
+
+  /* Don't run off the end of the token */
+  if (memchr (token, '\0', offset))
+    return "";
+
+  return token + offset;
+}
+
+static gint
+dfi_suffix_array_compare_items (gconstpointer a,
+                                gconstpointer b)
+{
+  guint item_a = *(const guint *) a;
+  guint item_b = *(const guint *) b;
+
+  return (item_a > item_b) - (item_a < item_b);
+}
+
+/* Finds the text index items whose token contains substring (folded in
+ * the same way as the tokens).  Returns a sorted array of n_items item
+ * ids, for use with dfi_text_index_get_string() and friends, to be
+ * freed with g_free(), or NULL if there are none.
+ */
+guint *
+dfi_suffix_array_search (const struct dfi_index         *dfi,
+                         const struct dfi_suffix_array  *suffix_array,
+                         const gchar                    *substring,
+                         gint                           *n_items)
+{
+  gchar buffer[DFI_TOKENIZER_MAX_SHORT_TOKEN + 1];
+  const struct dfi_text_index *text_index;
+  gchar *folded = NULL;
+  const gchar *query;
+  guint *items;
+  gsize length;
+  guint start, end;
+  guint l, r;
+  guint i, j;
+
+  *n_items = 0;
+
+  text_index = dfi_suffix_array_get_text_index (dfi, suffix_array);
+  if (text_index == NULL)
+    return NULL;
+
+  length = strlen (substring);
+
+  if (length <= DFI_TOKENIZER_MAX_SHORT_TOKEN && dfi_tokenizer_fold_ascii (substring, length, buffer))
+    query = buffer;
+  else
+    query = folded = dfi_tokenizer_fold (substring, length);
+
+  length = strlen (query);
+
+  /* Find the first suffix that starts with the query... */
+  l = 0;
+  r = dfi_uint32_get (suffix_array->n_suffixes);
+  while (l < r)
+    {
+      guint m = l + (r - l) / 2;
+
+      if (strncmp (dfi_suffix_array_get_suffix (dfi, suffix_array, text_index, m), query, length) < 0)
+        l = m + 1;
+      else
+        r = m;
+    }
+  start = l;
+
+  /* ...and the first one after that doesn't */
+  r = dfi_uint32_get (suffix_array->n_suffixes);
+  while (l < r)
+    {
+      guint m = l + (r - l) / 2;
+
+      if (strncmp (dfi_suffix_array_get_suffix (dfi, suffix_array, text_index, m), query, length) <= 0)
+        l = m + 1;
+      else
+        r = m;
+    }
+  end = l;
+
+  g_free (folded);
+
+  if (start == end)
+    return NULL;
+
+  /* A token can contain the query more than once */
+  items = g_new (guint, end - start);
+  for (i = start; i < end; i++)
+    items[i - start] = dfi_uint32_get (suffix_array->suffixes[i]) >> 8;
+
+  qsort (items, end - start, sizeof (guint), dfi_suffix_array_compare_items);
+
+  for (i = j = 0; i < end - start; i++)
+    if (j == 0 || items[j - 1] != items[i])
+      items[j++] = items[i];
+
+  *n_items = j;
+
+  return items;
+}
+
+/* dfi_position_table {{{1 */
+
+const struct dfi_position_table *
+dfi_position_table_from_pointer (const struct dfi_index *dfi,
+                                 dfi_pointer             pointer)
+{
+  const struct dfi_position_table *table;
+  guint need_size;
+  guint n_items;
+
+  need_size = G_STRUCT_OFFSET (struct dfi_position_table, lists);
+
+  table = dfi_pointer_dereference (dfi, pointer, need_size);
+
+  if (!table)
+    return NULL;
+
+  /* It's 32 bit, so make sure this won't overflow when we multiply */
+  n_items = dfi_uint32_get (table->n_items);
+  if (n_items > (1u << 24))
+    return NULL;
+
+  need_size += sizeof (dfi_pointer) * n_items;
+
+  return dfi_pointer_dereference (dfi, pointer, need_size);
+}
+
+const struct dfi_text_index *
+dfi_position_table_get_text_index (const struct dfi_index          *dfi,
+                                   const struct dfi_position_table *table)
+{
+  if G_UNLIKELY (table == NULL)
+    return NULL;
+
+  return dfi_text_index_from_pointer (dfi, table->text_index);
+}
+
+/* Gives the positions of the token of text index item id within the
+ * string of the entry'th (app, group, key) triple of its id list, in
+ * order.  Returns how many there are, of which at most max_positions
+ * are stored in positions.
+ */
+gint
+dfi_position_table_get_positions (const struct dfi_index          *dfi,
+                                  const struct dfi_position_table *table,
+                                  guint                            id,
+                                  guint                            entry,
+                                  guint                           *positions,
+                                  gint                             max_positions)
+{
+  const struct dfi_position_list *list;
+  guint need_size;
+  guint n_extra;
+  guint l, r;
+  gint n;
+
+  if G_UNLIKELY (table == NULL || id >= dfi_uint32_get (table->n_items) || max_positions < 1)
+    return 0;
+
+  list = dfi_pointer_dereference (dfi, table->lists[id], sizeof (dfi_uint16));
+  if (list == NULL)
+    return 0;
+
+  /* Make sure this won't overflow when we multiply */
+  if (entry > (1u << 24))
+    return 0;
+
+  n_extra = dfi_uint16_get (list->n_extra);
+  need_size = sizeof (dfi_uint16) * (1 + 2 * n_extra + entry + 1);
+
+  list = dfi_pointer_dereference (dfi, table->lists[id], need_size);
+  if (list == NULL)
+    return 0;
+
+  positions[0] = dfi_uint16_get (list->positions[2 * n_extra + entry]);
+  n = 1;
+
+  /* Find the first extra for the entry */
+  l = 0;
+  r = n_extra;
+  while (l < r)
+    {
+      guint m = l + (r - l) / 2;
+
+      if (dfi_uint16_get (list->positions[2 * m]) < entry)
+        l = m + 1;
+      else
+        r = m;
+    }
+
+  for (; l < n_extra && dfi_uint16_get (list->positions[2 * l]) == entry; l++, n++)
+    if (n < max_positions)
+      positions[n] = dfi_uint16_get (list->positions[2 * l + 1]);
+
+  return n;
+}
+
+struct dfi_phrase_entry
+{
+  guint triple[3];
+  guint entry;
+};
+
+struct dfi_phrase_token
+{
+  guint                             position;   /* within the query */
+  const struct dfi_text_index_item *item;
+  struct dfi_phrase_entry          *entries;    /* sorted by triple */
+  guint                             n_entries;
+  guint                             positions[16]; /* for the current candidate */
+  gint                              n_positions;
+  gint                              i;
+};
+
+struct dfi_phrase_search
+{
+  const struct dfi_index      *dfi;
+  const struct dfi_text_index *index;
+  GArray                      *tokens;
+};
+
+static void
+dfi_phrase_search_token (const gchar *token,
+                         gsize        length,
+                         guint        position,
+                         gpointer     user_data)
+{
+  struct dfi_phrase_search *search = user_data;
+  struct dfi_phrase_token phrase_token = { position, };
+
+  phrase_token.item = dfi_text_index_get_item_for_folded (search->dfi, search->index, token);
+  g_array_append_val (search->tokens, phrase_token);
+}
+
+static gint
+dfi_phrase_search_compare_results (gconstpointer a,
+                                   gconstpointer b)
+{
+  const guint *result_a = a;
+  const guint *result_b = b;
+
+  /* Best span first */
+  if (result_a[3] != result_b[3])
+    return result_a[3] < result_b[3] ? -1 : 1;
+
+  return dfi_text_index_search_compare (a, b);
+}
+
+/* The smallest span of a window that has one occurrence of each token,
+ * where each position counts relative to where its token is in the
+ * query.  That makes it 0 for an exact phrase.
+ */
+static guint
+dfi_phrase_search_get_span (struct dfi_phrase_token *tokens,
+                            guint                    n_tokens)
+{
+  guint best = G_MAXUINT;
+  guint t;
+
+  for (t = 0; t < n_tokens; t++)
+    tokens[t].i = 0;
+
+  while (best != 0)
+    {
+      gint min = G_MAXINT;
+      gint max = G_MININT;
+      guint min_t = 0;
+
+      for (t = 0; t < n_tokens; t++)
+        {
+          gint value = (gint) tokens[t].positions[tokens[t].i] - (gint) tokens[t].position;
+
+          if (value < min)
+            {
+              min = value;
+              min_t = t;
+            }
+
+          max = MAX (max, value);
+        }
+
+      best = MIN (best, (guint) (max - min));
+
+      if (++tokens[min_t].i == tokens[min_t].n_positions)
+        break;
+    }
+
+  return best;
+}
+
+/* Finds the (app, group, key) triples whose string has the words of
+ * phrase in the same order, with at most slop words out of place (0 for
+ * an exact phrase).  Returns an array of n_results ids, four per match:
+ * the triple and its span (the number of words out of place), best
+ * first.  It is to be freed with g_free().
+ */
+guint *
+dfi_position_table_phrase_search (const struct dfi_index          *dfi,
+                                  const struct dfi_position_table *table,
+                                  const gchar                     *phrase,
+                                  guint                            slop,
+                                  gint                            *n_results)
+{
+  struct dfi_phrase_search search;
+  struct dfi_phrase_token *tokens;
+  GArray *results;
+  guint n_tokens;
+  guint i, t;
+
+  *n_results = 0;
+
+  search.dfi = dfi;
+  search.index = dfi_position_table_get_text_index (dfi, table);
+  if (search.index == NULL)
+    return NULL;
+
+  search.tokens = g_array_new (FALSE, FALSE, sizeof (struct dfi_phrase_token));
+  dfi_tokenizer_split (NULL, phrase, dfi_phrase_search_token, &search);
+
+  n_tokens = search.tokens->len;
+  tokens = (struct dfi_phrase_token *) g_array_free (search.tokens, FALSE);
+
+  for (t = 0; t < n_tokens; t++)
+    {
+      const dfi_id *ids;
+      gint n_ids;
+
+      ids = dfi_text_index_item_get_ids (dfi, tokens[t].item, &n_ids);
+
+      tokens[t].n_entries = n_ids / 3;
+      tokens[t].entries = g_new (struct dfi_phrase_entry, tokens[t].n_entries);
+
+      for (i = 0; i < tokens[t].n_entries; i++)
+        {
+          tokens[t].entries[i].triple[0] = dfi_id_array_get (ids, dfi, 3 * i);
+          tokens[t].entries[i].triple[1] = dfi_id_array_get (ids, dfi, 3 * i + 1);
+          tokens[t].entries[i].triple[2] = dfi_id_array_get (ids, dfi, 3 * i + 2);
+          tokens[t].entries[i].entry = i;
+        }
+
+      if (tokens[t].n_entries > 1)
+        qsort (tokens[t].entries, tokens[t].n_entries, sizeof (struct dfi_phrase_entry), dfi_text_index_search_compare);
+    }
+
+  results = g_array_new (FALSE, FALSE, 4 * sizeof (guint));
+
+  for (i = 0; n_tokens && i < tokens[0].n_entries; i++)
+    {
+      const struct dfi_phrase_entry *candidate = &tokens[0].entries[i];
+      guint result[4];
+
+      for (t = 0; t < n_tokens; t++)
+        {
+          const struct dfi_phrase_entry *entry = candidate;
+
+          if (t > 0 && tokens[t].n_entries == 0)
+            entry = NULL;
+          else if (t > 0)
+            entry = bsearch (candidate, tokens[t].entries, tokens[t].n_entries,
+                             sizeof (struct dfi_phrase_entry), dfi_text_index_search_compare);
+
+          if (entry == NULL)
+            break;
+
+          tokens[t].n_positions = dfi_position_table_get_positions (dfi, table, tokens[t].item - search.index->items, entry->entry,
+                                                                    tokens[t].positions, G_N_ELEMENTS (tokens[t].positions));
+          if (tokens[t].n_positions == 0)
+            break;
+
+          tokens[t].n_positions = MIN (tokens[t].n_positions, G_N_ELEMENTS (tokens[t].positions));
+        }
+
+      if (t < n_tokens)
+        continue;
+
+      result[3] = dfi_phrase_search_get_span (tokens, n_tokens);
+
+      if (result[3] <= slop)
+        {
+          memcpy (result, candidate->triple, sizeof candidate->triple);
+          g_array_append_vals (results, result, 1);
+        }
+    }
+
+  for (t = 0; t < n_tokens; t++)
+    g_free (tokens[t].entries);
+  g_free (tokens);
+
+  if (results->len > 1)
+    qsort (results->data, results->len, 4 * sizeof (guint), dfi_phrase_search_compare_results);
+
+  *n_results = 4 * results->len;
+
+  return (guint *) g_array_free (results, results->len == 0);
+}
+
+/* dfi_token_dictionary {{{1 */
+
+/* See struct dfi_token_dictionary in common.h */
+struct dfi_token_dictionary_entry
+{
+  guint                     shared;
+  guint                     length;
+  const guchar             *suffix;
+  const struct dfi_id_list *id_list;
+};
+
+const struct dfi_token_dictionary *
+dfi_token_dictionary_from_pointer (const struct dfi_index *dfi,
+                                   dfi_pointer             pointer)
+{
+  const struct dfi_token_dictionary *dictionary;
+  guint need_size;
+  guint n_tokens;
+  guint n_bytes;
+
+  need_size = G_STRUCT_OFFSET (struct dfi_token_dictionary, blocks);
+
+  dictionary = dfi_pointer_dereference (dfi, pointer, need_size);
+
+  if (!dictionary)
+    return NULL;
+
+  /* It's 32 bit, so make sure this won't overflow when we multiply */
+  n_tokens = dfi_uint32_get (dictionary->n_tokens);
+  if (n_tokens > (1u << 24))
+    return NULL;
+
+  need_size += sizeof (dfi_uint32) * ((n_tokens + DFI_TOKEN_DICTIONARY_BLOCK_SIZE - 1) / DFI_TOKEN_DICTIONARY_BLOCK_SIZE);
+
+  n_bytes = dfi_uint32_get (dictionary->n_bytes);
+  if (n_bytes < need_size)
+    return NULL;
+
+  if G_UNLIKELY (dfi->profile_offsets)
+    dfi_index_profile_offset (dfi, pointer);
+
+  return dfi_pointer_dereference (dfi, pointer, n_bytes);
+}
+
+guint
+dfi_token_dictionary_get_length (const struct dfi_token_dictionary *dictionary,
+                                 const struct dfi_index            *dfi)
+{
+  if G_UNLIKELY (dictionary == NULL)
+    return 0;
+
+  return dfi_uint32_get (dictionary->n_tokens);
+}
+
+static guint
+dfi_token_dictionary_get_n_blocks (const struct dfi_token_dictionary *dictionary)
+{
+  return (dfi_uint32_get (dictionary->n_tokens) + DFI_TOKEN_DICTIONARY_BLOCK_SIZE - 1) / DFI_TOKEN_DICTIONARY_BLOCK_SIZE;
+}
+
+static const guchar *
+dfi_token_dictionary_get_block (const struct dfi_token_dictionary  *dictionary,
+                                guint                               block,
+                                const guchar                      **end)
+{
+  guint n_bytes = dfi_uint32_get (dictionary->n_bytes);
+  guint start, stop;
+
+  start = dfi_uint32_get (dictionary->blocks[block]);
+
+  if (block + 1 < dfi_token_dictionary_get_n_blocks (dictionary))
+    stop = dfi_uint32_get (dictionary->blocks[block + 1]);
+  else
+    stop = n_bytes;
+
+  if (start > stop || stop > n_bytes)
+    return NULL;
+
+  *end = (const guchar *) dictionary + stop;
+
+  return (const guchar *) dictionary + start;
+}
+
+static gboolean
+dfi_token_dictionary_read_varint (const guchar **data,
+                                  const guchar  *end,
+                                  guint         *value)
+{
+  guint shift;
+
+  *value = 0;
+
+  for (shift = 0; shift < 32; shift += 7)
+    {
+      guchar byte;
+
+      if (*data == end)
+        return FALSE;
+
+      byte = *(*data)++;
+      *value |= (guint) (byte & 0x7f) << shift;
+
+      if (~byte & 0x80)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+static gboolean
+dfi_token_dictionary_read_entry (const struct dfi_index             *dfi,
+                                 const guchar                      **data,
+                                 const guchar                       *end,
+                                 struct dfi_token_dictionary_entry  *entry)
+{
+  gsize id_size = dfi->wide_ids ? sizeof (dfi_wide_id) : sizeof (dfi_id);
+  gint n_ids;
+
+  if (!dfi_token_dictionary_read_varint (data, end, &entry->shared) ||
+      !dfi_token_dictionary_read_varint (data, end, &entry->length))
+    return FALSE;
+
+  if (entry->length > end - *data)
+    return FALSE;
+
+  entry->suffix = *data;
+  *data += entry->length;
+
+  /* Blocks and dictionaries are aligned, so this is the file offset */
+  *data += -(gsize) *data & (id_size - 1);
+
+  if (*data > end || end - *data < id_size)
+    return FALSE;
+
+  entry->id_list = (gconstpointer) *data;
+  dfi_id_list_get_ids (entry->id_list, dfi, &n_ids);
+
+  if ((end - *data) / id_size - 1 < n_ids)
+    return FALSE;
+
+  *data += (n_ids + 1) * id_size;
+
+  return TRUE;
+}
+
+/* Returns the last block that starts at or before string, or -1 */
+static gint
+dfi_token_dictionary_find_block (const struct dfi_index            *dfi,
+                                 const struct dfi_token_dictionary *dictionary,
+                                 const gchar                       *string,
+                                 gsize                              length)
+{
+  guint l, r;
+
+  l = 0;
+  r = dfi_token_dictionary_get_n_blocks (dictionary);
+
+  while (l < r)
+    {
+      struct dfi_token_dictionary_entry entry;
+      const guchar *data, *end;
+      guint m;
+      gint x;
+
+      m = l + (r - l) / 2;
+
+      data = dfi_token_dictionary_get_block (dictionary, m, &end);
+      if (data == NULL || !dfi_token_dictionary_read_entry (dfi, &data, end, &entry))
+        return -1;
+
+      x = memcmp (string, entry.suffix, MIN (length, entry.length));
+      if (x == 0)
+        x = (length > entry.length) - (length < entry.length);
+
+      if (x >= 0)
+        l = m + 1;
+      else
+        r = m;
+    }
+
+  return (gint) l - 1;
+}
+
+const dfi_id *
+dfi_token_dictionary_get_ids_for_exact_match (const struct dfi_index            *dfi,
+                                              const struct dfi_token_dictionary *dictionary,
+                                              const gchar                       *string,
+                                              gint                              *n_results)
+{
+  struct dfi_token_dictionary_entry entry;
+  const guchar *data, *end;
+  gsize matched;
+  gsize length;
+  gint block;
+  guint i;
+
+  *n_results = 0;
+
+  if G_UNLIKELY (dictionary == NULL)
+    return NULL;
+
+  length = strlen (string);
+
+  block = dfi_token_dictionary_find_block (dfi, dictionary, string, length);
+  if (block < 0)
+    return NULL;
+
+  data = dfi_token_dictionary_get_block (dictionary, block, &end);
+  if (data == NULL)
+    return NULL;
+
+  /* Scan the block without rebuilding the tokens: matched is how much
+   * of string the token before shares with it, and that token always
+   * sorts before string.
+   */
+  matched = 0;
+  for (i = 0; i < DFI_TOKEN_DICTIONARY_BLOCK_SIZE && data != end; i++)
+    {
+      gsize n, j;
+
+      if (!dfi_token_dictionary_read_entry (dfi, &data, end, &entry))
+        return NULL;
+
+      /* This token differs from the last one before it differs from
+       * string, so it is either still before string or already past it.
+       */
+      if (entry.shared > matched)
+        continue;
+      if (entry.shared < matched)
+        return NULL;
+
+      n = MIN (entry.length, length - matched);
+      for (j = 0; j < n && entry.suffix[j] == (guchar) string[matched + j]; j++)
+        ;
+
+      if (j < n ? entry.suffix[j] > (guchar) string[matched + j] : entry.length > n)
+        return NULL;
+
+      if (j == n && entry.length == length - matched)
+        return dfi_id_list_get_ids (entry.id_list, dfi, n_results);
+
+      matched += j;
+    }
+
+  return NULL;
+}
+
+/* Calls func for each token that starts with prefix, in order */
+void
+dfi_token_dictionary_foreach_prefix (const struct dfi_index            *dfi,
+                                     const struct dfi_token_dictionary *dictionary,
+                                     const gchar                       *prefix,
+                                     DfiTokenDictionaryFunc             func,
+                                     gpointer                           user_data)
+{
+  GString *token;
+  guint n_blocks;
+  gsize length;
+  gint block;
+
+  if G_UNLIKELY (dictionary == NULL)
+    return;
+
+  length = strlen (prefix);
+  n_blocks = dfi_token_dictionary_get_n_blocks (dictionary);
+
+  block = dfi_token_dictionary_find_block (dfi, dictionary, prefix, length);
+  token = g_string_new (NULL);
+
+  for (block = MAX (block, 0); block < n_blocks; block++)
+    {
+      struct dfi_token_dictionary_entry entry;
+      const guchar *data, *end;
+      guint i;
+
+      data = dfi_token_dictionary_get_block (dictionary, block, &end);
+      if (data == NULL)
+        break;
+
+      for (i = 0; i < DFI_TOKEN_DICTIONARY_BLOCK_SIZE && data != end; i++)
+        {
+          gint x;
+
+          if (!dfi_token_dictionary_read_entry (dfi, &data, end, &entry) || entry.shared > token->len)
+            goto out;
+
+          g_string_truncate (token, entry.shared);
+          g_string_append_len (token, (const gchar *) entry.suffix, entry.length);
+
+          x = memcmp (token->str, prefix, MIN (token->len, length));
+
+          if (x == 0 && token->len >= length)
+            {
+              const dfi_id *ids;
+              gint n_ids;
+
+              ids = dfi_id_list_get_ids (entry.id_list, dfi, &n_ids);
+              (* func) (token->str, token->len, ids, n_ids, user_data);
+            }
+          else if (x > 0)
+            goto out;
+        }
+    }
+
+out:
+  g_string_free (token, TRUE);
+}
+
+/* Like dfi_text_index_search(), for a front-coded file */
+guint *
+dfi_token_dictionary_search (const struct dfi_index            *dfi,
+                             const struct dfi_token_dictionary *dictionary,
+                             const gchar                       *query,
+                             gint                              *n_results)
+{
+  *n_results = 0;
+
+  if G_UNLIKELY (dictionary == NULL)
+    return NULL;
+
+  return dfi_text_index_search_internal (dfi, NULL, dictionary, query, 0, n_results);
+}
+
+/* dfi_app_summary, dfi_name_column, dfi_app_flags, dfi_show_in {{{1 */
+
+/* Apps that don't have a string have offset 0 */
+static const gchar *
+dfi_app_summary_string_get (const struct dfi_index *dfi,
+                            dfi_string              string)
+{
+  if (dfi_uint32_get (string.offset) == 0)
+    return NULL;
+
+  return dfi_string_get (dfi, string);
+}
+
+const struct dfi_app_summary *
+dfi_app_summary_from_pointer (const struct dfi_index *dfi,
+                              dfi_pointer             pointer)
+{
+  const struct dfi_app_summary *summary;
+  guint need_size;
+  guint n_apps;
+
+  need_size = sizeof (dfi_uint32);
+
+  summary = dfi_pointer_dereference (dfi, pointer, need_size);
+  if (summary == NULL)
+    return NULL;
+
+  n_apps = dfi_uint32_get (summary->n_apps);
+  if (n_apps > (1u << 24))
+    return NULL;
+
+  need_size += sizeof (struct dfi_app_summary_row) * n_apps;
+
+  return dfi_pointer_dereference (dfi, pointer, need_size);
+}
+
+guint
+dfi_app_summary_get_length (const struct dfi_app_summary *summary)
+{
+  return dfi_uint32_get (summary->n_apps);
+}
+
+const gchar *
+dfi_app_summary_get_icon (const struct dfi_app_summary *summary,
+                          const struct dfi_index       *dfi,
+                          guint                         app)
+{
+  if (app >= dfi_uint32_get (summary->n_apps))
+    return NULL;
+
+  return dfi_app_summary_string_get (dfi, summary->rows[app].icon);
+}
+
+const gchar *
+dfi_app_summary_get_exec (const struct dfi_app_summary *summary,
+                          const struct dfi_index       *dfi,
+                          guint                         app)
+{
+  if (app >= dfi_uint32_get (summary->n_apps))
+    return NULL;
+
+  return dfi_app_summary_string_get (dfi, summary->rows[app].exec);
+}
+
+/* DFI_APP_SUMMARY_FLAG_* */
+guint
+dfi_app_summary_get_flags (const struct dfi_app_summary *summary,
+                           guint                         app)
+{
+  if (app >= dfi_uint32_get (summary->n_apps))
+    return 0;
+
+  return dfi_uint32_get (summary->rows[app].flags);
+}
+
+const struct dfi_name_column *
+dfi_name_column_from_pointer (const struct dfi_index *dfi,
+                              dfi_pointer             pointer)
+{
+  const struct dfi_name_column *column;
+  guint need_size;
+  guint n_apps;
+
+  need_size = sizeof (dfi_uint32);
+
+  column = dfi_pointer_dereference (dfi, pointer, need_size);
+  if (column == NULL)
+    return NULL;
+
+  n_apps = dfi_uint32_get (column->n_apps);
+  if (n_apps > (1u << 24))
+    return NULL;
+
+  need_size += sizeof (dfi_string) * n_apps;
+
+  return dfi_pointer_dereference (dfi, pointer, need_size);
+}
+
+/* The Name of app as displayed in the column's locale, or NULL */
+const gchar *
+dfi_name_column_get_name (const struct dfi_name_column *column,
+                          const struct dfi_index       *dfi,
+                          guint                         app)
+{
+  if (app >= dfi_uint32_get (column->n_apps))
+    return NULL;
+
+  return dfi_app_summary_string_get (dfi, column->names[app]);
+}
+
+const struct dfi_app_flags *
+dfi_app_flags_from_pointer (const struct dfi_index *dfi,
+                            dfi_pointer             pointer)
+{
+  const struct dfi_app_flags *flags;
+  guint need_size;
+  guint n_apps;
+  guint n_flags;
+
+  need_size = 2 * sizeof (dfi_uint32);
+
+  flags = dfi_pointer_dereference (dfi, pointer, need_size);
+  if (flags == NULL)
+    return NULL;
+
+  n_apps = dfi_uint32_get (flags->n_apps);
+  n_flags = dfi_uint32_get (flags->n_flags);
+  if (n_apps > (1u << 24) || n_flags > 32)
+    return NULL;
+
+  need_size += sizeof (dfi_uint32) * n_flags * ((n_apps + 31) / 32);
+
+  return dfi_pointer_dereference (dfi, pointer, need_size);
+}
+
+gboolean
+dfi_app_flags_get (const struct dfi_app_flags *flags,
+                   guint                       flag,
+                   guint                       app)
+{
+  guint n_words;
+
+  if (flag >= dfi_uint32_get (flags->n_flags) || app >= dfi_uint32_get (flags->n_apps))
+    return FALSE;
+
+  n_words = (dfi_uint32_get (flags->n_apps) + 31) / 32;
+
+  return (dfi_uint32_get (flags->words[flag * n_words + app / 32]) >> (app % 32)) & 1;
+}
+
+/* Clears the bits of mask (a bitmap over the app ids, as in struct
+ * dfi_app_flags, of n_words words) for the apps that don't have flag
+ * set to value.  Apps past the end of the file's bitmaps are taken to
+ * have the flag unset.
+ *
+ * Starting from all ones and masking out DFI_APP_FLAG_NO_DISPLAY and
+ * DFI_APP_FLAG_HIDDEN gives the apps that belong in a menu.
+ */
+void
+dfi_app_flags_mask (const struct dfi_app_flags *flags,
+                    guint                       flag,
+                    gboolean                    value,
+                    guint32                    *mask,
+                    guint                       n_words)
+{
+  const dfi_uint32 *words = NULL;
+  guint n_flag_words;
+  guint i;
+
+  n_flag_words = (dfi_uint32_get (flags->n_apps) + 31) / 32;
+
+  if (flag < dfi_uint32_get (flags->n_flags))
+    words = flags->words + flag * n_flag_words;
+  else
+    n_flag_words = 0;
+
+  for (i = 0; i < n_words; i++)
+    {
+      guint32 word = i < n_flag_words ? dfi_uint32_get (words[i]) : 0;
+
+      mask[i] &= value ? word : ~word;
+    }
+}
+
+const struct dfi_show_in *
+dfi_show_in_from_pointer (const struct dfi_index *dfi,
+                          dfi_pointer             pointer)
+{
+  const struct dfi_show_in *show_in;
+  guint n_apps;
+
+  show_in = dfi_pointer_dereference (dfi, pointer, sizeof (dfi_uint32));
+  if (show_in == NULL)
+    return NULL;
+
+  n_apps = dfi_uint32_get (show_in->n_apps);
+  if (n_apps > (1u << 24))
+    return NULL;
+
+  return dfi_pointer_dereference (dfi, pointer, sizeof (dfi_uint32) * (1 + 2 * ((n_apps + 31) / 32)));
+}
+
+/* which is 0 for OnlyShowIn or 1 for NotShowIn */
+static guint32
+dfi_show_in_get_word (const struct dfi_show_in *show_in,
+                      guint                     which,
+                      guint                     i)
+{
+  guint n_words;
+
+  if (show_in == NULL)
+    return 0;
+
+  n_words = (dfi_uint32_get (show_in->n_apps) + 31) / 32;
+  if (i >= n_words)
+    return 0;
+
+  return dfi_uint32_get (show_in->words[which * n_words + i]);
+}
+
+/* dfi_keyfile, dfi_keyfile_group, dfi_keyfile_item {{{1 */
+
+/* The keyfile header is followed by the groups and then the items.  In
+ * the wide format, each of those is twice the size (except the item's
+ * value).
+ */
+static guint
+dfi_keyfile_get_n_groups (const struct dfi_keyfile *file,
+                          const struct dfi_index   *dfi)
+{
+  if G_LIKELY (!dfi->wide_ids)
+    return dfi_uint16_get (file->n_groups);
+  else
+    return dfi_uint32_get (((const struct dfi_keyfile_wide *) file)->n_groups);
+}
+
+static guint
+dfi_keyfile_get_n_items (const struct dfi_keyfile *file,
+                         const struct dfi_index   *dfi)
+{
+  if G_LIKELY (!dfi->wide_ids)
+    return dfi_uint16_get (file->n_items);
+  else
+    return dfi_uint32_get (((const struct dfi_keyfile_wide *) file)->n_items);
+}
+
+static gsize
+dfi_keyfile_get_items_offset (const struct dfi_keyfile *file,
+                              const struct dfi_index   *dfi)
+{
+  if G_LIKELY (!dfi->wide_ids)
+    return sizeof (struct dfi_keyfile) + sizeof (struct dfi_keyfile_group) * dfi_keyfile_get_n_groups (file, dfi);
+  else
+    return sizeof (struct dfi_keyfile_wide) + sizeof (struct dfi_keyfile_group_wide) * dfi_keyfile_get_n_groups (file, dfi);
+}
+
+const struct dfi_keyfile *
+dfi_keyfile_from_pointer (const struct dfi_index *dfi,
+                          dfi_pointer             pointer)
+{
+  const struct dfi_keyfile *file;
+  guint64 need_size;
+
+  if G_LIKELY (!dfi->wide_ids)
+    need_size = sizeof (struct dfi_keyfile);
+  else
+    need_size = sizeof (struct dfi_keyfile_wide);
+
+  file = dfi_pointer_dereference (dfi, pointer, need_size);
+
+  if (!file)
+    return NULL;
+
+  /* The sizes may be 32bit, so do this in 64bit to avoid overflow */
+  need_size = dfi_keyfile_get_items_offset (file, dfi);
+  if G_LIKELY (!dfi->wide_ids)
+    need_size += (guint64) sizeof (struct dfi_keyfile_item) * dfi_keyfile_get_n_items (file, dfi);
+  else
+    need_size += (guint64) sizeof (struct dfi_keyfile_item_wide) * dfi_keyfile_get_n_items (file, dfi);
+
+  if (need_size > dfi->file_size)
+    return NULL;
+
+  if G_UNLIKELY (dfi->profile_offsets)
+    dfi_index_profile_offset (dfi, pointer);
+
+  return dfi_pointer_dereference (dfi, pointer, need_size);
+}
+
+const struct dfi_keyfile_group *
+dfi_keyfile_get_groups (const struct dfi_keyfile *file,
+                        const struct dfi_index   *dfi,
+                        gint                     *n_groups)
+{
+  *n_groups = dfi_keyfile_get_n_groups (file, dfi);
+
+  if G_LIKELY (!dfi->wide_ids)
+    return G_STRUCT_MEMBER_P (file, sizeof (struct dfi_keyfile));
+  else
+    return G_STRUCT_MEMBER_P (file, sizeof (struct dfi_keyfile_wide));
+}
+
+const struct dfi_keyfile_group *
+dfi_keyfile_group_array_get (const struct dfi_keyfile_group *groups,
+                             const struct dfi_index         *dfi,
+                             gint                            i)
+{
+  if G_LIKELY (!dfi->wide_ids)
+    return groups + i;
+  else
+    return (gconstpointer) ((const struct dfi_keyfile_group_wide *) groups + i);
+}
+
+static guint
+dfi_keyfile_group_get_items_index (const struct dfi_keyfile_group *group,
+                                   const struct dfi_index         *dfi)
+{
+  if G_LIKELY (!dfi->wide_ids)
+    return dfi_uint16_get (group->items_index);
+  else
+    return dfi_uint32_get (((const struct dfi_keyfile_group_wide *) group)->items_index);
+}
+
+const gchar *
+dfi_keyfile_group_get_name (const struct dfi_keyfile_group *group,
+                            const struct dfi_index         *dfi)
+{
+  guint id;
+
+  if G_LIKELY (!dfi->wide_ids)
+    id = dfi_id_get (group->name_id);
+  else
+    id = dfi_wide_id_get (((const struct dfi_keyfile_group_wide *) group)->name_id);
+
+  return dfi_string_list_get_string (dfi->group_names, dfi, id);
+}
+
+const struct dfi_keyfile_item *
+dfi_keyfile_group_get_items (const struct dfi_keyfile_group *group,
+                             const struct dfi_index         *dfi,
+                             const struct dfi_keyfile       *file,
+                             gint                           *n_items)
+{
+  const struct dfi_keyfile_group *groups;
+  guint start, end;
+  gint n_groups;
+
+  start = dfi_keyfile_group_get_items_index (group, dfi);
+
+  groups = dfi_keyfile_get_groups (file, dfi, &n_groups);
+  if (dfi_keyfile_group_array_get (groups, dfi, n_groups - 1) == group)
+    end = dfi_keyfile_get_n_items (file, dfi);
+  else
+    end = dfi_keyfile_group_get_items_index (dfi_keyfile_group_array_get (group, dfi, 1), dfi);
+
+  if (start <= end && end <= dfi_keyfile_get_n_items (file, dfi))
+    {
+      const struct dfi_keyfile_item *items;
+
+      *n_items = end - start;
+      items = G_STRUCT_MEMBER_P (file, dfi_keyfile_get_items_offset (file, dfi));
+
+      return dfi_keyfile_item_array_get (items, dfi, start);
+    }
+  else
+    {
+      *n_items = 0;
+      return NULL;
+    }
+}
+
+const struct dfi_keyfile_item *
+dfi_keyfile_item_array_get (const struct dfi_keyfile_item *items,
+                            const struct dfi_index        *dfi,
+                            gint                           i)
+{
+  if G_LIKELY (!dfi->wide_ids)
+    return items + i;
+  else
+    return (gconstpointer) ((const struct dfi_keyfile_item_wide *) items + i);
+}
+
+static guint
+dfi_keyfile_item_get_key_id (const struct dfi_keyfile_item *item,
+                             const struct dfi_index        *dfi)
+{
+  if G_LIKELY (!dfi->wide_ids)
+    return dfi_id_get (item->key_id);
+  else
+    return dfi_wide_id_get (((const struct dfi_keyfile_item_wide *) item)->key_id);
+}
+
+static guint
+dfi_keyfile_item_get_locale_id (const struct dfi_keyfile_item *item,
+                                const struct dfi_index        *dfi)
+{
+  if G_LIKELY (!dfi->wide_ids)
+    return dfi_id_get (item->locale_id);
+  else
+    return dfi_wide_id_get (((const struct dfi_keyfile_item_wide *) item)->locale_id);
+}
+
+const gchar *
+dfi_keyfile_item_get_key (const struct dfi_keyfile_item *item,
+                          const struct dfi_index        *dfi)
+{
+  return dfi_string_list_get_string (dfi->key_names, dfi, dfi_keyfile_item_get_key_id (item, dfi));
+}
+
+const gchar *
+dfi_keyfile_item_get_locale (const struct dfi_keyfile_item *item,
+                             const struct dfi_index        *dfi)
+{
+  return dfi_string_list_get_string (dfi->locale_names, dfi, dfi_keyfile_item_get_locale_id (item, dfi));
+}
+
+static dfi_string
+dfi_keyfile_item_get_value_string (const struct dfi_keyfile_item *item,
+                                   const struct dfi_index        *dfi)
+{
+  if G_UNLIKELY (dfi->profile_offsets)
+    {
+      guint key_id = dfi_keyfile_item_get_key_id (item, dfi);
+      guint locale_id = dfi_keyfile_item_get_locale_id (item, dfi);
+
+      if (key_id < dfi_string_list_get_length (dfi->key_names, dfi))
+        dfi->profile_key_hits[key_id]++;
+
+      if (locale_id < dfi_string_list_get_length (dfi->locale_names, dfi))
+        dfi->profile_locale_hits[locale_id]++;
+    }
+
+  if G_LIKELY (!dfi->wide_ids)
+    return item->value;
+  else
+    return ((const struct dfi_keyfile_item_wide *) item)->value;
+}
+
+const gchar *
+dfi_keyfile_item_get_value (const struct dfi_keyfile_item *item,
+                            const struct dfi_index        *dfi)
+{
+  return dfi_string_get (dfi, dfi_keyfile_item_get_value_string (item, dfi));
+}
+
+const gchar *
+dfi_keyfile_item_get_value_with_length (const struct dfi_keyfile_item *item,
+                                        const struct dfi_index        *dfi,
+                                        gsize                         *length)
+{
+  return dfi_string_get_with_length (dfi, dfi_keyfile_item_get_value_string (item, dfi), length);
+}
+
+/* The value of the key key_id in group, in the first of locale_ids
+ * that has one (see dfi_index_resolve_locale()), or NULL.
+ */
+const gchar *
+dfi_keyfile_group_get_value (const struct dfi_keyfile_group *group,
+                             const struct dfi_index         *dfi,
+                             const struct dfi_keyfile       *file,
+                             guint                           key_id,
+                             const guint                    *locale_ids,
+                             gint                            n_locale_ids)
+{
+  const struct dfi_keyfile_item *items;
+  const struct dfi_keyfile_item *best = NULL;
+  gint best_rank = n_locale_ids;
+  gint n_items;
+  gint i, j;
+
+  items = dfi_keyfile_group_get_items (group, dfi, file, &n_items);
+
+  for (i = 0; i < n_items && best_rank > 0; i++)
+    {
+      const struct dfi_keyfile_item *item = dfi_keyfile_item_array_get (items, dfi, i);
+      guint locale_id;
+
+      if (dfi_keyfile_item_get_key_id (item, dfi) != key_id)
+        continue;
+
+      locale_id = dfi_keyfile_item_get_locale_id (item, dfi);
+      for (j = 0; j < best_rank; j++)
+        if (locale_ids[j] == locale_id)
+          {
+            best = item;
+            best_rank = j;
+            break;
+          }
+    }
+
+  return best ? dfi_keyfile_item_get_value (best, dfi) : NULL;
+}
+
+/* struct dfi_index implementation {{{1 */
+
+void
+dfi_index_free (struct dfi_index *dfi)
+{
+  guint i;
+
+  dfi_index_profile_free (dfi);
+  munmap (dfi->data, dfi->file_size);
+
+  g_hash_table_unref (dfi->fuzzy_tries);
+  g_mutex_clear (&dfi->fuzzy_lock);
+
+  for (i = 0; i < dfi->n_segments; i++)
+    g_free (dfi->segments[i].filename);
+  g_free (dfi->segments);
+
+  if (dfi->dir_fd > 0)
+    close (dfi->dir_fd);
+
+  free (dfi);
+}
+
+static gpointer
+dfi_index_map_file (const gchar *directory,
+                    guint32     *size)
+{
+  struct stat dir_buf, file_buf;
+  gpointer mapping = NULL;
+  gint file_fd = -1;
+  gint dir_fd = -1;
+
+  dir_fd = open (directory, O_DIRECTORY);
+  if (dir_fd < 0)
+    goto out;
+
+  if (fstat (dir_fd, &dir_buf) < 0)
+    goto out;
+
+  file_fd = openat (dir_fd, "index.cache", O_RDONLY);
+
+  if (file_fd < 0)
+    goto out;
+
+  if (fstat (file_fd, &file_buf) < 0)
+    goto out;
+
+  if (file_buf.st_size > G_MAXUINT32)
+    goto out;
+
+  //if (file_buf.st_mtime < dir_buf.st_mtime)
+    //goto out;
+
+  //if (dir_buf.st_nlink != 2)
+    //goto out;
+
+  mapping = mmap (NULL, file_buf.st_size, PROT_READ, MAP_SHARED, file_fd, 0);
+
+  if (mapping == MAP_FAILED)
+    {
+      mapping = NULL;
+      goto out;
+    }
+
+  madvise (mapping, file_buf.st_size, MADV_RANDOM);
+
+out:
+  if (file_fd != -1)
+    close (file_fd);
+
+  if (dir_fd != -1)
+    close (dir_fd);
+
+  if (mapping)
+    *size = file_buf.st_size;
+
+  return mapping;
+}
+
+static gboolean
+dfi_index_map_segments (struct dfi_index *dfi,
+                        const gchar      *directory,
+                        dfi_pointer       pointer)
+{
+  const struct dfi_segment_table *table;
+  struct dfi_index_segment *segments;
+  guint32 logical_size;
+  gpointer data;
+  gsize need_size;
+  guint n, i;
+
+  /* At this point we have a plain mapping of index.cache, which is
+   * exactly what we need because the offsets in the segment table are
+   * relative to that file.
+   */
+  table = dfi_pointer_dereference (dfi, pointer, sizeof (dfi_uint32));
+  if (table == NULL)
+    return FALSE;
+
+  n = dfi_uint32_get (table->n_segments);
+  if (n == 0 || n > 65536)
+    return FALSE;
+
+  /* The segments are followed by the build id */
+  need_size = sizeof (dfi_uint32) + n * sizeof (struct dfi_segment) + sizeof (struct dfi_segment_build_id);
+  if (dfi->sections[DFI_SECTION_SEGMENTS].length < need_size || !dfi_pointer_dereference (dfi, pointer, need_size))
+    return FALSE;
+
+  memcpy (&dfi->build_id, &table->segments[n], sizeof (struct dfi_segment_build_id));
+
+  segments = g_new0 (struct dfi_index_segment, n);
+  logical_size = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      const struct dfi_segment *segment = &table->segments[i];
+      dfi_string name = { segment->name };
+      const gchar *group;
+
+      segments[i].start = dfi_uint32_get (segment->start);
+      segments[i].size = dfi_uint32_get (segment->size);
+      segments[i].file_offset = dfi_uint32_get (segment->file_offset);
+
+      /* Segments must be sorted, aligned and not overlap */
+      if (segments[i].start < logical_size || segments[i].start % DFI_SEGMENT_ALIGNMENT ||
+          segments[i].size > G_MAXINT - segments[i].start)
+        goto err;
+
+      logical_size = segments[i].start + segments[i].size;
+
+      group = dfi_string_get (dfi, name);
+      if (strchr (group, '/'))
+        goto err;
+
+      if (group[0])
+        segments[i].filename = g_strdup_printf ("index-%s.cache", group);
+      else
+        segments[i].filename = g_strdup ("index.cache");
+    }
+
+  /* The header lives in the first segment, which is from index.cache */
+  if (segments[0].start != 0 || segments[0].file_offset != 0 || !g_str_equal (segments[0].filename, "index.cache"))
+    goto err;
+
+  dfi->dir_fd = open (directory, O_DIRECTORY);
+  if (dfi->dir_fd < 0)
+    goto err;
+
+  data = mmap (NULL, logical_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (data == MAP_FAILED)
+    goto err;
+
+  munmap (dfi->data, dfi->file_size);
+  dfi->data = data;
+  dfi->file_size = logical_size;
+  dfi->segments = segments;
+  dfi->n_segments = n;
+
+  /* If the system page size is larger than the segment alignment then
+   * we can't map the segments into place, so read them all up front.
+   */
+  if (sysconf (_SC_PAGESIZE) > DFI_SEGMENT_ALIGNMENT)
+    {
+      if (mprotect (data, logical_size, PROT_READ | PROT_WRITE) < 0)
+        return FALSE;
+
+      for (i = 0; i < n; i++)
+        if (!dfi_index_segment_read (dfi, &segments[i]))
+          return FALSE;
+
+      return mprotect (data, logical_size, PROT_READ) == 0;
+    }
+
+  /* Always map the core file; the locale files are mapped on demand */
+  for (i = 0; i < n; i++)
+    if (g_str_equal (segments[i].filename, "index.cache"))
+      if (!dfi_index_segment_map (dfi, &segments[i]))
+        return FALSE;
+
+  return TRUE;
+
+err:
+  for (i = 0; i < n; i++)
+    g_free (segments[i].filename);
+  g_free (segments);
+
+  return FALSE;
+}
+
+/* Opens the index.cache in directory.  The dfi_index can be used from
+ * several threads at once: the locale files of a split cache and the
+ * tries for fuzzy matching get set up safely on first use.  Profiling
+ * (DFI_PROFILE) is the exception and only works from one thread.
+ */
+struct dfi_index *
+dfi_index_new (const gchar *directory)
+{
+  struct dfi_index *dfi;
+  gpointer data;
+  guint32 size;
+
+  data = dfi_index_map_file (directory, &size);
+
+  if (data == NULL)
+    return NULL;
+
+  dfi = calloc (1, sizeof (struct dfi_index));
+  dfi->data = data;
+  dfi->file_size = size;
+  dfi->fuzzy_tries = g_hash_table_new_full (NULL, NULL, NULL, dfi_fuzzy_trie_free);
+  g_mutex_init (&dfi->fuzzy_lock);
+
+  if (dfi->file_size > G_MAXINT)
+    goto err;
+
+  if (!dfi_index_read_sections (dfi))
+    goto err;
+
+  if (dfi->sections[DFI_SECTION_SEGMENTS].offset != 0)
+    {
+      /* Offsets in the segment table are relative to index.cache, so
+       * look at it before we switch to the logical mapping.
+       */
+      if (!dfi_index_map_segments (dfi, directory, dfi_index_get_section (dfi, DFI_SECTION_SEGMENTS)))
+        goto err;
+    }
+  else
+    dfi_index_advise (dfi, 0, dfi->file_size);
+
+  /* Everything needs these, so check them now */
+  dfi->app_names = dfi_string_list_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_APP_NAMES));
+  dfi->key_names = dfi_string_list_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_KEY_NAMES));
+  dfi->locale_names = dfi_string_list_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_LOCALE_NAMES));
+  dfi->group_names = dfi_string_list_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_GROUP_NAMES));
+
+  if (!dfi->app_names || !dfi->key_names || !dfi->locale_names || !dfi->group_names)
+   goto err;
+
+  if (dfi->overlays)
+    {
+      const struct dfi_pointer_array *text_indexes;
+      gint c_id;
+
+      text_indexes = dfi_index_get_text_indexes (dfi);
+      c_id = dfi_string_list_binary_search (dfi->locale_names, dfi, "");
+
+      if (text_indexes && c_id >= 0)
+        dfi->overlay_base = dfi_text_index_from_pointer (dfi, dfi_pointer_array_get_pointer (text_indexes, c_id));
+    }
+
+  dfi_index_profile_init (dfi);
+
+  return dfi;
+
+err:
+  dfi_index_free (dfi);
+
+  return NULL;
+}
+
+const struct dfi_pointer_array *
+dfi_index_get_desktop_files (const struct dfi_index *dfi)
+{
+  return dfi_pointer_array_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_DESKTOP_FILES));
+}
+
+const struct dfi_string_list *
+dfi_index_get_app_names (const struct dfi_index *dfi)
+{
+  return dfi->app_names;
+}
+
+const struct dfi_string_list *
+dfi_index_get_key_names (const struct dfi_index *dfi)
+{
+  return dfi->key_names;
+}
+
+const struct dfi_string_list *
+dfi_index_get_locale_names (const struct dfi_index *dfi)
+{
+  return dfi->locale_names;
 }
 
 const struct dfi_string_list *
@@ -662,10 +3384,487 @@ dfi_index_get_group_names (const struct dfi_index *dfi)
   return dfi->group_names;
 }
 
+const struct dfi_pointer_array *
+dfi_index_get_implementors (const struct dfi_index *dfi)
+{
+  return dfi_pointer_array_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_IMPLEMENTORS));
+}
+
 const struct dfi_pointer_array *
 dfi_index_get_text_indexes (const struct dfi_index *dfi)
 {
-  return dfi->text_indexes;
+  return dfi_pointer_array_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_TEXT_INDEXES));
+}
+
+const struct dfi_pointer_array *
+dfi_index_get_suffix_arrays (const struct dfi_index *dfi)
+{
+  return dfi_pointer_array_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_SUFFIX_ARRAYS));
+}
+
+const struct dfi_pointer_array *
+dfi_index_get_token_dictionaries (const struct dfi_index *dfi)
+{
+  return dfi_pointer_array_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_TOKEN_DICTIONARIES));
+}
+
+const struct dfi_pointer_array *
+dfi_index_get_position_tables (const struct dfi_index *dfi)
+{
+  return dfi_pointer_array_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_POSITIONS));
+}
+
+const struct dfi_app_summary *
+dfi_index_get_app_summary (const struct dfi_index *dfi)
+{
+  return dfi_app_summary_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_APP_SUMMARY));
+}
+
+const struct dfi_app_flags *
+dfi_index_get_app_flags (const struct dfi_index *dfi)
+{
+  return dfi_app_flags_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_APP_FLAGS));
+}
+
+const struct dfi_pointer_array *
+dfi_index_get_show_in (const struct dfi_index *dfi)
+{
+  return dfi_pointer_array_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_SHOW_IN));
+}
+
+/* Clears the bits of mask (as for dfi_app_flags_mask()) for the apps
+ * that are not shown in any of desktops, the desktop names from
+ * XDG_CURRENT_DESKTOP in order.  As with GDesktopAppInfo, the first of
+ * desktops that an app lists in OnlyShowIn or NotShowIn decides, and
+ * otherwise the app is shown unless it has OnlyShowIn.
+ *
+ * mask is left alone if the index has no show-in bitmaps.
+ */
+void
+dfi_index_mask_show_in (const struct dfi_index *dfi,
+                        const gchar * const    *desktops,
+                        guint32                *mask,
+                        guint                   n_words)
+{
+  const struct dfi_pointer_array *array;
+  const struct dfi_string_list *names;
+  const struct dfi_show_in **show_in;
+  const struct dfi_show_in *any;
+  gint n_desktops;
+  gint i, j;
+  guint w;
+
+  array = dfi_index_get_show_in (dfi);
+  if (array == NULL)
+    return;
+
+  names = dfi_pointer_dereference_unchecked (dfi, array->associated_string_list);
+
+  any = NULL;
+  i = dfi_string_list_binary_search (names, dfi, "");
+  if (i >= 0)
+    any = dfi_show_in_from_pointer (dfi, dfi_pointer_array_get_pointer (array, i));
+
+  n_desktops = desktops ? g_strv_length ((gchar **) desktops) : 0;
+  show_in = g_new (const struct dfi_show_in *, n_desktops + 1);
+
+  /* Desktops that no app mentions can't decide anything */
+  for (i = 0, j = 0; i < n_desktops; i++)
+    {
+      gint id;
+
+      if (desktops[i][0] == '\0')
+        continue;
+
+      id = dfi_string_list_binary_search (names, dfi, desktops[i]);
+      if (id >= 0)
+        show_in[j++] = dfi_show_in_from_pointer (dfi, dfi_pointer_array_get_pointer (array, id));
+    }
+  n_desktops = j;
+
+  for (w = 0; w < n_words; w++)
+    {
+      guint32 undecided = ~0u;
+      guint32 shown = 0;
+
+      for (i = 0; i < n_desktops && undecided; i++)
+        {
+          guint32 only = dfi_show_in_get_word (show_in[i], 0, w);
+          guint32 not = dfi_show_in_get_word (show_in[i], 1, w);
+
+          shown |= undecided & only;
+          undecided &= ~(only | not);
+        }
+
+      shown |= undecided & ~dfi_show_in_get_word (any, 0, w);
+
+      mask[w] &= shown;
+    }
+
+  g_free (show_in);
+}
+
+const struct dfi_pointer_array *
+dfi_index_get_categories (const struct dfi_index *dfi)
+{
+  return dfi_pointer_array_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_CATEGORIES));
+}
+
+/* Looks name up in the list of names of a pointer array of id lists
+ * that has its own list, like the one for categories.
+ */
+static const struct dfi_id_list *
+dfi_index_lookup_id_list (const struct dfi_index         *dfi,
+                          const struct dfi_pointer_array *array,
+                          const gchar                    *name)
+{
+  const struct dfi_string_list *names;
+  gint i;
+
+  if (array == NULL)
+    return NULL;
+
+  names = dfi_pointer_dereference_unchecked (dfi, array->associated_string_list);
+
+  i = dfi_string_list_binary_search (names, dfi, name);
+  if (i < 0)
+    return NULL;
+
+  return dfi_id_list_from_pointer (dfi, dfi_pointer_array_get_pointer (array, i));
+}
+
+/* The ids of the apps with a StartupWMClass of wm_class, for matching
+ * windows to their apps.
+ */
+const dfi_id *
+dfi_index_lookup_startup_wm_class (const struct dfi_index *dfi,
+                                   const gchar            *wm_class,
+                                   gint                   *n_apps)
+{
+  const struct dfi_pointer_array *array;
+
+  array = dfi_pointer_array_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_STARTUP_WM_CLASSES));
+
+  return dfi_id_list_get_ids (dfi_index_lookup_id_list (dfi, array, wm_class), dfi, n_apps);
+}
+
+/* The ids of the apps that run a program called name (a basename, as
+ * found in Exec or TryExec).  For Exec, that is the program that env
+ * runs, or the --command of flatpak run.  Shells, and flatpak without
+ * --command, don't say what they run, so they aren't listed.
+ */
+const dfi_id *
+dfi_index_lookup_executable (const struct dfi_index *dfi,
+                             const gchar            *name,
+                             gint                   *n_apps)
+{
+  const struct dfi_pointer_array *array;
+
+  array = dfi_pointer_array_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_EXECUTABLES));
+
+  return dfi_id_list_get_ids (dfi_index_lookup_id_list (dfi, array, name), dfi, n_apps);
+}
+
+/* Sets the bits of mask (as for dfi_app_flags_mask()) for the apps that
+ * are in any of categories.
+ */
+void
+dfi_index_union_categories (const struct dfi_index *dfi,
+                            const gchar * const    *categories,
+                            guint32                *mask,
+                            guint                   n_words)
+{
+  const struct dfi_pointer_array *array;
+  gint i;
+
+  array = dfi_index_get_categories (dfi);
+
+  for (i = 0; categories[i]; i++)
+    dfi_id_list_set_bits (dfi_index_lookup_id_list (dfi, array, categories[i]), dfi, mask, n_words);
+}
+
+/* Clears the bits of mask (as for dfi_app_flags_mask()) for the apps
+ * that are not in all of categories.
+ *
+ * With dfi_index_union_categories() and complementing the mask, that
+ * is enough to evaluate the <And>, <Or>, <Not> and <Category> rules of
+ * a menu.
+ */
+void
+dfi_index_intersect_categories (const struct dfi_index *dfi,
+                                const gchar * const    *categories,
+                                guint32                *mask,
+                                guint                   n_words)
+{
+  const struct dfi_pointer_array *array;
+  guint32 *bits;
+  gint i;
+  guint w;
+
+  array = dfi_index_get_categories (dfi);
+  bits = g_new (guint32, n_words);
+
+  for (i = 0; categories[i]; i++)
+    {
+      memset (bits, 0, n_words * sizeof (guint32));
+      dfi_id_list_set_bits (dfi_index_lookup_id_list (dfi, array, categories[i]), dfi, bits, n_words);
+
+      for (w = 0; w < n_words; w++)
+        mask[w] &= bits[w];
+    }
+
+  g_free (bits);
+}
+
+const struct dfi_pointer_array *
+dfi_index_get_display_names (const struct dfi_index *dfi)
+{
+  return dfi_pointer_array_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_DISPLAY_NAMES));
+}
+
+const struct dfi_text_index *
+dfi_index_get_mime_types (const struct dfi_index *dfi)
+{
+  return dfi_text_index_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_MIME_TYPES));
+}
+
+/* For files without a fallback table */
+static gint
+dfi_index_find_locale_fallbacks (const struct dfi_index *dfi,
+                                 const gchar            *locale,
+                                 guint                  *locale_ids,
+                                 gint                    max_ids)
+{
+  gint n_ids = 0;
+  gint c_id;
+
+  if (locale && locale[0] && !g_str_equal (locale, "C") && !g_str_equal (locale, "POSIX"))
+    {
+      gchar **variants;
+      guint i;
+
+      variants = g_get_locale_variants (locale);
+
+      for (i = 0; variants[i] && n_ids < max_ids - 1; i++)
+        {
+          gint id;
+
+          id = dfi_string_list_binary_search (dfi->locale_names, dfi, variants[i]);
+          if (id >= 0)
+            locale_ids[n_ids++] = id;
+        }
+
+      g_strfreev (variants);
+    }
+
+  c_id = dfi_string_list_binary_search (dfi->locale_names, dfi, "");
+  if (c_id >= 0 && n_ids < max_ids)
+    locale_ids[n_ids++] = c_id;
+
+  return n_ids;
+}
+
+/* Fills locale_ids with the ids of the locales to look in for locale
+ * (as returned by setlocale (LC_MESSAGES, NULL)), most specific first:
+ * those of its variants that the index has strings for, followed by
+ * the untranslated strings.  Returns the number of ids, at most
+ * max_ids.
+ *
+ * This only needs doing once.  The ids can then be given to
+ * dfi_index_search_locales() and dfi_keyfile_group_get_value().
+ */
+gint
+dfi_index_resolve_locale (const struct dfi_index *dfi,
+                          const gchar            *locale,
+                          guint                  *locale_ids,
+                          gint                    max_ids)
+{
+  const struct dfi_pointer_array *fallbacks;
+  const struct dfi_string_list *names;
+  const dfi_id *ids;
+  gint n_ids;
+  gint i;
+
+  fallbacks = dfi_pointer_array_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_LOCALE_FALLBACKS));
+  if (fallbacks == NULL)
+    return dfi_index_find_locale_fallbacks (dfi, locale, locale_ids, max_ids);
+
+  names = dfi_pointer_dereference_unchecked (dfi, fallbacks->associated_string_list);
+
+  if (locale == NULL)
+    locale = "";
+
+  /* The table has every locale that the index knows, so anything else
+   * is a territory or modifier that nobody translated for.
+   */
+  i = dfi_string_list_binary_search (names, dfi, locale);
+  if (i < 0)
+    {
+      gchar **variants;
+      gint j;
+
+      variants = g_get_locale_variants (locale);
+      for (j = 0; i < 0 && variants[j]; j++)
+        i = dfi_string_list_binary_search (names, dfi, variants[j]);
+      g_strfreev (variants);
+    }
+
+  if (i < 0)
+    i = dfi_string_list_binary_search (names, dfi, "");
+
+  if (i < 0)
+    return 0;
+
+  ids = dfi_id_list_get_ids (dfi_id_list_from_pointer (dfi, dfi_pointer_array_get_pointer (fallbacks, i)), dfi, &n_ids);
+
+  n_ids = MIN (n_ids, max_ids);
+  for (i = 0; i < n_ids; i++)
+    locale_ids[i] = dfi_id_array_get (ids, dfi, i);
+
+  return n_ids;
+}
+
+/* Searches the text of each of locale_ids in turn (see
+ * dfi_index_resolve_locale()), so that a user in fr_CA finds matches in
+ * the fr_CA strings, then the fr strings and then the untranslated
+ * ones.  Every app appears once, at the first locale that all of the
+ * tokens of query matched in.
+ *
+ * This works whatever options the file was compiled with, and gives
+ * the same results for all of them: it searches the text indexes or,
+ * in a file compiled with --front-coded, the token dictionaries.
+ *
+ * Returns an array of n_results ids (an app and a locale per match),
+ * ordered by locale and then by app, to be freed with g_free(), or NULL
+ * if there are no matches.
+ */
+guint *
+dfi_index_search_locales (const struct dfi_index *dfi,
+                          const guint            *locale_ids,
+                          gint                    n_locale_ids,
+                          const gchar            *query,
+                          gint                   *n_results)
+{
+  const struct dfi_pointer_array *token_dictionaries = NULL;
+  const struct dfi_pointer_array *text_indexes;
+  GArray *results;
+  guint32 *seen;
+  guint n_apps;
+  gint i;
+
+  *n_results = 0;
+
+  text_indexes = dfi_index_get_text_indexes (dfi);
+  if (text_indexes == NULL)
+    {
+      token_dictionaries = dfi_index_get_token_dictionaries (dfi);
+      if (token_dictionaries == NULL)
+        return NULL;
+    }
+
+  n_apps = dfi_string_list_get_length (dfi->app_names, dfi);
+  seen = g_new0 (guint32, (n_apps + 31) / 32);
+  results = g_array_new (FALSE, FALSE, 2 * sizeof (guint));
+
+  for (i = 0; i < n_locale_ids; i++)
+    {
+      guint *triples;
+      gint n, j;
+
+      if (token_dictionaries)
+        {
+          const struct dfi_token_dictionary *dictionary;
+
+          if (locale_ids[i] >= dfi_pointer_array_get_length (token_dictionaries, dfi))
+            continue;
+
+          dictionary = dfi_token_dictionary_from_pointer (dfi, dfi_pointer_array_get_pointer (token_dictionaries, locale_ids[i]));
+          if (dictionary == NULL)
+            continue;
+
+          triples = dfi_token_dictionary_search (dfi, dictionary, query, &n);
+        }
+      else
+        {
+          const struct dfi_text_index *text_index;
+
+          if (locale_ids[i] >= dfi_pointer_array_get_length (text_indexes, dfi))
+            continue;
+
+          text_index = dfi_text_index_from_pointer (dfi, dfi_pointer_array_get_pointer (text_indexes, locale_ids[i]));
+          if (text_index == NULL)
+            continue;
+
+          triples = dfi_text_index_search (dfi, text_index, query, &n);
+        }
+
+      /* The triples are sorted, so each app's matches are together */
+      for (j = 0; j < n; j += 3)
+        {
+          guint app = triples[j];
+
+          if (app < n_apps && !(seen[app / 32] & (1u << (app % 32))))
+            {
+              guint pair[2] = { app, locale_ids[i] };
+
+              seen[app / 32] |= 1u << (app % 32);
+              g_array_append_vals (results, pair, 1);
+            }
+        }
+
+      g_free (triples);
+    }
+
+  g_free (seen);
+
+  if (results->len == 0)
+    {
+      g_array_free (results, TRUE);
+      return NULL;
+    }
+
+  *n_results = 2 * results->len;
+
+  return (guint *) g_array_free (results, FALSE);
+}
+
+/* The app ids in the order that the locale locale_id displays them in:
+ * by Name, with any apps that have no Name last.  Names are collated by
+ * the rules of the locale if it was installed where the index was
+ * compiled.  Otherwise, and for the untranslated names, they are in
+ * codepoint order once case folded, which doesn't depend on where the
+ * index was compiled.  Use dfi_id_array_get() to read them.  Returns
+ * NULL if the index doesn't have the order.
+ */
+const dfi_id *
+dfi_index_get_sorted_apps (const struct dfi_index *dfi,
+                           guint                   locale_id,
+                           gint                   *n_apps)
+{
+  const struct dfi_pointer_array *sorted_apps;
+
+  *n_apps = 0;
+
+  sorted_apps = dfi_pointer_array_from_pointer (dfi, dfi_index_get_section (dfi, DFI_SECTION_SORTED_APPS));
+  if (sorted_apps == NULL || locale_id >= dfi_pointer_array_get_length (sorted_apps, dfi))
+    return NULL;
+
+  return dfi_id_list_get_ids (dfi_id_list_from_pointer (dfi, dfi_pointer_array_get_pointer (sorted_apps, locale_id)), dfi, n_apps);
+}
+
+/* Like dfi_index_search_locales(), for the locale ids of locale */
+guint *
+dfi_index_search (const struct dfi_index *dfi,
+                  const gchar            *locale,
+                  const gchar            *query,
+                  gint                   *n_results)
+{
+  guint locale_ids[16];
+  gint n_locale_ids;
+
+  n_locale_ids = dfi_index_resolve_locale (dfi, locale, locale_ids, G_N_ELEMENTS (locale_ids));
+
+  return dfi_index_search_locales (dfi, locale_ids, n_locale_ids, query, n_results);
 }
 
 /* Epilogue {{{1 */
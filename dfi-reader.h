@@ -34,10 +34,53 @@ const struct dfi_string_list *          dfi_index_get_group_names
 const struct dfi_pointer_array *        dfi_index_get_implementors                      (const struct dfi_index      *index);
 const struct dfi_pointer_array *        dfi_index_get_text_indexes                      (const struct dfi_index      *index);
 const struct dfi_pointer_array *        dfi_index_get_desktop_files                     (const struct dfi_index      *index);
-const struct dfi_pointer_array *        dfi_index_get_mime_types                        (const struct dfi_index      *index);
+const struct dfi_pointer_array *        dfi_index_get_suffix_arrays                     (const struct dfi_index      *index);
+const struct dfi_pointer_array *        dfi_index_get_token_dictionaries                (const struct dfi_index      *index);
+const struct dfi_pointer_array *        dfi_index_get_position_tables                   (const struct dfi_index      *index);
+const struct dfi_app_summary *          dfi_index_get_app_summary                       (const struct dfi_index      *index);
+const struct dfi_pointer_array *        dfi_index_get_display_names                     (const struct dfi_index      *index);
+const struct dfi_app_flags *            dfi_index_get_app_flags                         (const struct dfi_index      *index);
+const struct dfi_pointer_array *        dfi_index_get_show_in                           (const struct dfi_index      *index);
+void                                    dfi_index_mask_show_in                          (const struct dfi_index      *index,
+                                                                                         const gchar * const         *desktops,
+                                                                                         guint32                     *mask,
+                                                                                         guint                        n_words);
+const struct dfi_pointer_array *        dfi_index_get_categories                        (const struct dfi_index      *index);
+void                                    dfi_index_union_categories                      (const struct dfi_index      *index,
+                                                                                         const gchar * const         *categories,
+                                                                                         guint32                     *mask,
+                                                                                         guint                        n_words);
+void                                    dfi_index_intersect_categories                  (const struct dfi_index      *index,
+                                                                                         const gchar * const         *categories,
+                                                                                         guint32                     *mask,
+                                                                                         guint                        n_words);
+const dfi_id *                          dfi_index_lookup_startup_wm_class               (const struct dfi_index      *index,
+                                                                                         const gchar                 *wm_class,
+                                                                                         gint                        *n_apps);
+const dfi_id *                          dfi_index_lookup_executable                     (const struct dfi_index      *index,
+                                                                                         const gchar                 *name,
+                                                                                         gint                        *n_apps);
+const struct dfi_text_index *           dfi_index_get_mime_types                        (const struct dfi_index      *index);
+gint                                    dfi_index_resolve_locale                        (const struct dfi_index      *index,
+                                                                                         const gchar                 *locale,
+                                                                                         guint                       *locale_ids,
+                                                                                         gint                         max_ids);
+guint *                                 dfi_index_search_locales                        (const struct dfi_index      *index,
+                                                                                         const guint                 *locale_ids,
+                                                                                         gint                         n_locale_ids,
+                                                                                         const gchar                 *query,
+                                                                                         gint                        *n_results);
+const dfi_id *                          dfi_index_get_sorted_apps                       (const struct dfi_index      *index,
+                                                                                         guint                        locale_id,
+                                                                                         gint                        *n_apps);
+guint *                                 dfi_index_search                                (const struct dfi_index      *index,
+                                                                                         const gchar                 *locale,
+                                                                                         const gchar                 *query,
+                                                                                         gint                        *n_results);
 
-gboolean                                dfi_id_valid                                    (dfi_id                       id);
-guint                                   dfi_id_get                                      (dfi_id                       id);
+guint                                   dfi_id_array_get                                (const dfi_id                *ids,
+                                                                                         const struct dfi_index      *dfi,
+                                                                                         gint                         i);
 
 guint                                   dfi_pointer_array_get_length                    (const struct dfi_pointer_array   *array,
                                                                                          const struct dfi_index           *dfi);
@@ -49,6 +92,7 @@ dfi_pointer                             dfi_pointer_array_get_pointer
 
 
 const dfi_id *                          dfi_id_list_get_ids                             (const struct dfi_id_list         *list,
+                                                                                         const struct dfi_index           *dfi,
                                                                                          gint                             *n_ids);
 const struct dfi_id_list *              dfi_id_list_from_pointer                        (const struct dfi_index           *index,
                                                                                          dfi_pointer                       pointer);
@@ -58,11 +102,16 @@ const struct dfi_string_list *          dfi_string_list_from_pointer
 gint                                    dfi_string_list_binary_search                   (const struct dfi_string_list     *list,
                                                                                          const struct dfi_index           *index,
                                                                                          const gchar                      *string);
-guint                                   dfi_string_list_get_length                      (const struct dfi_string_list     *list);
+guint                                   dfi_string_list_get_length                      (const struct dfi_string_list     *list,
+                                                                                         const struct dfi_index           *dfi);
 
 const gchar *                           dfi_string_list_get_string                      (const struct dfi_string_list     *list,
                                                                                          const struct dfi_index           *dfi,
-                                                                                         dfi_id                            id);
+                                                                                         guint                             id);
+const gchar *                           dfi_string_list_get_string_with_length          (const struct dfi_string_list     *list,
+                                                                                         const struct dfi_index           *dfi,
+                                                                                         guint                             id,
+                                                                                         gsize                            *length);
 
 const gchar *                           dfi_string_list_get_string_at_index             (const struct dfi_string_list     *list,
                                                                                          const struct dfi_index           *dfi,
@@ -73,7 +122,11 @@ const struct dfi_text_index *           dfi_text_index_from_pointer
 
 const gchar *                           dfi_text_index_get_string                       (const struct dfi_index           *dfi,
                                                                                          const struct dfi_text_index      *text_index,
-                                                                                         dfi_id                            id);
+                                                                                         guint                             id);
+const gchar *                           dfi_text_index_get_string_with_length           (const struct dfi_index           *dfi,
+                                                                                         const struct dfi_text_index      *text_index,
+                                                                                         guint                             id,
+                                                                                         gsize                            *length);
 
 const struct dfi_text_index_item *      dfi_text_index_binary_search                    (const struct dfi_index           *dfi,
                                                                                          const struct dfi_text_index      *text_index,
@@ -86,6 +139,107 @@ const dfi_id *                          dfi_text_index_get_ids_for_exact_match
                                                                                          const struct dfi_text_index      *index,
                                                                                          const gchar                      *string,
                                                                                          gint                             *n_results);
+const dfi_id *                          dfi_text_index_get_ids_for_word                 (const struct dfi_index           *dfi,
+                                                                                         const struct dfi_text_index      *index,
+                                                                                         const gchar                      *word,
+                                                                                         gint                             *n_results);
+guint *                                 dfi_text_index_search                           (const struct dfi_index           *dfi,
+                                                                                         const struct dfi_text_index      *index,
+                                                                                         const gchar                      *query,
+                                                                                         gint                             *n_results);
+guint *                                 dfi_text_index_fuzzy_search                     (const struct dfi_index           *dfi,
+                                                                                         const struct dfi_text_index      *index,
+                                                                                         const gchar                      *query,
+                                                                                         guint                             max_distance,
+                                                                                         gint                             *n_results);
+guint *                                 dfi_text_index_fuzzy_match                      (const struct dfi_index           *dfi,
+                                                                                         const struct dfi_text_index      *index,
+                                                                                         const gchar                      *word,
+                                                                                         guint                             max_distance,
+                                                                                         gint                             *n_items);
+void                                    dfi_text_index_prepare_fuzzy_match              (const struct dfi_index           *dfi,
+                                                                                         const struct dfi_text_index      *index);
+
+const struct dfi_suffix_array *         dfi_suffix_array_from_pointer                   (const struct dfi_index           *dfi,
+                                                                                         dfi_pointer                       pointer);
+const struct dfi_text_index *           dfi_suffix_array_get_text_index                 (const struct dfi_index           *dfi,
+                                                                                         const struct dfi_suffix_array    *suffix_array);
+guint *                                 dfi_suffix_array_search                         (const struct dfi_index           *dfi,
+                                                                                         const struct dfi_suffix_array    *suffix_array,
+                                                                                         const gchar                      *substring,
+                                                                                         gint                             *n_items);
+
+const struct dfi_position_table *       dfi_position_table_from_pointer                 (const struct dfi_index           *dfi,
+                                                                                         dfi_pointer                       pointer);
+const struct dfi_text_index *           dfi_position_table_get_text_index               (const struct dfi_index           *dfi,
+                                                                                         const struct dfi_position_table  *table);
+gint                                    dfi_position_table_get_positions                (const struct dfi_index           *dfi,
+                                                                                         const struct dfi_position_table  *table,
+                                                                                         guint                             id,
+                                                                                         guint                             entry,
+                                                                                         guint                            *positions,
+                                                                                         gint                              max_positions);
+guint *                                 dfi_position_table_phrase_search                (const struct dfi_index           *dfi,
+                                                                                         const struct dfi_position_table  *table,
+                                                                                         const gchar                      *phrase,
+                                                                                         guint                             slop,
+                                                                                         gint                             *n_results);
+
+typedef void (* DfiTokenDictionaryFunc) (const gchar  *token,
+                                         gsize         length,
+                                         const dfi_id *ids,
+                                         gint          n_ids,
+                                         gpointer      user_data);
+
+const struct dfi_token_dictionary *     dfi_token_dictionary_from_pointer               (const struct dfi_index            *dfi,
+                                                                                         dfi_pointer                        pointer);
+guint                                   dfi_token_dictionary_get_length                 (const struct dfi_token_dictionary *dictionary,
+                                                                                         const struct dfi_index            *dfi);
+const dfi_id *                          dfi_token_dictionary_get_ids_for_exact_match    (const struct dfi_index            *dfi,
+                                                                                         const struct dfi_token_dictionary *dictionary,
+                                                                                         const gchar                       *string,
+                                                                                         gint                              *n_results);
+void                                    dfi_token_dictionary_foreach_prefix             (const struct dfi_index            *dfi,
+                                                                                         const struct dfi_token_dictionary *dictionary,
+                                                                                         const gchar                       *prefix,
+                                                                                         DfiTokenDictionaryFunc             func,
+                                                                                         gpointer                           user_data);
+guint *                                 dfi_token_dictionary_search                     (const struct dfi_index            *dfi,
+                                                                                         const struct dfi_token_dictionary *dictionary,
+                                                                                         const gchar                       *query,
+                                                                                         gint                              *n_results);
+
+const struct dfi_app_summary *          dfi_app_summary_from_pointer                    (const struct dfi_index           *dfi,
+                                                                                         dfi_pointer                       pointer);
+guint                                   dfi_app_summary_get_length                      (const struct dfi_app_summary     *summary);
+const gchar *                           dfi_app_summary_get_icon                        (const struct dfi_app_summary     *summary,
+                                                                                         const struct dfi_index           *dfi,
+                                                                                         guint                             app);
+const gchar *                           dfi_app_summary_get_exec                        (const struct dfi_app_summary     *summary,
+                                                                                         const struct dfi_index           *dfi,
+                                                                                         guint                             app);
+guint                                   dfi_app_summary_get_flags                       (const struct dfi_app_summary     *summary,
+                                                                                         guint                             app);
+
+const struct dfi_name_column *          dfi_name_column_from_pointer                    (const struct dfi_index           *dfi,
+                                                                                         dfi_pointer                       pointer);
+const gchar *                           dfi_name_column_get_name                        (const struct dfi_name_column     *column,
+                                                                                         const struct dfi_index           *dfi,
+                                                                                         guint                             app);
+
+const struct dfi_app_flags *            dfi_app_flags_from_pointer                      (const struct dfi_index           *dfi,
+                                                                                         dfi_pointer                       pointer);
+gboolean                                dfi_app_flags_get                               (const struct dfi_app_flags       *flags,
+                                                                                         guint                             flag,
+                                                                                         guint                             app);
+void                                    dfi_app_flags_mask                              (const struct dfi_app_flags       *flags,
+                                                                                         guint                             flag,
+                                                                                         gboolean                          value,
+                                                                                         guint32                          *mask,
+                                                                                         guint                             n_words);
+
+const struct dfi_show_in *              dfi_show_in_from_pointer                        (const struct dfi_index           *dfi,
+                                                                                         dfi_pointer                       pointer);
 
 const struct dfi_keyfile *              dfi_keyfile_from_pointer                        (const struct dfi_index           *dfi,
                                                                                          dfi_pointer                       pointer);
@@ -93,6 +247,9 @@ const struct dfi_keyfile *              dfi_keyfile_from_pointer
 const struct dfi_keyfile_group *        dfi_keyfile_get_groups                          (const struct dfi_keyfile         *file,
                                                                                          const struct dfi_index           *dfi,
                                                                                          gint                             *n_groups);
+const struct dfi_keyfile_group *        dfi_keyfile_group_array_get                     (const struct dfi_keyfile_group   *groups,
+                                                                                         const struct dfi_index           *dfi,
+                                                                                         gint                              i);
 const gchar *                           dfi_keyfile_group_get_name                      (const struct dfi_keyfile_group   *group,
                                                                                          const struct dfi_index           *dfi);
 
@@ -100,9 +257,21 @@ const struct dfi_keyfile_item *         dfi_keyfile_group_get_items
                                                                                          const struct dfi_index           *dfi,
                                                                                          const struct dfi_keyfile         *file,
                                                                                          gint                             *n_items);
+const struct dfi_keyfile_item *         dfi_keyfile_item_array_get                      (const struct dfi_keyfile_item    *items,
+                                                                                         const struct dfi_index           *dfi,
+                                                                                         gint                              i);
 const gchar *                           dfi_keyfile_item_get_key                        (const struct dfi_keyfile_item    *item,
                                                                                          const struct dfi_index           *dfi);
 const gchar *                           dfi_keyfile_item_get_locale                     (const struct dfi_keyfile_item    *item,
                                                                                          const struct dfi_index           *dfi);
 const gchar *                           dfi_keyfile_item_get_value                      (const struct dfi_keyfile_item    *item,
                                                                                          const struct dfi_index           *dfi);
+const gchar *                           dfi_keyfile_item_get_value_with_length          (const struct dfi_keyfile_item    *item,
+                                                                                         const struct dfi_index           *dfi,
+                                                                                         gsize                            *length);
+const gchar *                           dfi_keyfile_group_get_value                     (const struct dfi_keyfile_group   *group,
+                                                                                         const struct dfi_index           *dfi,
+                                                                                         const struct dfi_keyfile         *file,
+                                                                                         guint                             key_id,
+                                                                                         const guint                      *locale_ids,
+                                                                                         gint                              n_locale_ids);
@@ -0,0 +1,443 @@
+#include "dfi-tokenizer.h"
+
+#include <string.h>
+
+/* Splitting of text into folded tokens.  This is used by compile to
+ * build the text indexes and by readers to turn queries into tokens, so
+ * that the two always agree.
+ *
+ * A token is a maximal run of alphanumeric characters (but see
+ * dfi_tokenizer_emit_cjk() for CJK text).  It is folded by
+ * NFKC normalisation, then replacing the Turkish dotted and dotless i
+ * by a plain 'i' and then case folding.
+ *
+ * For ASCII, all of that comes down to mapping A-Z to a-z.  Nearly all
+ * queries (and most of the C locale) are ASCII, so that case is handled
+ * with a table and without any allocation.
+ *
+ * Splitting many strings (as compile does) is best done with a
+ * DfiTokenizer.  It has a scratch buffer for long ASCII tokens and
+ * remembers the folded form of every other token, since the same words
+ * come up again and again (eg: untranslated values are indexed once
+ * for every locale).
+ *
+ * To allow searches to ignore accents, compile also indexes each token
+ * that has accents under its unaccented form (see
+ * dfi_tokenizer_unaccent()) and readers look up the unaccented form of
+ * queries.
+ */
+
+struct _DfiTokenizer
+{
+  DfiTokenizerFlags  flags;
+  GString           *scratch;
+  GHashTable        *folded;    /* token -> "folded\0unaccented\0" */
+};
+
+/* The folded form of each ASCII alphanumeric character, or 0 */
+static const gchar dfi_tokenizer_ascii_table[128] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 0, 0, 0, 0, 0, 0,
+  0, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o',
+  'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z', 0, 0, 0, 0, 0,
+  0, 'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n', 'o',
+  'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z', 0, 0, 0, 0, 0,
+};
+
+gchar *
+dfi_tokenizer_fold (const gchar *token,
+                    gssize       length)
+{
+  gchar *normal;
+  gchar *result;
+
+  if (length < 0)
+    length = strlen (token);
+
+  result = g_malloc (length + 1);
+  if (dfi_tokenizer_fold_ascii (token, length, result) == length)
+    return result;
+
+  g_free (result);
+
+  normal = g_utf8_normalize (token, length, G_NORMALIZE_ALL_COMPOSE);
+
+  /* TODO: Invent time machine.  Converse with Mustafa Ataturk... */
+  if (strstr (normal, "ı") || strstr (normal, "İ"))
+    {
+      gchar *s = normal;
+      GString *tmp;
+
+      tmp = g_string_new (NULL);
+
+      while (*s)
+        {
+          gchar *i, *I, *e;
+
+          i = strstr (s, "ı");
+          I = strstr (s, "İ");
+
+          if (!i && !I)
+            break;
+          else if (i && !I)
+            e = i;
+          else if (I && !i)
+            e = I;
+          else if (i < I)
+            e = i;
+          else
+            e = I;
+
+          g_string_append_len (tmp, s, e - s);
+          g_string_append_c (tmp, 'i');
+          s = g_utf8_next_char (e);
+        }
+
+      g_string_append (tmp, s);
+      g_free (normal);
+      normal = g_string_free (tmp, FALSE);
+    }
+
+  result = g_utf8_casefold (normal, -1);
+  g_free (normal);
+
+  return result;
+}
+
+/* Removes accents from an already-folded token, giving a new string, or
+ * NULL if there were none.  Only the combining marks on Latin, Greek
+ * and Cyrillic letters are considered to be accents.  In other scripts,
+ * they are often vowels, which really do make a different word.
+ */
+gchar *
+dfi_tokenizer_unaccent (const gchar *folded)
+{
+  GUnicodeScript script;
+  gboolean changed;
+  gchar *decomposed;
+  gchar *result;
+  const gchar *s;
+  GString *tmp;
+
+  for (s = folded; *s; s++)
+    if ((guchar) *s >= 0x80)
+      break;
+
+  if (*s == '\0')
+    return NULL;
+
+  decomposed = g_utf8_normalize (folded, -1, G_NORMALIZE_DEFAULT);
+  tmp = g_string_new (NULL);
+  script = G_UNICODE_SCRIPT_COMMON;
+  changed = FALSE;
+
+  for (s = decomposed; *s; s = g_utf8_next_char (s))
+    {
+      gunichar c = g_utf8_get_char (s);
+
+      if (g_unichar_type (c) != G_UNICODE_NON_SPACING_MARK)
+        script = g_unichar_get_script (c);
+
+      else if (script == G_UNICODE_SCRIPT_LATIN ||
+               script == G_UNICODE_SCRIPT_GREEK ||
+               script == G_UNICODE_SCRIPT_CYRILLIC)
+        {
+          changed = TRUE;
+          continue;
+        }
+
+      g_string_append_unichar (tmp, c);
+    }
+
+  if (changed)
+    result = g_utf8_normalize (tmp->str, tmp->len, G_NORMALIZE_ALL_COMPOSE);
+  else
+    result = NULL;
+
+  g_string_free (tmp, TRUE);
+  g_free (decomposed);
+
+  return result;
+}
+
+/* Folds a token made only of ASCII alphanumerics into buffer, which
+ * must have room for length + 1 bytes.  Returns the length, or 0 if the
+ * token contains anything else (in which case dfi_tokenizer_fold() must
+ * be used instead).
+ */
+gsize
+dfi_tokenizer_fold_ascii (const gchar *token,
+                          gsize        length,
+                          gchar       *buffer)
+{
+  gsize i;
+
+  for (i = 0; i < length; i++)
+    {
+      guchar c = token[i];
+
+      if (c >= 0x80 || !dfi_tokenizer_ascii_table[c])
+        return 0;
+
+      buffer[i] = dfi_tokenizer_ascii_table[c];
+    }
+
+  buffer[length] = '\0';
+
+  return length;
+}
+
+DfiTokenizer *
+dfi_tokenizer_new (DfiTokenizerFlags flags)
+{
+  DfiTokenizer *tokenizer;
+
+  tokenizer = g_slice_new (DfiTokenizer);
+  tokenizer->flags = flags;
+  tokenizer->scratch = g_string_new (NULL);
+  tokenizer->folded = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+
+  return tokenizer;
+}
+
+void
+dfi_tokenizer_free (DfiTokenizer *tokenizer)
+{
+  g_string_free (tokenizer->scratch, TRUE);
+  g_hash_table_unref (tokenizer->folded);
+
+  g_slice_free (DfiTokenizer, tokenizer);
+}
+
+static void
+dfi_tokenizer_emit (DfiTokenizer     *tokenizer,
+                    const gchar      *start,
+                    const gchar      *end,
+                    gboolean          ascii,
+                    gchar            *buffer,
+                    guint             position,
+                    DfiTokenizerFunc  func,
+                    gpointer          user_data)
+{
+  gsize length = end - start;
+  gchar *folded;
+
+  if (ascii && length <= DFI_TOKENIZER_MAX_SHORT_TOKEN)
+    {
+      dfi_tokenizer_fold_ascii (start, length, buffer);
+      (* func) (buffer, length, position, user_data);
+      return;
+    }
+
+  if (tokenizer == NULL)
+    {
+      folded = dfi_tokenizer_fold (start, length);
+      (* func) (folded, strlen (folded), position, user_data);
+      g_free (folded);
+      return;
+    }
+
+  g_string_set_size (tokenizer->scratch, length);
+
+  if (ascii)
+    {
+      dfi_tokenizer_fold_ascii (start, length, tokenizer->scratch->str);
+      (* func) (tokenizer->scratch->str, length, position, user_data);
+      return;
+    }
+
+  memcpy (tokenizer->scratch->str, start, length);
+
+  folded = g_hash_table_lookup (tokenizer->folded, tokenizer->scratch->str);
+  if (folded == NULL)
+    {
+      gchar *unaccented = NULL;
+      gsize folded_length;
+      gchar *tmp;
+
+      tmp = dfi_tokenizer_fold (start, length);
+      folded_length = strlen (tmp);
+
+      if (tokenizer->flags & DFI_TOKENIZER_FLAGS_UNACCENTED)
+        unaccented = dfi_tokenizer_unaccent (tmp);
+
+      folded = g_malloc (folded_length + 1 + (unaccented ? strlen (unaccented) : 0) + 1);
+      strcpy (folded, tmp);
+      strcpy (folded + folded_length + 1, unaccented ? unaccented : "");
+      g_hash_table_insert (tokenizer->folded, g_strndup (start, length), folded);
+
+      g_free (unaccented);
+      g_free (tmp);
+    }
+
+  length = strlen (folded);
+  (* func) (folded, length, position, user_data);
+
+  if (folded[length + 1])
+    (* func) (folded + length + 1, strlen (folded + length + 1), position, user_data);
+}
+
+enum
+{
+  DFI_TOKENIZER_CHAR_OTHER,
+  DFI_TOKENIZER_CHAR_WORD,
+  DFI_TOKENIZER_CHAR_CJK
+};
+
+static gint
+dfi_tokenizer_classify (gunichar c)
+{
+  if (!g_unichar_isalnum (c))
+    return DFI_TOKENIZER_CHAR_OTHER;
+
+  switch (g_unichar_get_script (c))
+    {
+    case G_UNICODE_SCRIPT_HAN:
+    case G_UNICODE_SCRIPT_HIRAGANA:
+    case G_UNICODE_SCRIPT_KATAKANA:
+    case G_UNICODE_SCRIPT_HANGUL:
+      return DFI_TOKENIZER_CHAR_CJK;
+
+    default:
+      break;
+    }
+
+  /* Iteration and prolonged sound marks are "common" to several scripts,
+   * but they only ever appear within CJK text.
+   */
+  if (c == 0x3005 || c == 0x30fc || c == 0xff70 || c == 0xff9e || c == 0xff9f)
+    return DFI_TOKENIZER_CHAR_CJK;
+
+  return DFI_TOKENIZER_CHAR_WORD;
+}
+
+/* CJK text has no spaces between words, so a run of CJK characters is
+ * split into overlapping pairs of characters (bigrams) instead.  A
+ * query then matches if all of its bigrams do.  A run of a single
+ * character is a token by itself, and with
+ * DFI_TOKENIZER_FLAGS_CJK_UNIGRAMS every single character of a longer
+ * run is also given, so that one-character queries find it.
+ *
+ * Each character of the run takes up one position, and the tokens that
+ * start with it are at that position.
+ */
+static guint
+dfi_tokenizer_emit_cjk (DfiTokenizer     *tokenizer,
+                        const gchar      *start,
+                        const gchar      *end,
+                        gchar            *buffer,
+                        guint             position,
+                        DfiTokenizerFunc  func,
+                        gpointer          user_data)
+{
+  gboolean unigrams;
+  const gchar *a, *b;
+  guint n = 0;
+
+  unigrams = tokenizer && (tokenizer->flags & DFI_TOKENIZER_FLAGS_CJK_UNIGRAMS);
+
+  a = start;
+  b = g_utf8_next_char (a);
+
+  if (b == end)
+    {
+      dfi_tokenizer_emit (tokenizer, a, b, FALSE, buffer, position, func, user_data);
+      return 1;
+    }
+
+  while (b < end)
+    {
+      const gchar *c = g_utf8_next_char (b);
+
+      if (unigrams)
+        dfi_tokenizer_emit (tokenizer, a, b, FALSE, buffer, position + n, func, user_data);
+
+      dfi_tokenizer_emit (tokenizer, a, c, FALSE, buffer, position + n, func, user_data);
+
+      a = b;
+      b = c;
+      n++;
+    }
+
+  if (unigrams)
+    dfi_tokenizer_emit (tokenizer, a, b, FALSE, buffer, position + n, func, user_data);
+
+  return n + 1;
+}
+
+/* Returns the number of positions taken up */
+static guint
+dfi_tokenizer_flush (DfiTokenizer     *tokenizer,
+                     gint              kind,
+                     const gchar      *start,
+                     const gchar      *end,
+                     gboolean          ascii,
+                     gchar            *buffer,
+                     guint             position,
+                     DfiTokenizerFunc  func,
+                     gpointer          user_data)
+{
+  if (kind == DFI_TOKENIZER_CHAR_WORD)
+    {
+      dfi_tokenizer_emit (tokenizer, start, end, ascii, buffer, position, func, user_data);
+      return 1;
+    }
+
+  else if (kind == DFI_TOKENIZER_CHAR_CJK)
+    return dfi_tokenizer_emit_cjk (tokenizer, start, end, buffer, position, func, user_data);
+
+  return 0;
+}
+
+/* Calls func for each folded token in string, in order.  The token is
+ * only valid for the duration of the call.  tokenizer may be NULL.
+ *
+ * The position counts words from 0.  Other forms of the same word (eg:
+ * unaccented) are given at the same position.
+ */
+void
+dfi_tokenizer_split (DfiTokenizer     *tokenizer,
+                     const gchar      *string,
+                     DfiTokenizerFunc  func,
+                     gpointer          user_data)
+{
+  gchar buffer[DFI_TOKENIZER_MAX_SHORT_TOKEN + 1];
+  gint kind = DFI_TOKENIZER_CHAR_OTHER;
+  const gchar *start = NULL;
+  gboolean ascii = TRUE;
+  guint position = 0;
+  const gchar *next;
+  const gchar *s;
+
+  for (s = string; *s; s = next)
+    {
+      guchar c = *s;
+      gint char_kind;
+
+      if (c < 0x80)
+        {
+          char_kind = dfi_tokenizer_ascii_table[c] ? DFI_TOKENIZER_CHAR_WORD : DFI_TOKENIZER_CHAR_OTHER;
+          next = s + 1;
+        }
+      else
+        {
+          char_kind = dfi_tokenizer_classify (g_utf8_get_char (s));
+          next = g_utf8_next_char (s);
+        }
+
+      if (char_kind != kind)
+        {
+          position += dfi_tokenizer_flush (tokenizer, kind, start, s, ascii, buffer, position, func, user_data);
+          kind = char_kind;
+          start = s;
+          ascii = TRUE;
+        }
+
+      if (c >= 0x80)
+        ascii = FALSE;
+    }
+
+  dfi_tokenizer_flush (tokenizer, kind, start, s, ascii, buffer, position, func, user_data);
+}
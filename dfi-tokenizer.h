@@ -0,0 +1,36 @@
+#include <glib.h>
+
+/* Tokens up to this many bytes long are folded without allocating */
+#define DFI_TOKENIZER_MAX_SHORT_TOKEN   63
+
+typedef struct _DfiTokenizer DfiTokenizer;
+
+typedef enum
+{
+  DFI_TOKENIZER_FLAGS_NONE         = 0,
+  DFI_TOKENIZER_FLAGS_UNACCENTED   = (1 << 0),  /* also give the unaccented form of tokens */
+  DFI_TOKENIZER_FLAGS_CJK_UNIGRAMS = (1 << 1)   /* also give single CJK characters */
+} DfiTokenizerFlags;
+
+typedef void (* DfiTokenizerFunc) (const gchar *token,
+                                   gsize        length,
+                                   guint        position,
+                                   gpointer     user_data);
+
+DfiTokenizer *          dfi_tokenizer_new                               (DfiTokenizerFlags flags);
+
+void                    dfi_tokenizer_free                              (DfiTokenizer     *tokenizer);
+
+gchar *                 dfi_tokenizer_fold                              (const gchar      *token,
+                                                                         gssize            length);
+
+gchar *                 dfi_tokenizer_unaccent                          (const gchar      *folded);
+
+gsize                   dfi_tokenizer_fold_ascii                        (const gchar      *token,
+                                                                         gsize             length,
+                                                                         gchar            *buffer);
+
+void                    dfi_tokenizer_split                             (DfiTokenizer     *tokenizer,
+                                                                         const gchar      *string,
+                                                                         DfiTokenizerFunc  func,
+                                                                         gpointer          user_data);
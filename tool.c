@@ -19,8 +19,8 @@ main (void)
 
 #if 0
   locales = dfi_index_get_locale_names (dfi);
-  g_print ("%d locales\n", dfi_string_list_get_length (locales));
-  n = dfi_string_list_get_length (locales);
+  g_print ("%d locales\n", dfi_string_list_get_length (locales, dfi));
+  n = dfi_string_list_get_length (locales, dfi);
   for (i = 0; i < n; i++)
     g_print ("  %s\n", dfi_string_list_get_string_at_index (locales, dfi, i));
   g_print ("\n\n");
@@ -48,14 +48,14 @@ main (void)
           const struct dfi_keyfile_item *items;
           gint n_items, k;
 
-          g_print ("  [%s]\n", dfi_keyfile_group_get_name (&groups[j], dfi));
-          items = dfi_keyfile_group_get_items (&groups[j], dfi, kf, &n_items);
+          g_print ("  [%s]\n", dfi_keyfile_group_get_name (dfi_keyfile_group_array_get (groups, dfi, j), dfi));
+          items = dfi_keyfile_group_get_items (dfi_keyfile_group_array_get (groups, dfi, j), dfi, kf, &n_items);
 
           for (k = 0; k < n_items; k++)
             {
-              const gchar *key = dfi_keyfile_item_get_key (&items[k], dfi);
-              const gchar *locale = dfi_keyfile_item_get_locale (&items[k], dfi);
-              const gchar *value = dfi_keyfile_item_get_value (&items[k], dfi);
+              const gchar *key = dfi_keyfile_item_get_key (dfi_keyfile_item_array_get (items, dfi, k), dfi);
+              const gchar *locale = dfi_keyfile_item_get_locale (dfi_keyfile_item_array_get (items, dfi, k), dfi);
+              const gchar *value = dfi_keyfile_item_get_value (dfi_keyfile_item_array_get (items, dfi, k), dfi);
 
               if (locale[0])
                 {
@@ -77,17 +77,17 @@ main (void)
 
   gint n_ids;
   guint64 start_time = g_get_monotonic_time();
-  const dfi_id * ids = dfi_text_index_get_ids_for_exact_match (dfi, text_index, "système", &n_ids);
+  const dfi_id * ids = dfi_text_index_get_ids_for_word (dfi, text_index, "systeme", &n_ids);
   g_print ("%d\n", (gint)(g_get_monotonic_time()- start_time));
   g_print ("got %d\n", n_ids);
-  g_print ("%s %s %s\n", dfi_string_list_get_string (dfi_index_get_app_names (dfi), dfi, ids[0]),
-                         dfi_string_list_get_string (dfi_index_get_group_names (dfi), dfi, ids[1]),
-                         dfi_string_list_get_string (dfi_index_get_key_names (dfi), dfi, ids[2]));
+  g_print ("%s %s %s\n", dfi_string_list_get_string (dfi_index_get_app_names (dfi), dfi, dfi_id_array_get (ids, dfi, 0)),
+                         dfi_string_list_get_string (dfi_index_get_group_names (dfi), dfi, dfi_id_array_get (ids, dfi, 1)),
+                         dfi_string_list_get_string (dfi_index_get_key_names (dfi), dfi, dfi_id_array_get (ids, dfi, 2)));
 
   for (i = 0; i < n_ids / 3; i++)
     {
-      const gchar *key = dfi_string_list_get_string (dfi_index_get_app_names (dfi), dfi, ids[3*i]);
-      const struct dfi_keyfile *kf = dfi_keyfile_from_pointer (dfi, dfi_pointer_array_get_pointer (dfs, dfi_id_get(ids[3*i])));
+      const gchar *key = dfi_string_list_get_string (dfi_index_get_app_names (dfi), dfi, dfi_id_array_get (ids, dfi, 3*i));
+      const struct dfi_keyfile *kf = dfi_keyfile_from_pointer (dfi, dfi_pointer_array_get_pointer (dfs, dfi_id_array_get (ids, dfi, 3*i)));
       const struct dfi_keyfile_group *groups;
       gint n_groups, j;
 
@@ -99,14 +99,14 @@ main (void)
           const struct dfi_keyfile_item *items;
           gint n_items, k;
 
-     //     g_print ("  [%s]\n", dfi_keyfile_group_get_name (&groups[j], dfi));
-          items = dfi_keyfile_group_get_items (&groups[j], dfi, kf, &n_items);
+     //     g_print ("  [%s]\n", dfi_keyfile_group_get_name (dfi_keyfile_group_array_get (groups, dfi, j), dfi));
+          items = dfi_keyfile_group_get_items (dfi_keyfile_group_array_get (groups, dfi, j), dfi, kf, &n_items);
 
           for (k = 0; k < n_items; k++)
             {
-              const gchar *key = dfi_keyfile_item_get_key (&items[k], dfi);
-              const gchar *locale = dfi_keyfile_item_get_locale (&items[k], dfi);
-              const gchar *value = dfi_keyfile_item_get_value (&items[k], dfi);
+              const gchar *key = dfi_keyfile_item_get_key (dfi_keyfile_item_array_get (items, dfi, k), dfi);
+              const gchar *locale = dfi_keyfile_item_get_locale (dfi_keyfile_item_array_get (items, dfi, k), dfi);
+              const gchar *value = dfi_keyfile_item_get_value (dfi_keyfile_item_array_get (items, dfi, k), dfi);
 
               if (locale[0])
                 {
@@ -121,5 +121,8 @@ main (void)
         }
       
     }
+
+  dfi_index_free (dfi);
+
   return 0;
 }